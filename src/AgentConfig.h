@@ -0,0 +1,400 @@
+#ifndef AGENT_CONFIG_H
+#define AGENT_CONFIG_H
+
+#include <Arduino.h>
+#include <Blueprint.h>
+#include <ConfigParser.h>
+#include <TopicRouter.h>
+#include <Value.h>
+#include <memory>
+#include <vector>
+
+namespace Agent {
+// Config entries by blueprint slot, `used` tells the slots the config fills.
+// Values are kept decoded, as their slot declares.
+struct param {
+  bool used;
+  int id;
+  Value value;
+  // Route of `param/<id>`
+  Subscription route;
+};
+
+struct input {
+  bool used;
+  int id;
+  int src;
+  Value value;
+  // Routes of `pin/<id>`, `pin/<id>/src` and `pin/<src>`
+  Subscription route;
+  Subscription srcRoute;
+  Subscription source;
+};
+
+struct Config {
+  int id;
+  // Sized to the blueprint once, routes keep indices into them
+  std::vector<param> params;
+  std::vector<input> inputs;
+  std::vector<int> outputs;
+};
+
+// What applying a config changed, per kind of slot
+typedef struct {
+  unsigned int added;
+  unsigned int removed;
+  // Given another entry, value or source
+  unsigned int updated;
+  unsigned int unchanged;
+} EntryChanges;
+
+typedef struct {
+  EntryChanges params;
+  EntryChanges inputs;
+  bool outputs;
+} ConfigChanges;
+
+namespace {
+void dumpEntryChanges(Print &out, const EntryChanges &entries) {
+  out.print("{\"added\":");
+  out.print(entries.added);
+  out.print(",\"removed\":");
+  out.print(entries.removed);
+  out.print(",\"updated\":");
+  out.print(entries.updated);
+  out.print(",\"unchanged\":");
+  out.print(entries.unchanged);
+  out.print("}");
+}
+}; // namespace
+
+// The topic the config of the agent at `index` comes on. The first agent
+// goes by the MAC address alone, as single agent builds do.
+String identityOf(const String &mac, size_t index) {
+  return index == 0 ? mac : mac + "-" + String((unsigned int)index);
+}
+
+// The payload asking for the config of the agent at `index`. Past the first
+// agent, whose blueprint the device announces when provisioned, it names
+// its blueprint too, as `<identity>|<blueprint>`.
+String configRequestOf(const String &mac, size_t index,
+                       const char *blueprint) {
+  auto request = identityOf(mac, index);
+  if (index != 0) {
+    request += "|";
+    request += blueprint;
+  }
+  return request;
+}
+
+// What a config is bound to: the routes of its topics and the slots of the
+// agent type. Agents bind to the client.
+class Binder {
+public:
+  virtual ~Binder() {}
+  virtual Subscription subscribe(const char *topic, TopicHandler handler) = 0;
+  virtual void unsubscribe(const Subscription &subscription) = 0;
+  // A broker subscription without a handler, see ::hold()
+  virtual void hold(const char *filter) = 0;
+  virtual void release(const char *filter) = 0;
+  virtual const ValueSpec &paramType(size_t slot) const = 0;
+  virtual const ValueSpec &inputType(size_t slot) const = 0;
+  virtual void invokeParam(size_t slot, const Value &value) = 0;
+  virtual void invokeInput(size_t slot, const Value &value) = 0;
+};
+
+// Hands values to the slots of an agent type T, as its blueprint
+// T::blueprint() declares them, on top of the Binder B
+template <typename T, typename B> class Slots : public B {
+protected:
+  const ValueSpec &paramType(size_t slot) const override {
+    return T::blueprint().params[slot].value;
+  }
+  const ValueSpec &inputType(size_t slot) const override {
+    return T::blueprint().inputs[slot].value;
+  }
+  void invokeParam(size_t slot, const Value &value) override {
+    (static_cast<T *>(this)->*T::blueprint().params[slot].handler)(value);
+  }
+  void invokeInput(size_t slot, const Value &value) override {
+    (static_cast<T *>(this)->*T::blueprint().inputs[slot].handler)(value);
+  }
+};
+
+// The config an agent runs on. New ones are merged into it slot by slot, so
+// only the entries that differ touch the routes or the handlers.
+class AppliedConfig {
+private:
+  Binder &binder;
+  std::unique_ptr<Config> config = nullptr;
+  bool holdingPins = false;
+  ConfigChanges changes = {};
+
+  // Decodes a value as the slot declares, once, where it comes in. Values
+  // that do not decode are logged and come out unset.
+  static Value decode(const ValueSpec &spec, const char *text, size_t len) {
+    Value value;
+    if (!decodeValue(spec, text, len, value)) {
+      Serial.print("Invalid value: ");
+      Serial.println(String(text, len));
+    }
+    return value;
+  }
+
+  static Value decode(const ValueSpec &spec, const TextView &text) {
+    if (text.escaped) {
+      auto unescaped = text.toString();
+      return decode(spec, unescaped.c_str(), unescaped.length());
+    }
+    return decode(spec, text.data, text.len);
+  }
+
+  // Handlers keep the live value, a config only has to hand over the
+  // values that differ from it
+  TopicHandler paramHandler(size_t slot) {
+    return [this, slot](const char *text, size_t len) {
+      auto value = decode(binder.paramType(slot), text, len);
+      if (value.isSet()) {
+        config->params[slot].value = value;
+        binder.invokeParam(slot, value);
+      }
+    };
+  }
+
+  TopicHandler inputHandler(size_t slot) {
+    return [this, slot](const char *text, size_t len) {
+      auto value = decode(binder.inputType(slot), text, len);
+      if (value.isSet()) {
+        config->inputs[slot].value = value;
+        binder.invokeInput(slot, value);
+      }
+    };
+  }
+
+  // Points the input at another source. The new one is taken before the
+  // old one is let go, so rebinding to the same source keeps its
+  // subscription.
+  void bindSource(size_t slot, int src) {
+    auto &input = config->inputs[slot];
+    auto previous = input.source;
+    input.source = Subscription();
+    if (src != 0) {
+      input.source = binder.subscribe(("pin/" + String(src)).c_str(),
+                                      inputHandler(slot));
+    }
+    binder.unsubscribe(previous);
+    input.src = src;
+  }
+
+  TopicHandler sourceHandler(size_t slot) {
+    return [this, slot](const char *json, size_t len) {
+      ParamView src;
+      if (!parseParam(json, len, src)) {
+        Serial.println("Failed to parse config");
+        return;
+      }
+
+      auto value = decode(binder.inputType(slot), src.value);
+      if (src.id && value.isSet()) {
+        auto &input = config->inputs[slot];
+        input.value = value;
+        binder.invokeInput(slot, value);
+      }
+      bindSource(slot, src.id);
+    };
+  }
+
+  // Empties the slot, its routes are let go of later on
+  static void vacate(param &param, std::vector<Subscription> &routes) {
+    routes.push_back(param.route);
+    param = {};
+  }
+
+  static void vacate(input &input, std::vector<Subscription> &routes) {
+    routes.push_back(input.route);
+    routes.push_back(input.srcRoute);
+    routes.push_back(input.source);
+    input = {};
+  }
+
+public:
+  explicit AppliedConfig(Binder &binder) : binder(binder) {}
+  ~AppliedConfig() { clear(); }
+
+  // Brings the config in line with `json`, slot by slot. Only the slots
+  // that differ are touched: filled ones are subscribed to and handed their
+  // value, emptied ones are unsubscribed from, and kept ones only see their
+  // handler again when their live value differs. Values that do not decode
+  // leave their slot bound, but unset. A config that is not valid for the
+  // blueprint changes nothing.
+  ConfigError load(const char *json, size_t len, const Blueprint &limits) {
+    auto error = checkConfig(json, len, limits);
+    if (error != ConfigError::None) {
+      return error;
+    }
+
+    if (config == nullptr) {
+      config = std::make_unique<Config>();
+      config->params.resize(limits.params);
+      config->inputs.resize(limits.inputs);
+    }
+    changes = {};
+
+    // Routes of the entries replaced, let go of last so the topics they
+    // share with the new ones stay subscribed
+    std::vector<Subscription> released;
+    size_t params = 0;
+    size_t inputs = 0;
+    std::vector<int> outputs;
+    auto onParam = [&](const ParamView &view, size_t slot) {
+      params = slot + 1;
+      auto &param = config->params[slot];
+      auto value = decode(binder.paramType(slot), view.value);
+      if (param.used && param.id == view.id) {
+        if (value == param.value) {
+          changes.params.unchanged++;
+          return;
+        }
+        param.value = value;
+        if (value.isSet()) {
+          binder.invokeParam(slot, value);
+        }
+        changes.params.updated++;
+        return;
+      }
+      if (param.used) {
+        vacate(param, released);
+        changes.params.updated++;
+      } else {
+        changes.params.added++;
+      }
+      param.used = true;
+      param.id = view.id;
+      param.value = value;
+      if (value.isSet()) {
+        binder.invokeParam(slot, value);
+      }
+      param.route = binder.subscribe(("param/" + String(view.id)).c_str(),
+                                     paramHandler(slot));
+    };
+    auto onInput = [&](const InputView &view, size_t slot) {
+      inputs = slot + 1;
+      // A single broker subscription for every pin topic, routed locally
+      if (!holdingPins) {
+        binder.hold("pin/#");
+        holdingPins = true;
+      }
+      auto &input = config->inputs[slot];
+      auto value = decode(binder.inputType(slot), view.value);
+      if (input.used && input.id == view.id) {
+        auto updated = false;
+        if (value != input.value) {
+          input.value = value;
+          if (value.isSet()) {
+            binder.invokeInput(slot, value);
+          }
+          updated = true;
+        }
+        if (input.src != view.src) {
+          bindSource(slot, view.src);
+          updated = true;
+        }
+        if (updated) {
+          changes.inputs.updated++;
+        } else {
+          changes.inputs.unchanged++;
+        }
+        return;
+      }
+      if (input.used) {
+        vacate(input, released);
+        changes.inputs.updated++;
+      } else {
+        changes.inputs.added++;
+      }
+      input.used = true;
+      input.id = view.id;
+      input.value = value;
+      if (value.isSet()) {
+        binder.invokeInput(slot, value);
+      }
+      // Inputs may share a source or listen to each other, every one of
+      // them gets its own route
+      bindSource(slot, view.src);
+      input.route = binder.subscribe(("pin/" + String(view.id)).c_str(),
+                                     inputHandler(slot));
+      input.srcRoute =
+          binder.subscribe(("pin/" + String(view.id) + "/src").c_str(),
+                           sourceHandler(slot));
+    };
+    parseConfig(json, len, limits, config->id, onParam, onInput,
+                [&outputs](int output) { outputs.push_back(output); });
+
+    for (auto slot = params; slot < config->params.size(); slot++) {
+      if (config->params[slot].used) {
+        vacate(config->params[slot], released);
+        changes.params.removed++;
+      }
+    }
+    for (auto slot = inputs; slot < config->inputs.size(); slot++) {
+      if (config->inputs[slot].used) {
+        vacate(config->inputs[slot], released);
+        changes.inputs.removed++;
+      }
+    }
+    for (auto &route : released) {
+      binder.unsubscribe(route);
+    }
+    if (holdingPins && inputs == 0) {
+      binder.release("pin/#");
+      holdingPins = false;
+    }
+
+    changes.outputs = outputs != config->outputs;
+    config->outputs = std::move(outputs);
+    return ConfigError::None;
+  }
+
+  // Drops the config and its routes
+  void clear() {
+    std::vector<Subscription> routes;
+    if (config != nullptr) {
+      for (auto &param : config->params) {
+        vacate(param, routes);
+      }
+      for (auto &input : config->inputs) {
+        vacate(input, routes);
+      }
+    }
+    for (auto &route : routes) {
+      binder.unsubscribe(route);
+    }
+    if (holdingPins) {
+      binder.release("pin/#");
+    }
+    holdingPins = false;
+    config = nullptr;
+  }
+
+  bool empty() const { return config == nullptr; }
+  // Of the config, which must not be empty()
+  const Config &get() const { return *config; }
+  const std::vector<int> &outputs() const { return config->outputs; }
+
+  // Of the last config loaded
+  const ConfigChanges &lastChanges() const { return changes; }
+
+  // Writes the changes of the last config as one JSON object
+  void dumpChanges(Print &out) const {
+    out.print("{\"params\":");
+    dumpEntryChanges(out, changes.params);
+    out.print(",\"inputs\":");
+    dumpEntryChanges(out, changes.inputs);
+    out.print(",\"outputs\":");
+    out.print(changes.outputs ? "true" : "false");
+    out.print("}");
+  }
+};
+}; // namespace Agent
+
+#endif
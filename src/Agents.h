@@ -1,374 +1,464 @@
 #ifndef AGENTS_H
 #define AGENTS_H
 
+#include <AgentConfig.h>
 #include <Arduino.h>
-#include <Constants.h>
+#include <Blueprint.h>
+#include <ConfigCache.h>
+#include <ConfigParser.h>
 #include <CustomTasks.h>
-#include <Utils.h>
-#include <functional>
-#include <map>
-#include <memory>
+#include <Value.h>
+#include <atomic>
+#include <iterator>
 #include <mqtt.h>
 #include <vector>
 
-namespace Agent {
-struct param {
-  int id;
-  String value;
-};
+// QoS of the values agents publish, 1 to have them acknowledged and sent
+// again until they are
+#ifndef AGENT_PUBLISH_QOS
+#define AGENT_PUBLISH_QOS 0
+#endif
 
-struct input {
-  int id;
-  int src;
-  String value;
-  std::function<void(const String &s)> handler;
-};
+// Default pins of the agent types, as single agent boards are wired. The
+// LED and the switch share one, see register_agents().
+#define LED_PIN 5
+#define SWITCH_PIN 5
+#define SLIDER_PIN 34
 
-void convertFromJson(JsonVariantConst src, Agent::param &dst) {
-  auto json = src.as<JsonObjectConst>();
-  dst.id = json["id"].as<int>();
-  dst.value = json["value"].as<String>();
-}
+namespace Agent {
+// An agent hosted by the firmware: a blueprint bound to its own pins, with
+// its own config, scope and identity on the broker. Agents share the
+// connection, the scheduler and the topic router.
+class Base : public Binder {
+private:
+  size_t index = 0;
+  AppliedConfig config{*this};
+  // Mirrors `config`, readable from the I/O core
+  std::atomic<bool> configured{false};
+  // Whether the server sent the applied config since boot, as opposed to it
+  // being restored from the cache
+  std::atomic<bool> confirmed{false};
+  // Of the applied config
+  uint32_t appliedHash = 0;
+  ConfigCache cache;
+  // Route of the config topic
+  Subscription configRoute;
+
+  bool loadConfig(const String &s) {
+    Serial.print("Got config: ");
+    Serial.println(s);
+    auto error = config.load(s.c_str(), s.length(), limits());
+    if (error != ConfigError::None) {
+      Serial.print("Invalid config: ");
+      Serial.println(configErrorName(error));
+      return false;
+    }
+    appliedHash = ConfigCache::hash(s);
+    configured.store(true);
+    Serial.print("Config changes: ");
+    config.dumpChanges(Serial);
+    Serial.println();
+    return true;
+  }
 
-void convertFromJson(JsonVariantConst src, Agent::input &dst) {
-  auto json = src.as<JsonObjectConst>();
-  dst.id = json["id"].as<int>();
-  dst.src = json["src"].as<int>();
-  dst.value = json["value"].as<String>();
-}
+protected:
+  // Routes on the shared client
+  Subscription subscribe(const char *topic, TopicHandler handler) override {
+    return ::subscribe(topic, std::move(handler));
+  }
+  void unsubscribe(const Subscription &subscription) override {
+    ::unsubscribe(subscription);
+  }
+  void hold(const char *filter) override { ::hold(filter); }
+  void release(const char *filter) override { ::release(filter); }
+
+  // Hooks of the agent type, with the slot ones of Binder
+  virtual const ValueSpec &outputType(size_t output) const = 0;
+  virtual void _setup() {}
+  virtual void _setupListeners() {}
+
+  const std::vector<int> &outputs() const { return config.outputs(); }
+
+  // Publishes on the output the value its blueprint declares, encoded on
+  // the stack
+  void publishOutput(size_t output, const Value &value) {
+    char topic[16];
+    char payload[VALUE_TEXT_SIZE];
+    snprintf(topic, sizeof(topic), "pin/%d", outputs().at(output));
+    if (encodeValue(outputType(output), value, payload, sizeof(payload)) ==
+        0) {
+      Serial.println("Could not encode output");
+      return;
+    }
+    publish(topic, payload, AGENT_PUBLISH_QOS);
+  }
 
-struct Config {
-  int id;
-  std::map<int, std::function<void(const String &s)>> params;
-  std::map<int, input> inputs;
-  std::vector<int> outputs;
+public:
+  // Tasks that need the applied config. They keep running through broker
+  // outages, what they publish meanwhile is sent once it is back.
+  Tasks::Scope scope;
 
-  Config(int id, std::map<int, std::function<void(const String &s)>> params,
-         std::map<int, input> inputs, std::vector<int> outputs)
-      : id(id), params(params), inputs(inputs), outputs(outputs) {}
-};
+  Base() : scope(nullptr, false) {}
+  virtual ~Base() {}
 
-namespace {
-std::unique_ptr<Config> config = nullptr;
-}; // namespace
+  // Of its blueprint
+  virtual const char *name() const = 0;
+  virtual Blueprint limits() const = 0;
 
-std::vector<std::function<void(const String &s)>> getParamHandlers();
-std::vector<std::function<void(const String &s)>> getInputHandlers();
-void _setup();
-void _reset();
-void _setupListeners();
+  // Called once when registered, the index sets its identity
+  void attach(size_t agent_index) {
+    index = agent_index;
+    cache = ConfigCache(index);
+  }
 
-bool hasConfig() { return config != nullptr; }
+  // The topic its config comes on, see identityOf()
+  String identity() const { return identityOf(WiFi.macAddress(), index); }
+  // What it asks for its config with, see configRequestOf()
+  String configRequest() const {
+    return configRequestOf(WiFi.macAddress(), index, name());
+  }
 
-void setup() { _setup(); }
+  bool hasConfig() const { return configured.load(); }
+  bool isConfirmed() const { return confirmed.load(); }
 
-void reset() {
-  config = nullptr;
-  _reset();
-}
+  // Of the last config applied
+  const ConfigChanges &lastChanges() const { return config.lastChanges(); }
 
-void setupListeners() { _setupListeners(); }
+  // Writes the changes of the last config as one JSON object
+  void dumpChanges(Print &out) const { config.dumpChanges(out); }
 
-void applyConfig(const String &s) {
-  Serial.println("Got config: " + s);
-  StaticJsonDocument<256> doc;
-  auto err = deserializeJson(doc, s);
-  if (err) {
-    Serial.println("Failed to parse config");
-    return;
-  }
+  void setup() { _setup(); }
 
-  int id = doc["id"].as<int>();
-  auto idStr = String(id);
-
-  int idx = 0;
-  auto param_handlers = getParamHandlers();
-  std::map<int, std::function<void(const String &s)>> paramsMap;
-  auto param_arr = doc["params"].as<JsonArrayConst>();
-  for (auto obj : param_arr) {
-    auto param = obj.as<Agent::param>();
-    param_handlers[idx](param.value);
-    paramsMap[param.id] = param_handlers[idx];
-    auto paramId = param.id;
-    subscribe(
-        ("param/" + String(paramId)).c_str(),
-        [paramId](const String &value) { config->params[paramId](value); });
-    idx++;
+  void setupListeners() {
+    if (scope.isActive() || !hasConfig()) {
+      return;
+    }
+    scope.renew();
+    _setupListeners();
   }
 
-  idx = 0;
-  auto input_handlers = getInputHandlers();
-  std::map<int, input> inputsMap;
-  auto input_arr = doc["inputs"].as<JsonArrayConst>();
-  for (auto obj : input_arr) {
-    auto input = obj.as<Agent::input>();
-    input_handlers[idx](input.value);
-    input.handler = input_handlers[idx];
-    inputsMap[input.id] = input;
-    auto inputId = input.id;
-    subscribe(("pin/" + String(inputId)).c_str(),
-              [inputId](const String &value) {
-                config->inputs[inputId].handler(value);
-              });
-    subscribe(("pin/" + String(input.src)).c_str(),
-              [inputId](const String &value) {
-                config->inputs[inputId].handler(value);
-              });
-    subscribe(("pin/" + String(inputId) + "/src").c_str(),
-              [inputId](const String &json) {
-                StaticJsonDocument<256> doc;
-                auto err = deserializeJson(doc, json);
-                if (err) {
-                  Serial.println("Failed to parse config");
-                  return;
-                }
-
-                // Serial.print("Received new source for pin ");
-                // Serial.print(inputId);
-                // Serial.print(" : ");
-                // Serial.println(json);
-
-                auto src = doc.as<Agent::param>();
-                auto &input = config->inputs[inputId];
-                // Serial.print("Unsubscribing from: ");
-                // Serial.println(input.src);
-                unsubscribe(("pin/" + String(input.src)).c_str());
-                if (src.id) {
-                  input.handler(src.value);
-                  // Serial.print("Subscribing to: ");
-                  // Serial.println(src.id);
-                  subscribe(("pin/" + String(src.id)).c_str(), input.handler);
-                }
-                input.src = src.id;
-              });
-    idx++;
+  // Listens for its config. The route outlives the broker session, see
+  // restart_subscriptions().
+  void subscribeConfig() {
+    if (configRoute.id == 0) {
+      configRoute =
+          subscribe(identity().c_str(), [this](const char *json, size_t len) {
+            applyConfig(String(json, len));
+          });
+    }
   }
 
-  std::vector<int> outputs;
-  auto outputs_arr = doc["outputs"].as<JsonArrayConst>();
-  for (auto out : outputs_arr) {
-    outputs.push_back(out.as<int>());
+  // A config from the server. The one already applied is only confirmed,
+  // anything else is merged into it, and it is kept for the next boot.
+  void applyConfig(const String &s) {
+    if (!config.empty() && ConfigCache::hash(s) == appliedHash) {
+      Serial.println("Config confirmed");
+    } else if (!loadConfig(s)) {
+      return;
+    }
+    confirmed.store(true);
+    cache.store(s);
   }
 
-  config = std::make_unique<Config>(id, std::move(paramsMap),
-                                    std::move(inputsMap), std::move(outputs));
-}
-
-}; // namespace Agent
-
-#ifdef VLX_LED
+  // Applies the config of the previous run, so the agent works before the
+  // broker is reachable. The server confirms or replaces it later on.
+  bool restoreConfig() {
+    String s;
+    if (!cache.load(s)) {
+      return false;
+    }
+    Serial.println("Restoring cached config");
+    return loadConfig(s);
+  }
+};
 
-#define AGENT_BLUEPRINT "vlx_led"
+// Binds an agent type T to its blueprint, T::blueprint()
+template <typename T> class Kind : public Slots<T, Base> {
+protected:
+  const ValueSpec &outputType(size_t output) const override {
+    return T::blueprint().outputs[output];
+  }
 
-#define LED_PIN 5
+public:
+  const char *name() const override { return T::blueprint().name; }
+  Blueprint limits() const override { return T::blueprint().limits(); }
+};
 
-namespace Agent {
+// REGISTRY
+namespace {
+std::vector<Base *> agents;
+}; // namespace
 
-bool state = false;
-int brightness = 100;
+// Hosts the agent, for the lifetime of the firmware
+void add(Base *agent) {
+  agent->attach(agents.size());
+  agents.push_back(agent);
+}
 
-void update_led() { ledcWrite(0, state * (brightness / 100.0) * 255); }
+const std::vector<Base *> &all() { return agents; }
 
-void update_power(const String &s) {
-  state = trueStr.equalsIgnoreCase(s);
-  update_led();
+// Whether every agent has a config, applied or restored
+bool hasConfig() {
+  for (auto agent : agents) {
+    if (!agent->hasConfig()) {
+      return false;
+    }
+  }
+  return true;
 }
 
-void update_brightness(const String &s) {
-  brightness = clamp(s.toInt(), 0, 100);
-  update_led();
+// Pin and param values, as opposed to control topics like `pin/<id>/src`
+bool isStateTopic(const char *topic) {
+  return TopicRouter::covers("pin/+", topic) ||
+         TopicRouter::covers("param/+", topic);
 }
 
-std::vector<std::function<void(const String &s)>> getParamHandlers() {
-  return {};
-};
-
-std::vector<std::function<void(const String &s)>> getInputHandlers() {
-  return {update_power, update_brightness};
+void setup() {
+  for (auto agent : agents) {
+    agent->setup();
+  }
 }
 
-void _setup() {
-  pinMode(LED_PIN, OUTPUT);
-  ledcSetup(0, 5000, 8); // 12000 pt rgb
-  ledcAttachPin(LED_PIN, 0);
-  update_led();
+// Starts the agents that have a config and are not running yet
+void setupListeners() {
+  for (auto agent : agents) {
+    agent->setupListeners();
+  }
 }
 
-void _setupListeners() {}
-
-void _reset() {}
-
-} // namespace Agent
-#endif
-
-#ifdef VLX_SWITCH
-
-#define AGENT_BLUEPRINT "vlx_switch"
+void subscribeConfigs() {
+  for (auto agent : agents) {
+    agent->subscribeConfig();
+  }
+}
 
-#define SWITCH_PIN 5
+// Returns how many agents got their cached config back
+size_t restoreConfigs() {
+  size_t restored = 0;
+  for (auto agent : agents) {
+    restored += agent->restoreConfig();
+  }
+  return restored;
+}
 
-namespace Agent {
+// Writes the hosted agents and the shared routes as one JSON object
+void dumpStats(Print &out) {
+  out.print("{\"agents\":[");
+  for (size_t i = 0; i < agents.size(); i++) {
+    out.print(i ? ",{\"blueprint\":\"" : "{\"blueprint\":\"");
+    out.print(agents[i]->name());
+    out.print("\",\"identity\":\"");
+    out.print(agents[i]->identity());
+    out.print("\",\"configured\":");
+    out.print(agents[i]->hasConfig() ? "true" : "false");
+    out.print(",\"confirmed\":");
+    out.print(agents[i]->isConfirmed() ? "true" : "false");
+    out.print(",\"changes\":");
+    agents[i]->dumpChanges(out);
+    out.print("}");
+  }
+  out.print("],\"routes\":");
+  out.print((unsigned long)mqttRouter.size());
+  out.print(",\"filters\":");
+  out.print((unsigned long)mqttFilters.size());
+  out.print("}");
+}
+// REGISTRY END
+
+// TYPES
+class Led : public Kind<Led> {
+private:
+  int pin;
+  int channel;
+  bool state = false;
+  int brightness = 100;
+
+  void update_led() { ledcWrite(channel, state ? brightness * 255 / 100 : 0); }
+
+protected:
+  void _setup() override {
+    pinMode(pin, OUTPUT);
+    ledcSetup(channel, 5000, 8); // 12000 pt rgb
+    ledcAttachPin(pin, channel);
+    update_led();
+  }
 
-std::shared_ptr<bool> dependency = std::make_shared<bool>(true);
-bool last_state = false;
-unsigned long last_millis;
+public:
+  // Each LED needs its own LEDC channel
+  explicit Led(int pin = LED_PIN, int channel = 0)
+      : pin(pin), channel(channel) {}
 
-bool publish_on_change = true;
-unsigned long publish_period = 5000;
+  static const AgentBlueprint<Led> &blueprint();
 
-void update_publish_mode(const String &s) {
-  publish_on_change = trueStr.equalsIgnoreCase(s);
-}
-void update_publish_period(const String &s) {
-  publish_period = std::strtoul(s.c_str(), NULL, 0);
-}
+  void update_power(const Value &value) {
+    state = value.asBool();
+    update_led();
+  }
 
-std::vector<std::function<void(const String &s)>> getParamHandlers() {
-  return {update_publish_mode, update_publish_period};
+  // A percentage, clamped by its slot
+  void update_brightness(const Value &value) {
+    brightness = value.asInt();
+    update_led();
+  }
 };
 
-std::vector<std::function<void(const String &s)>> getInputHandlers() {
-  return {};
-}
+constexpr Slot<Led> ledInputs[] = {
+    {"power", boolValue(), &Led::update_power},
+    {"brightness", intValue(0, 100), &Led::update_brightness}};
+constexpr AgentBlueprint<Led> ledBlueprint = {
+    "vlx_led", nullptr, 0, ledInputs, std::size(ledInputs), nullptr, 0};
 
-void send_val() {
-  auto out_id = config->outputs.at(0);
-  auto topic = "pin/" + String(out_id);
-  auto payload = last_state ? trueStr.c_str() : falseStr.c_str();
-  // Serial.print("out_id: ");
-  // Serial.println(out_id);
-  // Serial.print("topic: ");
-  // Serial.println(topic);
-  // Serial.print("payload: ");
-  // Serial.println(payload);
-  mqttClient.publish(topic.c_str(), 0, false, payload);
-  last_millis = millis();
-}
+const AgentBlueprint<Led> &Led::blueprint() { return ledBlueprint; }
 
-void _setup() {
-  pinMode(LED_BUILTIN, OUTPUT);
-  pinMode(SWITCH_PIN, INPUT_PULLUP);
-}
+class Switch : public Kind<Switch> {
+private:
+  int pin;
+  bool last_state = false;
+  unsigned long last_millis;
 
-void _setupListeners() {
-  Tasks::queueTask(new DependentTask(
-      {dependency}, new Tasks::Task(
-                        []() {
-                          last_state = digitalRead(SWITCH_PIN);
-                          digitalWrite(LED_BUILTIN, last_state);
-                          send_val();
-                        },
-                        []() {
-                          auto state = digitalRead(SWITCH_PIN);
-                          digitalWrite(LED_BUILTIN, state);
-                          if (publish_on_change) {
-                            if (state != last_state) {
-                              last_state = state;
-                              send_val();
-                            }
-                          } else if (millis() - last_millis >= publish_period) {
-                            last_state = state;
-                            send_val();
-                          }
-
-                          return false;
-                        },
-                        Tasks::NoOp)));
-}
+  bool publish_on_change = true;
+  unsigned long publish_period = 5000;
 
-void _reset() {
-  *dependency = false;
-  dependency = std::make_shared<bool>(true);
-}
-
-} // namespace Agent
-#endif
+  void send_val() {
+    publishOutput(0, Value::ofBool(last_state));
+    last_millis = millis();
+  }
 
-#ifdef VLX_SLIDER
+protected:
+  void _setup() override {
+    pinMode(LED_BUILTIN, OUTPUT);
+    pinMode(pin, INPUT_PULLUP);
+  }
 
-#define AGENT_BLUEPRINT "vlx_slider"
+  void _setupListeners() override {
+    auto sampler = Tasks::spawn(Tasks::dependent(
+        scope, Tasks::sequence(Tasks::once([this]() {
+                                 last_state = digitalRead(pin);
+                                 digitalWrite(LED_BUILTIN, last_state);
+                                 send_val();
+                               }),
+                               Tasks::poll([this]() {
+                                 auto state = digitalRead(pin);
+                                 digitalWrite(LED_BUILTIN, state);
+                                 if (publish_on_change) {
+                                   if (state != last_state) {
+                                     last_state = state;
+                                     send_val();
+                                   }
+                                 } else if (millis() - last_millis >=
+                                            publish_period) {
+                                   last_state = state;
+                                   send_val();
+                                 }
+
+                                 return false;
+                               }))));
+    Tasks::name(sampler, "switch-sampler");
+    Tasks::prioritize(sampler, Tasks::Priority::Realtime);
+  }
 
-#define SLIDER_PIN 34
+public:
+  explicit Switch(int pin = SWITCH_PIN) : pin(pin) {}
 
-namespace Agent {
+  static const AgentBlueprint<Switch> &blueprint();
 
-std::shared_ptr<bool> dependency = std::make_shared<bool>(true);
-int last_value = 0;
-unsigned long last_millis;
+  void update_publish_mode(const Value &value) {
+    publish_on_change = value.asBool();
+  }
+  // In milliseconds
+  void update_publish_period(const Value &value) {
+    publish_period = value.asInt();
+  }
+};
 
-bool publish_on_change = true;
-unsigned long publish_period = 5000;
+constexpr Slot<Switch> switchParams[] = {
+    {"publish_mode", boolValue(), &Switch::update_publish_mode},
+    {"publish_period", intValue(0), &Switch::update_publish_period}};
+// Publishes on its first output
+constexpr ValueSpec switchOutputs[] = {boolValue()};
+constexpr AgentBlueprint<Switch> switchBlueprint = {
+    "vlx_switch",  switchParams, std::size(switchParams), nullptr, 0,
+    switchOutputs, std::size(switchOutputs)};
+
+const AgentBlueprint<Switch> &Switch::blueprint() { return switchBlueprint; }
+
+class Slider : public Kind<Slider> {
+private:
+  int pin;
+  int last_value = 0;
+  unsigned long last_millis;
+
+  bool publish_on_change = true;
+  unsigned long publish_period = 5000;
+
+  void send_val() {
+    publishOutput(0, Value::ofInt(last_value * 100 / 40));
+    last_millis = millis();
+  }
 
-void update_publish_mode(const String &s) {
-  publish_on_change = trueStr.equalsIgnoreCase(s);
-}
-void update_publish_period(const String &s) {
-  publish_period = std::strtoul(s.c_str(), NULL, 0);
-}
+  int read_avg(int read_count = 10) {
+    unsigned int sum = 0;
+    for (int i = 0; i < read_count; i++) {
+      sum += analogRead(pin);
+    }
 
-std::vector<std::function<void(const String &s)>> getParamHandlers() {
-  return {update_publish_mode, update_publish_period};
-};
+    return std::round(1.0 * sum / read_count) / 100;
+  }
 
-std::vector<std::function<void(const String &s)>> getInputHandlers() {
-  return {};
-}
+protected:
+  void _setup() override { pinMode(pin, INPUT); }
+
+  void _setupListeners() override {
+    auto sampler = Tasks::spawn(Tasks::dependent(
+        scope, Tasks::sequence(Tasks::once([this]() {
+                                 last_value = read_avg();
+                                 send_val();
+                               }),
+                               Tasks::poll([this]() {
+                                 auto value = read_avg();
+                                 if (publish_on_change) {
+                                   if (std::abs(value - last_value) > 1) {
+                                     last_value = value;
+                                     send_val();
+                                   }
+                                 } else if (millis() - last_millis >=
+                                            publish_period) {
+                                   last_value = value;
+                                   send_val();
+                                 }
+
+                                 return false;
+                               }))));
+    Tasks::name(sampler, "slider-sampler");
+    Tasks::prioritize(sampler, Tasks::Priority::Realtime);
+  }
 
-void send_val() {
-  auto out_id = config->outputs.at(0);
-  auto topic = "pin/" + String(out_id);
-  auto payload = String((int)((last_value / 40.0) * 100));
-  // Serial.print("out_id: ");
-  // Serial.println(out_id);
-  // Serial.print("topic: ");
-  // Serial.println(topic);
-  // Serial.print("payload: ");
-  // Serial.println(payload);
-  mqttClient.publish(topic.c_str(), 0, false, payload.c_str());
-  last_millis = millis();
-}
+public:
+  explicit Slider(int pin = SLIDER_PIN) : pin(pin) {}
 
-void _setup() { pinMode(SLIDER_PIN, INPUT); }
+  static const AgentBlueprint<Slider> &blueprint();
 
-int read_avg(int read_count = 10) {
-  unsigned int sum = 0;
-  for (int i = 0; i < read_count; i++) {
-    sum += analogRead(SLIDER_PIN);
+  void update_publish_mode(const Value &value) {
+    publish_on_change = value.asBool();
   }
+  // In milliseconds
+  void update_publish_period(const Value &value) {
+    publish_period = value.asInt();
+  }
+};
 
-  return std::round(1.0 * sum / read_count) / 100;
-}
+constexpr Slot<Slider> sliderParams[] = {
+    {"publish_mode", boolValue(), &Slider::update_publish_mode},
+    {"publish_period", intValue(0), &Slider::update_publish_period}};
+// Publishes on its first output
+constexpr ValueSpec sliderOutputs[] = {intValue()};
+constexpr AgentBlueprint<Slider> sliderBlueprint = {
+    "vlx_slider",  sliderParams, std::size(sliderParams), nullptr, 0,
+    sliderOutputs, std::size(sliderOutputs)};
 
-void _setupListeners() {
-  Tasks::queueTask(new DependentTask(
-      {dependency}, new Tasks::Task(
-                        []() {
-                          last_value = read_avg();
-                          send_val();
-                        },
-                        []() {
-                          auto value = read_avg();
-                          if (publish_on_change) {
-                            if (std::abs(value - last_value) > 1) {
-                              last_value = value;
-                              send_val();
-                            }
-                          } else if (millis() - last_millis >= publish_period) {
-                            last_value = value;
-                            send_val();
-                          }
-
-                          return false;
-                        },
-                        Tasks::NoOp)));
-}
+const AgentBlueprint<Slider> &Slider::blueprint() { return sliderBlueprint; }
+// TYPES END
 
-void _reset() {
-  *dependency = false;
-  dependency = std::make_shared<bool>(true);
-}
+}; // namespace Agent
 
-} // namespace Agent
 #endif
-
-#endif
\ No newline at end of file
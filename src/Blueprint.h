@@ -0,0 +1,37 @@
+#ifndef BLUEPRINT_H
+#define BLUEPRINT_H
+
+#include <Arduino.h>
+#include <ConfigParser.h>
+#include <Value.h>
+#include <cstddef>
+
+// A handler of an agent of type T, at a fixed position of its blueprint.
+// Config entries are bound to slots by position, their values are decoded
+// as the slot declares before the handler sees them.
+template <typename T> struct Slot {
+  const char *name;
+  ValueSpec value;
+  void (T::*handler)(const Value &value);
+};
+
+// What an agent type is made of, declared as a constexpr table so
+// dispatching to a slot is an array index and a direct call
+template <typename T> struct AgentBlueprint {
+  const char *name;
+  const Slot<T> *params;
+  size_t paramCount;
+  const Slot<T> *inputs;
+  size_t inputCount;
+  // What it publishes on each of its outputs
+  const ValueSpec *outputs;
+  size_t outputCount;
+
+  // What a config for it may hold
+  constexpr Blueprint limits() const {
+    return {
+        .params = paramCount, .inputs = inputCount, .outputs = outputCount};
+  }
+};
+
+#endif
@@ -0,0 +1,124 @@
+#ifndef CALLABLE_H
+#define CALLABLE_H
+
+#include <cstddef>
+#include <new>
+#include <type_traits>
+#include <utility>
+
+// Inline storage for callables, enough for a couple of captured pointers
+// or a captured std::function
+#ifndef TASKS_CALLABLE_CAPACITY
+#define TASKS_CALLABLE_CAPACITY (4 * sizeof(void *))
+#endif
+
+namespace Tasks {
+
+template <typename Sig, size_t Capacity = TASKS_CALLABLE_CAPACITY>
+class Callable;
+
+// std::function replacement that never touches the heap: the target is
+// stored inline and anything larger than Capacity fails to compile
+template <typename R, typename... Args, size_t Capacity>
+class Callable<R(Args...), Capacity> {
+private:
+  enum class Op { Copy, Move, Destroy };
+
+  alignas(std::max_align_t) unsigned char storage[Capacity];
+  R (*invoke_fn)(void *, Args...) = nullptr;
+  void (*manage_fn)(Op, void *, void *) = nullptr;
+
+  template <typename T> static R invoke(void *self, Args... args) {
+    return (*static_cast<T *>(self))(std::forward<Args>(args)...);
+  }
+
+  template <typename T> static void manage(Op op, void *dst, void *src) {
+    switch (op) {
+    case Op::Copy:
+      new (dst) T(*static_cast<const T *>(src));
+      break;
+    case Op::Move:
+      new (dst) T(std::move(*static_cast<T *>(src)));
+      static_cast<T *>(src)->~T();
+      break;
+    case Op::Destroy:
+      static_cast<T *>(dst)->~T();
+      break;
+    }
+  }
+
+  void reset() {
+    if (manage_fn != nullptr) {
+      manage_fn(Op::Destroy, storage, nullptr);
+    }
+    invoke_fn = nullptr;
+    manage_fn = nullptr;
+  }
+
+  void copyFrom(const Callable &other) {
+    if (other.manage_fn != nullptr) {
+      other.manage_fn(Op::Copy, storage, const_cast<unsigned char *>(other.storage));
+    }
+    invoke_fn = other.invoke_fn;
+    manage_fn = other.manage_fn;
+  }
+
+  void moveFrom(Callable &other) {
+    if (other.manage_fn != nullptr) {
+      other.manage_fn(Op::Move, storage, other.storage);
+    }
+    invoke_fn = other.invoke_fn;
+    manage_fn = other.manage_fn;
+    other.invoke_fn = nullptr;
+    other.manage_fn = nullptr;
+  }
+
+public:
+  Callable() {}
+  Callable(std::nullptr_t) {}
+
+  template <typename F,
+            typename = std::enable_if_t<
+                !std::is_same<std::decay_t<F>, Callable>::value>>
+  Callable(F &&fn) {
+    using T = std::decay_t<F>;
+    static_assert(sizeof(T) <= Capacity,
+                  "Callable target exceeds TASKS_CALLABLE_CAPACITY");
+    static_assert(alignof(T) <= alignof(std::max_align_t),
+                  "Callable target is over-aligned");
+    new (storage) T(std::forward<F>(fn));
+    invoke_fn = invoke<T>;
+    manage_fn = manage<T>;
+  }
+
+  Callable(const Callable &other) { copyFrom(other); }
+  Callable(Callable &&other) { moveFrom(other); }
+
+  Callable &operator=(const Callable &other) {
+    if (this != &other) {
+      reset();
+      copyFrom(other);
+    }
+    return *this;
+  }
+  Callable &operator=(Callable &&other) {
+    if (this != &other) {
+      reset();
+      moveFrom(other);
+    }
+    return *this;
+  }
+
+  ~Callable() { reset(); }
+
+  explicit operator bool() const { return invoke_fn != nullptr; }
+
+  R operator()(Args... args) const {
+    return invoke_fn(const_cast<unsigned char *>(storage),
+                     std::forward<Args>(args)...);
+  }
+};
+
+} // namespace Tasks
+
+#endif
@@ -0,0 +1,158 @@
+#ifndef CHANNEL_H
+#define CHANNEL_H
+
+#include <atomic>
+#include <cstddef>
+#include <deque>
+#include <utility>
+
+namespace Tasks {
+
+// Lock-free single producer, single consumer ring between two threads,
+// e.g. the tasks of two schedulers. Exactly one thread may push and
+// exactly one may pop. Capacity must be a power of two.
+template <typename T, size_t Capacity> class Channel {
+  static_assert(Capacity >= 2 && (Capacity & (Capacity - 1)) == 0,
+                "Channel capacity must be a power of two");
+
+private:
+  T slots[Capacity];
+  // Free running indices, only the producer writes tail and only the
+  // consumer writes head
+  std::atomic<size_t> head{0};
+  std::atomic<size_t> tail{0};
+  std::atomic<unsigned long> rejected{0};
+
+public:
+  // False when the channel is full, the value is left untouched then
+  bool push(T &&value) {
+    auto at = tail.load(std::memory_order_relaxed);
+    if (at - head.load(std::memory_order_acquire) == Capacity) {
+      rejected.fetch_add(1, std::memory_order_relaxed);
+      return false;
+    }
+    slots[at & (Capacity - 1)] = std::move(value);
+    tail.store(at + 1, std::memory_order_release);
+    return true;
+  }
+
+  bool push(const T &value) {
+    T copy = value;
+    return push(std::move(copy));
+  }
+
+  bool pop(T &value) {
+    auto at = head.load(std::memory_order_relaxed);
+    if (at == tail.load(std::memory_order_acquire)) {
+      return false;
+    }
+    value = std::move(slots[at & (Capacity - 1)]);
+    head.store(at + 1, std::memory_order_release);
+    return true;
+  }
+
+  // Producer side, in place: the next slot to fill, nullptr when the
+  // channel is full. The consumer sees it once committed.
+  T *claim() {
+    auto at = tail.load(std::memory_order_relaxed);
+    if (at - head.load(std::memory_order_acquire) == Capacity) {
+      rejected.fetch_add(1, std::memory_order_relaxed);
+      return nullptr;
+    }
+    return &slots[at & (Capacity - 1)];
+  }
+
+  void commit() {
+    tail.store(tail.load(std::memory_order_relaxed) + 1,
+               std::memory_order_release);
+  }
+
+  // Consumer side, in place: the oldest value, nullptr when empty. It
+  // stays put until dropped.
+  T *front() {
+    auto at = head.load(std::memory_order_relaxed);
+    if (at == tail.load(std::memory_order_acquire)) {
+      return nullptr;
+    }
+    return &slots[at & (Capacity - 1)];
+  }
+
+  // Consumer side: the value `offset` places after the oldest, nullptr past
+  // the newest
+  T *peek(size_t offset) {
+    auto at = head.load(std::memory_order_relaxed);
+    if (offset >= tail.load(std::memory_order_acquire) - at) {
+      return nullptr;
+    }
+    return &slots[(at + offset) & (Capacity - 1)];
+  }
+
+  void drop() {
+    head.store(head.load(std::memory_order_relaxed) + 1,
+               std::memory_order_release);
+  }
+
+  // Approximate unless called from the producer or the consumer
+  size_t size() const {
+    return tail.load(std::memory_order_acquire) -
+           head.load(std::memory_order_acquire);
+  }
+  bool empty() const { return size() == 0; }
+  size_t capacity() const { return Capacity; }
+
+  // Pushes refused because the channel was full
+  unsigned long full() const {
+    return rejected.load(std::memory_order_relaxed);
+  }
+};
+
+// Channel for requests that must not be lost, e.g. subscription changes.
+// What does not fit is kept in order on the producer side, in a backlog
+// moved over by flush(), so bursts larger than the channel only cost heap
+// until the consumer caught up. Producer calls and consumer calls each
+// have to stay on their own thread, as with Channel.
+template <typename T, size_t Capacity> class LosslessChannel {
+private:
+  Channel<T, Capacity> channel;
+  std::deque<T> backlog;
+
+public:
+  // Producer side: moves over what the backlog holds and fits
+  void flush() {
+    while (!backlog.empty() && channel.push(std::move(backlog.front()))) {
+      backlog.pop_front();
+    }
+  }
+
+  // Producer side: never fails, after everything pushed before
+  void push(T &&value) {
+    flush();
+    if (!backlog.empty() || !channel.push(std::move(value))) {
+      backlog.push_back(std::move(value));
+    }
+  }
+
+  void push(const T &value) {
+    T copy = value;
+    push(std::move(copy));
+  }
+
+  // Producer side: for values that may be dropped, false when the channel
+  // is full or values wait in the backlog
+  bool offer(T &&value) {
+    flush();
+    return backlog.empty() && channel.push(std::move(value));
+  }
+
+  bool pop(T &value) { return channel.pop(value); }
+
+  // Producer side: values waiting to be moved over
+  size_t backlogged() const { return backlog.size(); }
+  // Times the channel was found full, whether the value was then kept or
+  // dropped
+  unsigned long full() const { return channel.full(); }
+};
+
+} // namespace Tasks
+
+#endif
@@ -0,0 +1,90 @@
+#ifndef CONFIG_CACHE_H
+#define CONFIG_CACHE_H
+
+#include <Arduino.h>
+#include <Preferences.h>
+#include <cstdint>
+
+#define CONFIG_CACHE_NAMESPACE "volex-config"
+#define CONFIG_KEY "config"
+#define CONFIG_HASH_KEY "hash"
+
+// The last config the server sent an agent, kept in NVS so it can run on it
+// right after boot, before the broker is reachable. Agents past the first
+// one have their index appended to the keys.
+class ConfigCache {
+private:
+  String configKey;
+  String hashKey;
+  // Of the stored config, 0 for none
+  uint32_t storedHash = 0;
+  bool loaded = false;
+
+public:
+  ConfigCache(size_t index = 0)
+      : configKey(CONFIG_KEY), hashKey(CONFIG_HASH_KEY) {
+    if (index != 0) {
+      configKey += String((unsigned int)index);
+      hashKey += String((unsigned int)index);
+    }
+  }
+
+  // FNV-1a of a config, tells two of them apart without storing both
+  static uint32_t hash(const String &config) {
+    uint32_t value = 2166136261u;
+    for (size_t i = 0; i < config.length(); i++) {
+      value ^= (uint8_t)config[i];
+      value *= 16777619u;
+    }
+    // 0 stands for no config
+    return value != 0 ? value : 1;
+  }
+
+  // The stored config, false when there is none or it does not match its
+  // hash, e.g. after a write cut short by a power loss
+  bool load(String &config) {
+    Preferences prefs;
+    if (!prefs.begin(CONFIG_CACHE_NAMESPACE, true)) {
+      loaded = true;
+      return false;
+    }
+    config = prefs.getString(configKey.c_str());
+    auto expected = prefs.getUInt(hashKey.c_str(), 0);
+    prefs.end();
+    loaded = true;
+    if (config.length() == 0 || hash(config) != expected) {
+      storedHash = 0;
+      return false;
+    }
+    storedHash = expected;
+    return true;
+  }
+
+  // Keeps the config for the next boot. The flash is only written when it
+  // differs from the stored one.
+  bool store(const String &config) {
+    if (!loaded) {
+      String stored;
+      load(stored);
+    }
+    auto value = hash(config);
+    if (value == storedHash) {
+      return true;
+    }
+    Preferences prefs;
+    if (!prefs.begin(CONFIG_CACHE_NAMESPACE)) {
+      Serial.println("Could not open the config cache");
+      return false;
+    }
+    // The hash goes last, a config without its hash is not loaded
+    auto written =
+        prefs.putUInt(hashKey.c_str(), 0) != 0 &&
+        prefs.putString(configKey.c_str(), config) == config.length() &&
+        prefs.putUInt(hashKey.c_str(), value) != 0;
+    prefs.end();
+    storedHash = written ? value : 0;
+    return written;
+  }
+};
+
+#endif
@@ -0,0 +1,175 @@
+#ifndef CONFIG_PARSER_H
+#define CONFIG_PARSER_H
+
+#include <JsonReader.h>
+#include <cstddef>
+
+// What an agent firmware can take from a config
+typedef struct {
+  // Params and inputs it has handlers for, by position
+  size_t params;
+  size_t inputs;
+  // Outputs it publishes on, the config has to name them
+  size_t outputs;
+} Blueprint;
+
+enum class ConfigError {
+  None,
+  Malformed,
+  TooManyParams,
+  TooManyInputs,
+  MissingOutputs
+};
+
+const char *configErrorName(ConfigError error) {
+  switch (error) {
+  case ConfigError::None:
+    return "none";
+  case ConfigError::Malformed:
+    return "malformed";
+  case ConfigError::TooManyParams:
+    return "too many params";
+  case ConfigError::TooManyInputs:
+    return "too many inputs";
+  case ConfigError::MissingOutputs:
+    return "missing outputs";
+  }
+  return "unknown";
+}
+
+// Entries of a config, their values are views into the message
+typedef struct {
+  int id;
+  TextView value;
+} ParamView;
+
+typedef struct {
+  int id;
+  int src;
+  TextView value;
+} InputView;
+
+namespace {
+bool readParam(JsonReader &reader, ParamView &param) {
+  param = {};
+  return reader.object([&](const TextView &key) {
+    if (key.equals("id")) {
+      return reader.integerOrNull(param.id);
+    }
+    if (key.equals("value")) {
+      return reader.scalar(param.value);
+    }
+    return reader.skip();
+  });
+}
+
+bool readInput(JsonReader &reader, InputView &input) {
+  input = {};
+  return reader.object([&](const TextView &key) {
+    if (key.equals("id")) {
+      return reader.integerOrNull(input.id);
+    }
+    if (key.equals("src")) {
+      return reader.integerOrNull(input.src);
+    }
+    if (key.equals("value")) {
+      return reader.scalar(input.value);
+    }
+    return reader.skip();
+  });
+}
+} // namespace
+
+// Reads a config of the form
+//   {"id": 1, "params": [{"id": 2, "value": "x"}],
+//    "inputs": [{"id": 3, "src": 4, "value": "y"}], "outputs": [5]}
+// straight off the message, handing every entry over as it is read, with
+// `onParam(param, slot)`, `onInput(input, slot)` and `onOutput(id)`. The
+// slot is the position of the entry, which picks its handler. Nothing is
+// kept in between, so the size of a config is not bounded by a buffer.
+//
+// The callbacks may have seen part of a config that turns out invalid,
+// check it with checkConfig() first.
+template <typename P, typename I, typename O>
+ConfigError parseConfig(const char *json, size_t len,
+                        const Blueprint &blueprint, int &id, P onParam,
+                        I onInput, O onOutput) {
+  JsonReader reader(json, len);
+  size_t params = 0;
+  size_t inputs = 0;
+  size_t outputs = 0;
+  auto error = ConfigError::None;
+  id = 0;
+  reader.object([&](const TextView &key) {
+    if (key.equals("id")) {
+      return reader.integerOrNull(id);
+    }
+    if (key.equals("params")) {
+      return reader.array([&]() {
+        ParamView param;
+        if (!readParam(reader, param)) {
+          return false;
+        }
+        if (params == blueprint.params) {
+          error = ConfigError::TooManyParams;
+          return false;
+        }
+        onParam(param, params++);
+        return true;
+      });
+    }
+    if (key.equals("inputs")) {
+      return reader.array([&]() {
+        InputView input;
+        if (!readInput(reader, input)) {
+          return false;
+        }
+        if (inputs == blueprint.inputs) {
+          error = ConfigError::TooManyInputs;
+          return false;
+        }
+        onInput(input, inputs++);
+        return true;
+      });
+    }
+    if (key.equals("outputs")) {
+      return reader.array([&]() {
+        int output;
+        if (!reader.integer(output)) {
+          return false;
+        }
+        onOutput(output);
+        outputs++;
+        return true;
+      });
+    }
+    return reader.skip();
+  });
+  if (error != ConfigError::None) {
+    return error;
+  }
+  if (!reader.done()) {
+    return ConfigError::Malformed;
+  }
+  if (outputs < blueprint.outputs) {
+    return ConfigError::MissingOutputs;
+  }
+  return ConfigError::None;
+}
+
+// Whether the config is well formed and fits the blueprint
+ConfigError checkConfig(const char *json, size_t len,
+                        const Blueprint &blueprint) {
+  int id;
+  return parseConfig(
+      json, len, blueprint, id, [](const ParamView &param, size_t slot) {},
+      [](const InputView &input, size_t slot) {}, [](int output) {});
+}
+
+// Reads a single `{"id": 2, "value": "x"}`, as sent to `pin/<id>/src`
+bool parseParam(const char *json, size_t len, ParamView &param) {
+  JsonReader reader(json, len);
+  return readParam(reader, param) && reader.done();
+}
+
+#endif
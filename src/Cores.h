@@ -0,0 +1,60 @@
+#ifndef CORES_H
+#define CORES_H
+
+#include <Arduino.h>
+#include <Tasks.h>
+
+// Runs a scheduler on its own FreeRTOS task pinned to one of the ESP32
+// cores, next to the Arduino loop() which keeps running Tasks::loop() on
+// the default scheduler.
+//
+//   Tasks::Scheduler io;
+//   {
+//     Tasks::Binding on(io);
+//     Tasks::queueTask(new ConnectFlow());
+//   }
+//   Tasks::runPinned(io, "io", 0);
+namespace Tasks {
+
+#ifdef ESP32
+namespace {
+typedef struct {
+  Scheduler *scheduler;
+  unsigned long max_idle_ms;
+} PinnedLoop;
+
+void pinnedLoop(void *arg) {
+  auto pinned = static_cast<PinnedLoop *>(arg);
+  bind(*pinned->scheduler);
+  while (true) {
+    auto idle = std::min(pinned->scheduler->loop(), pinned->max_idle_ms);
+    // Always block for a tick, the idle task of the core has to run or its
+    // watchdog fires
+    vTaskDelay(std::max((TickType_t)1, (TickType_t)pdMS_TO_TICKS(idle)));
+  }
+}
+} // namespace
+
+// Starts driving `scheduler` from a new task on `core`. It idles up to
+// `max_idle_ms` between passes so channels fed from the other core are
+// picked up promptly.
+bool runPinned(Scheduler &scheduler, const char *name, BaseType_t core,
+               unsigned long max_idle_ms = 10, uint32_t stack_size = 8192,
+               UBaseType_t priority = 1) {
+  auto pinned = new PinnedLoop{.scheduler = &scheduler,
+                               .max_idle_ms = max_idle_ms};
+  auto created = xTaskCreatePinnedToCore(pinnedLoop, name, stack_size, pinned,
+                                         priority, nullptr, core);
+  if (created != pdPASS) {
+    Serial.print("Could not start scheduler task ");
+    Serial.println(name);
+    delete pinned;
+    return false;
+  }
+  return true;
+}
+#endif
+
+} // namespace Tasks
+
+#endif
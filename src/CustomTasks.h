@@ -3,113 +3,337 @@
 
 #include <Arduino.h>
 #include <Tasks.h>
-#include <memory>
+#include <tuple>
+#include <type_traits>
+#include <utility>
 
-class AdapterTask : public Tasks::Task {
-public:
-  AdapterTask()
-      : Task([&](const Tasks::TaskRef *ref) { init(ref); },
-             [&](const Tasks::TaskRef *ref) { return check(ref); },
-             [&](const Tasks::TaskRef *ref) { dispatch(ref); }) {
-    Serial.println("adapter constructor");
+// Compile-time task composition. A step is a plain object providing
+//   void init();                  called when the step starts
+//   Status check();               called every pass until it is not Pending
+//   void dispatch();              called once after check() returned Done
+//   bool wake(unsigned long &at); deadline before which checking is pointless,
+//                                 false when the step has to be polled
+// Combinators hold their children by value, so a composed task is a single
+// object and only the scheduler's calls into it are virtual.
+namespace Tasks {
+
+enum class Status { Pending, Done, Failed };
+
+// INTERNALS
+// Work functions may return a Status, a bool (true when done) or nothing
+template <typename F> Status run(F &fn) {
+  using R = decltype(fn());
+  if constexpr (std::is_same<R, Status>::value) {
+    return fn();
+  } else if constexpr (std::is_void<R>::value) {
+    fn();
+    return Status::Done;
+  } else {
+    return fn() ? Status::Done : Status::Pending;
   }
+}
 
-  ~AdapterTask() { Serial.println("adapter destructor"); }
+bool isEarlier(unsigned long a, unsigned long b) { return (long)(a - b) < 0; }
+// INTERNALS END
 
-  virtual void init(const Tasks::TaskRef *ref) { init(); }
-  virtual bool check(const Tasks::TaskRef *ref) { return check(); }
-  virtual void dispatch(const Tasks::TaskRef *ref) { dispatch(); }
+// STEPS
+// Runs `work` on every pass until it is done, see run() for what it returns
+template <typename F> class Poll {
+private:
+  F work;
 
-  virtual void init() { Serial.println("adapter init"); }
-  virtual bool check() {
-    Serial.println("adapter check");
-    return true;
-  }
-  virtual void dispatch() { Serial.println("adapter dispatch"); }
+public:
+  Poll(F work) : work(std::move(work)) {}
+
+  void init() {}
+  Status check() { return run(work); }
+  void dispatch() {}
+  bool wake(unsigned long &at) { return false; }
 };
 
-class TimedTask : public AdapterTask {
+// A function returning nothing polls once, anything else like Poll
+template <typename F> using Once = Poll<F>;
+
+template <typename F> class Timed {
 private:
-  unsigned long prev_millis;
+  F work;
   unsigned long delay;
   bool immediate;
-
-  std::function<bool()> work;
-  std::function<void()> callback;
+  unsigned long prev_millis = 0;
 
 public:
-  TimedTask(std::function<bool()> work, std::function<void()> callback,
-            unsigned long delay, bool immediate = true)
-      : work(work), callback(callback), delay(delay), immediate(immediate) {}
-
-  ~TimedTask() { Serial.println("timed destructor"); }
+  Timed(unsigned long delay, F work, bool immediate)
+      : work(std::move(work)), delay(delay), immediate(immediate) {}
 
-  virtual void init() {
-    prev_millis = millis() - delay * immediate;
-    Serial.println("timed setup: " + String(prev_millis));
-  }
-  virtual bool check() {
-    auto curr_millis = millis();
-    if (curr_millis - prev_millis >= delay) {
-      prev_millis = curr_millis;
-      return work();
+  void init() { prev_millis = now() - delay * immediate; }
+  Status check() {
+    auto curr_millis = now();
+    if (curr_millis - prev_millis < delay) {
+      return Status::Pending;
     }
-    return false;
+    prev_millis = curr_millis;
+    return run(work);
   }
-  virtual void dispatch() {
+  void dispatch() {}
+  bool wake(unsigned long &at) {
+    at = prev_millis + delay;
+    return true;
+  }
+};
+
+template <typename S, typename F> class Then {
+private:
+  S step;
+  F callback;
+
+public:
+  Then(S step, F callback)
+      : step(std::move(step)), callback(std::move(callback)) {}
+
+  void init() { step.init(); }
+  Status check() { return step.check(); }
+  void dispatch() {
+    step.dispatch();
     callback();
-    Serial.println("timed dispatch");
   }
+  bool wake(unsigned long &at) { return step.wake(at); }
 };
 
-class CompositeTask : public AdapterTask {
-protected:
-  std::unique_ptr<Tasks::Task> task = nullptr;
+// Fails as soon as the scope is cancelled. When it is the outermost step,
+// spawn() binds the task to the scope so cancellation is pushed instead.
+template <typename S> class Dependent {
+private:
+  S step;
 
 public:
-  CompositeTask(Tasks::Task *t)
-      : task(std::move(std::unique_ptr<Tasks::Task>(t))) {}
+  Scope *scope;
+
+  Dependent(Scope &scope, S step) : step(std::move(step)), scope(&scope) {}
+
+  void init() { step.init(); }
+  Status check() {
+    if (!scope->isActive()) {
+      return Status::Failed;
+    }
+    return step.check();
+  }
+  void dispatch() { step.dispatch(); }
+  bool wake(unsigned long &at) { return step.wake(at); }
+};
 
-  ~CompositeTask() { Serial.println("composite destructor"); }
+// Restarts the step each time it fails, up to `attempts` runs in total. It
+// runs at least once, even for 0 attempts.
+template <typename S> class Retry {
+private:
+  S step;
+  unsigned int attempts;
+  unsigned int left = 0;
 
-  virtual void init() { task->setup(); }
-  virtual bool check() { return task->isFinished(); }
-  virtual void dispatch() { task->finish(); }
+public:
+  Retry(unsigned int attempts, S step)
+      : step(std::move(step)), attempts(attempts) {}
+
+  void init() {
+    left = attempts;
+    step.init();
+  }
+  Status check() {
+    auto status = step.check();
+    if (status != Status::Failed || left == 0 || --left == 0) {
+      return status;
+    }
+    step.init();
+    return Status::Pending;
+  }
+  void dispatch() { step.dispatch(); }
+  bool wake(unsigned long &at) { return step.wake(at); }
 };
 
-class DependentTask : public CompositeTask {
+// Runs the steps one after the other, each one dispatched as it completes
+template <typename... S> class Sequence {
 private:
-  std::vector<std::shared_ptr<boolean>> deps;
+  std::tuple<S...> steps;
+  size_t index = 0;
+
+  template <size_t I> Status checkFrom() {
+    if constexpr (I < sizeof...(S)) {
+      if (index != I) {
+        return checkFrom<I + 1>();
+      }
+      auto &step = std::get<I>(steps);
+      auto status = step.check();
+      if (status != Status::Done) {
+        return status;
+      }
+      step.dispatch();
+      index++;
+      if constexpr (I + 1 < sizeof...(S)) {
+        std::get<I + 1>(steps).init();
+      }
+      return checkFrom<I + 1>();
+    } else {
+      return Status::Done;
+    }
+  }
 
-  bool aborted = false;
+  template <size_t I> bool wakeAt(unsigned long &at) {
+    if constexpr (I < sizeof...(S)) {
+      return index == I ? std::get<I>(steps).wake(at) : wakeAt<I + 1>(at);
+    } else {
+      return false;
+    }
+  }
 
 public:
-  DependentTask(std::vector<std::shared_ptr<boolean>> dependencies,
-                Tasks::Task *task)
-      : CompositeTask(task), deps(std::move(dependencies)) {}
-
-  // Idk why this does not work
-  DependentTask(std::vector<std::shared_ptr<boolean>> dependencies,
-                Tasks::void_type setupFn, Tasks::bool_type checkFn,
-                Tasks::void_type callbackFn)
-      : DependentTask(deps, new Tasks::Task(setupFn, checkFn, callbackFn)) {}
-
-  ~DependentTask() { Serial.println("dependent destructor called"); }
-
-  virtual bool check() override {
-    for (auto &dep : deps) {
-      if (!*dep) {
-        return aborted = true;
+  Sequence(S... steps) : steps(std::move(steps)...) {}
+
+  void init() {
+    index = 0;
+    std::get<0>(steps).init();
+  }
+  Status check() { return checkFrom<0>(); }
+  void dispatch() {}
+  bool wake(unsigned long &at) { return wakeAt<0>(at); }
+};
+
+// Runs the steps side by side, the first one done wins and is the only one
+// dispatched. Fails once every step failed.
+template <typename... S> class Race {
+private:
+  std::tuple<S...> steps;
+  Status statuses[sizeof...(S)];
+  size_t winner = 0;
+
+  template <size_t... I> void initAll(std::index_sequence<I...>) {
+    ((statuses[I] = Status::Pending, std::get<I>(steps).init()), ...);
+  }
+
+  template <size_t I> Status checkFrom(bool failed) {
+    if constexpr (I < sizeof...(S)) {
+      if (statuses[I] == Status::Pending) {
+        statuses[I] = std::get<I>(steps).check();
+        if (statuses[I] == Status::Done) {
+          winner = I;
+          return Status::Done;
+        }
+      }
+      return checkFrom<I + 1>(failed && statuses[I] == Status::Failed);
+    } else {
+      return failed ? Status::Failed : Status::Pending;
+    }
+  }
+
+  template <size_t I> void dispatchWinner() {
+    if constexpr (I < sizeof...(S)) {
+      if (winner == I) {
+        std::get<I>(steps).dispatch();
+      } else {
+        dispatchWinner<I + 1>();
+      }
+    }
+  }
+
+  template <size_t I> bool wakeAt(unsigned long &at, bool found) {
+    if constexpr (I < sizeof...(S)) {
+      if (statuses[I] == Status::Pending) {
+        unsigned long step_at;
+        if (!std::get<I>(steps).wake(step_at)) {
+          return false;
+        }
+        if (!found || isEarlier(step_at, at)) {
+          at = step_at;
+        }
+        found = true;
       }
+      return wakeAt<I + 1>(at, found);
+    } else {
+      return found;
     }
-    return task->isFinished();
   }
 
-  virtual void dispatch() override {
-    if (!aborted) {
-      task->finish();
+public:
+  Race(S... steps) : steps(std::move(steps)...) {}
+
+  void init() { initAll(std::index_sequence_for<S...>()); }
+  Status check() { return checkFrom<0>(true); }
+  void dispatch() { dispatchWinner<0>(); }
+  bool wake(unsigned long &at) { return wakeAt<0>(at, false); }
+};
+// STEPS END
+
+// The task the scheduler sees, wrapping the whole composed step
+template <typename S> class Composed : public ITask {
+private:
+  S step;
+  Status status = Status::Pending;
+
+public:
+  Composed(S step) : step(std::move(step)) {}
+
+  virtual boolean isStarted() override { return started; }
+  virtual void setup() override {
+    step.init();
+    started = true;
+  }
+  virtual boolean isFinished() override {
+    status = step.check();
+    if (status != Status::Pending) {
+      return true;
+    }
+    unsigned long at;
+    if (step.wake(at)) {
+      sleepUntil(at);
+    }
+    return false;
+  }
+  virtual void finish() override {
+    if (status == Status::Done) {
+      step.dispatch();
     }
   }
 };
 
-#endif
\ No newline at end of file
+// API
+template <typename F> Once<F> once(F fn) { return Once<F>(std::move(fn)); }
+
+template <typename F> Poll<F> poll(F work) { return Poll<F>(std::move(work)); }
+
+// Runs `work` every `delay` ms until it is done
+template <typename F>
+Timed<F> timed(unsigned long delay, F work, bool immediate = true) {
+  return Timed<F>(delay, std::move(work), immediate);
+}
+
+template <typename S, typename F> Then<S, F> then(S step, F callback) {
+  return Then<S, F>(std::move(step), std::move(callback));
+}
+
+template <typename S> Dependent<S> dependent(Scope &scope, S step) {
+  return Dependent<S>(scope, std::move(step));
+}
+
+template <typename S> Retry<S> retry(unsigned int attempts, S step) {
+  return Retry<S>(attempts, std::move(step));
+}
+
+template <typename... S> Sequence<S...> sequence(S... steps) {
+  return Sequence<S...>(std::move(steps)...);
+}
+
+template <typename... S> Race<S...> race(S... steps) {
+  return Race<S...>(std::move(steps)...);
+}
+
+template <typename S> TaskRef *spawn(S step, Scope *scope = nullptr) {
+  return queueTask(new Composed<S>(std::move(step)), scope);
+}
+
+template <typename S> TaskRef *spawn(Dependent<S> step) {
+  auto scope = step.scope;
+  return queueTask(new Composed<Dependent<S>>(std::move(step)), scope);
+}
+// API END
+
+} // namespace Tasks
+
+#endif
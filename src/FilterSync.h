@@ -0,0 +1,82 @@
+#ifndef FILTER_SYNC_H
+#define FILTER_SYNC_H
+
+#include <Arduino.h>
+#include <cstddef>
+#include <map>
+#include <set>
+
+// The filters the broker should be subscribed to, against those it was
+// told about. Changes are staged and sent in one go by flush(), so a filter
+// dropped and taken again in between, e.g. while a config is replaced,
+// never reaches the broker.
+//
+// Not thread safe, it lives with the client.
+class FilterSync {
+private:
+  // Subscribed to, as far as the broker was told
+  std::set<String> current;
+  // Staged since the last flush, true to subscribe
+  std::map<String, bool> changes;
+  // Connected since the boot
+  bool connected = false;
+
+public:
+  void subscribe(const char *filter) { changes[String(filter)] = true; }
+  void unsubscribe(const char *filter) { changes[String(filter)] = false; }
+
+  // A new connection. A broker that kept the session still has the
+  // filters, otherwise they are sent again unless dropped meanwhile. What a
+  // session kept from before the boot is unknown, so on the first one the
+  // filters are sent again either way and the dropped ones unsubscribed.
+  void restart(bool session_present) {
+    if (session_present && connected) {
+      return;
+    }
+    for (auto &filter : current) {
+      changes.emplace(filter, true);
+    }
+    current.clear();
+    if (!connected) {
+      for (auto &change : changes) {
+        if (!change.second) {
+          current.insert(change.first);
+        }
+      }
+      connected = true;
+    }
+  }
+
+  // Sends the staged changes the broker does not know about yet with
+  // `subscribe(filter)` and `unsubscribe(filter)`, which return false when
+  // the client did not take them. Returns how many were sent.
+  template <typename S, typename U> size_t flush(S subscribe, U unsubscribe) {
+    size_t sent = 0;
+    for (auto change = changes.begin(); change != changes.end();) {
+      auto &filter = change->first;
+      auto wanted = change->second;
+      if (wanted != (current.count(filter) != 0)) {
+        if (!(wanted ? subscribe(filter.c_str())
+                     : unsubscribe(filter.c_str()))) {
+          return sent;
+        }
+        if (wanted) {
+          current.insert(filter);
+        } else {
+          current.erase(filter);
+        }
+        sent++;
+      }
+      change = changes.erase(change);
+    }
+    return sent;
+  }
+
+  bool has(const char *filter) const {
+    return current.count(String(filter)) != 0;
+  }
+  size_t size() const { return current.size(); }
+  size_t pending() const { return changes.size(); }
+};
+
+#endif
@@ -0,0 +1,158 @@
+#ifndef FLOW_H
+#define FLOW_H
+
+#include <Arduino.h>
+#include <CustomTasks.h>
+#include <Tasks.h>
+#include <atomic>
+
+// Stackless resumable tasks. A flow is a task whose run() is written as a
+// straight sequence of steps with FLOW_* awaits in between. Awaiting records
+// the line to resume from and returns to the scheduler, so nothing is
+// allocated per step. Locals do not survive an await, keep state in members.
+//
+//   class Blink : public Tasks::Flow<Blink> {
+//   public:
+//     Blink() : Flow("blink") {}
+//
+//     Tasks::Status run() {
+//       FLOW_BEGIN();
+//       while (true) {
+//         digitalWrite(LED_BUILTIN, HIGH);
+//         FLOW_SLEEP(500);
+//         digitalWrite(LED_BUILTIN, LOW);
+//         FLOW_SLEEP(500);
+//       }
+//       FLOW_END();
+//     }
+//   };
+
+#define FLOW_BEGIN()                                                           \
+  switch (this->resume_point) {                                                \
+  case 0:
+
+#define FLOW_END()                                                             \
+  }                                                                            \
+  this->resume_point = 0;                                                      \
+  return Tasks::Status::Done
+
+// Resumes once `cond` holds, checked on every pass
+#define FLOW_AWAIT(cond)                                                       \
+  do {                                                                         \
+    this->pollWait();                                                          \
+    this->resume_point = __LINE__;                                             \
+  case __LINE__:                                                               \
+    if (!(cond)) {                                                             \
+      return Tasks::Status::Pending;                                           \
+    }                                                                          \
+  } while (0)
+
+// Resumes after `ms`, the task is parked meanwhile
+#define FLOW_SLEEP(ms)                                                         \
+  do {                                                                         \
+    this->waitFor((ms), true);                                                 \
+    this->resume_point = __LINE__;                                             \
+  case __LINE__:                                                               \
+    if (!this->isWaitOver()) {                                                 \
+      return Tasks::Status::Pending;                                           \
+    }                                                                          \
+  } while (0)
+
+// Resumes once `cond` holds or after `ms`, whichever comes first, so `cond`
+// has to be checked again afterwards
+#define FLOW_AWAIT_FOR(cond, ms)                                               \
+  do {                                                                         \
+    this->waitFor((ms), false);                                                \
+    this->resume_point = __LINE__;                                             \
+  case __LINE__:                                                               \
+    if (!(cond) && !this->isWaitOver()) {                                      \
+      return Tasks::Status::Pending;                                           \
+    }                                                                          \
+  } while (0)
+
+// Aborts the flow without finishing it
+#define FLOW_FAIL()                                                            \
+  do {                                                                         \
+    this->resume_point = 0;                                                    \
+    return Tasks::Status::Failed;                                              \
+  } while (0)
+
+namespace Tasks {
+
+// One-shot flag raised from any context (WiFi events, AsyncTCP callbacks)
+// and consumed from a flow. It never touches the scheduler itself.
+class Event {
+private:
+  std::atomic<bool> fired{false};
+
+public:
+  void set() { fired.store(true); }
+  void clear() { fired.store(false); }
+  bool isSet() const { return fired.load(); }
+  // Consumes the event, true if it was set
+  bool take() { return fired.exchange(false); }
+};
+
+template <typename D> class Flow : public ITask {
+protected:
+  int resume_point = 0;
+
+private:
+  const char *name;
+  unsigned long wait_start = 0;
+  unsigned long wait_ms = 0;
+  bool parkable = false;
+  unsigned long started_at = 0;
+  unsigned long marked_at = 0;
+
+protected:
+  void waitFor(unsigned long ms, bool park) {
+    wait_start = now();
+    wait_ms = ms;
+    parkable = park;
+  }
+  void pollWait() { parkable = false; }
+  bool isWaitOver() const { return now() - wait_start >= wait_ms; }
+
+  // Logs how long the flow took to reach `step`, since the previous step
+  // and since it started
+  void mark(const char *step) {
+    auto curr_millis = now();
+    Serial.print("[");
+    Serial.print(name);
+    Serial.print("] ");
+    Serial.print(step);
+    Serial.print(" +");
+    Serial.print(curr_millis - marked_at);
+    Serial.print(" ms (");
+    Serial.print(curr_millis - started_at);
+    Serial.println(" ms total)");
+    marked_at = curr_millis;
+  }
+
+  // Restarts the step clock, e.g. when the flow starts over after a drop
+  void restartClock() { started_at = marked_at = now(); }
+
+public:
+  Flow(const char *name) : name(name) { Tasks::name(this, name); }
+
+  virtual boolean isStarted() override { return started; }
+  virtual void setup() override {
+    restartClock();
+    started = true;
+  }
+  virtual boolean isFinished() override {
+    if (static_cast<D *>(this)->run() != Status::Pending) {
+      return true;
+    }
+    if (parkable) {
+      sleepUntil(wait_start + wait_ms);
+    }
+    return false;
+  }
+  virtual void finish() override {}
+};
+
+} // namespace Tasks
+
+#endif
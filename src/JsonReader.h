@@ -0,0 +1,451 @@
+#ifndef JSON_READER_H
+#define JSON_READER_H
+
+#include <Arduino.h>
+#include <climits>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+
+// Deepest nesting skip() and printJsonPretty() go through, bounds the stack
+#ifndef JSON_MAX_DEPTH
+#define JSON_MAX_DEPTH 16
+#endif
+
+// Text inside a JSON message, read in place. String contents keep their
+// escapes, toString() resolves them.
+struct TextView {
+  const char *data = nullptr;
+  size_t len = 0;
+  bool escaped = false;
+
+  bool empty() const { return len == 0; }
+
+  String toString() const {
+    if (!escaped) {
+      return String(data, len);
+    }
+    String text;
+    text.reserve(len);
+    for (size_t i = 0; i < len; i++) {
+      if (data[i] != '\\' || i + 1 == len) {
+        text += data[i];
+        continue;
+      }
+      switch (data[++i]) {
+      case 'b':
+        text += '\b';
+        break;
+      case 'f':
+        text += '\f';
+        break;
+      case 'n':
+        text += '\n';
+        break;
+      case 'r':
+        text += '\r';
+        break;
+      case 't':
+        text += '\t';
+        break;
+      case 'u':
+        i += appendCodePoint(text, i + 1);
+        break;
+      default:
+        text += data[i];
+      }
+    }
+    return text;
+  }
+
+  bool equals(const char *other, size_t other_len) const {
+    if (escaped) {
+      auto text = toString();
+      return text.length() == other_len &&
+             memcmp(text.c_str(), other, other_len) == 0;
+    }
+    return len == other_len && memcmp(data, other, len) == 0;
+  }
+  bool equals(const String &other) const {
+    return equals(other.c_str(), other.length());
+  }
+  bool equals(const char *other) const {
+    return equals(other, strlen(other));
+  }
+
+private:
+  static int hex(char c) {
+    if (c >= '0' && c <= '9') {
+      return c - '0';
+    }
+    if ((c | 0x20) >= 'a' && (c | 0x20) <= 'f') {
+      return (c | 0x20) - 'a' + 10;
+    }
+    return -1;
+  }
+
+  // Four hex digits at `at`, -1 when they are not
+  long hex4(size_t at) const {
+    if (at + 4 > len) {
+      return -1;
+    }
+    long value = 0;
+    for (size_t i = at; i < at + 4; i++) {
+      auto digit = hex(data[i]);
+      if (digit < 0) {
+        return -1;
+      }
+      value = value << 4 | digit;
+    }
+    return value;
+  }
+
+  // Appends the code point of the `\u` escape whose digits start at `at`,
+  // as UTF-8. Returns how many characters it took past the `u`.
+  size_t appendCodePoint(String &text, size_t at) const {
+    auto code = hex4(at);
+    if (code < 0) {
+      text += 'u';
+      return 0;
+    }
+    size_t used = 4;
+    // A surrogate pair, the low half follows as another escape
+    if (code >= 0xD800 && code < 0xDC00 && at + 10 <= len &&
+        data[at + 4] == '\\' && data[at + 5] == 'u') {
+      auto low = hex4(at + 6);
+      if (low >= 0xDC00 && low < 0xE000) {
+        code = 0x10000 + ((code - 0xD800) << 10) + (low - 0xDC00);
+        used = 10;
+      }
+    }
+    if (code < 0x80) {
+      text += (char)code;
+    } else if (code < 0x800) {
+      text += (char)(0xC0 | code >> 6);
+      text += (char)(0x80 | (code & 0x3F));
+    } else if (code < 0x10000) {
+      text += (char)(0xE0 | code >> 12);
+      text += (char)(0x80 | (code >> 6 & 0x3F));
+      text += (char)(0x80 | (code & 0x3F));
+    } else {
+      text += (char)(0xF0 | code >> 18);
+      text += (char)(0x80 | (code >> 12 & 0x3F));
+      text += (char)(0x80 | (code >> 6 & 0x3F));
+      text += (char)(0x80 | (code & 0x3F));
+    }
+    return used;
+  }
+};
+
+// Pull reader over a JSON message, which it neither copies nor changes.
+// Nothing is allocated: values are read as they come, as views or numbers,
+// and what the caller does not ask for is skipped. Any malformed input
+// makes every later read fail.
+class JsonReader {
+private:
+  const char *at;
+  const char *end;
+  bool failed = false;
+
+  bool fail() {
+    failed = true;
+    return false;
+  }
+
+  void skipSpace() {
+    while (at != end &&
+           (*at == ' ' || *at == '\t' || *at == '\n' || *at == '\r')) {
+      at++;
+    }
+  }
+
+  bool token(const char *literal) {
+    auto len = strlen(literal);
+    if ((size_t)(end - at) < len || memcmp(at, literal, len) != 0) {
+      return fail();
+    }
+    at += len;
+    return true;
+  }
+
+  static bool isNumberChar(char c) {
+    return (c >= '0' && c <= '9') || c == '-' || c == '+' || c == '.' ||
+           c == 'e' || c == 'E';
+  }
+
+  bool skip(int depth) {
+    if (depth > JSON_MAX_DEPTH) {
+      return fail();
+    }
+    skipSpace();
+    if (at == end) {
+      return fail();
+    }
+    switch (*at) {
+    case '{':
+      return object([&](const TextView &key) { return skip(depth + 1); });
+    case '[':
+      return array([&]() { return skip(depth + 1); });
+    default:
+      TextView value;
+      return scalar(value);
+    }
+  }
+
+public:
+  JsonReader(const char *json, size_t len) : at(json), end(json + len) {}
+
+  bool ok() const { return !failed; }
+
+  // Whether only whitespace is left
+  bool done() {
+    skipSpace();
+    return !failed && at == end;
+  }
+
+  // Checks and consumes `c`, the next character past whitespace
+  bool expect(char c) {
+    skipSpace();
+    if (failed || at == end || *at != c) {
+      return fail();
+    }
+    at++;
+    return true;
+  }
+
+  // Reads an object, `member(key)` has to read or skip its value
+  template <typename F> bool object(F member) {
+    if (!expect('{')) {
+      return false;
+    }
+    skipSpace();
+    if (at != end && *at == '}') {
+      at++;
+      return true;
+    }
+    while (true) {
+      TextView key;
+      if (!string(key) || !expect(':') || !member(key) || failed) {
+        return fail();
+      }
+      skipSpace();
+      if (at == end || *at != ',') {
+        return expect('}');
+      }
+      at++;
+    }
+  }
+
+  // Reads an array, `element()` has to read or skip each element
+  template <typename F> bool array(F element) {
+    if (!expect('[')) {
+      return false;
+    }
+    skipSpace();
+    if (at != end && *at == ']') {
+      at++;
+      return true;
+    }
+    while (true) {
+      if (!element() || failed) {
+        return fail();
+      }
+      skipSpace();
+      if (at == end || *at != ',') {
+        return expect(']');
+      }
+      at++;
+    }
+  }
+
+  bool string(TextView &value) {
+    if (!expect('"')) {
+      return false;
+    }
+    value.data = at;
+    value.escaped = false;
+    while (at != end && *at != '"') {
+      if ((unsigned char)*at < 0x20) {
+        return fail();
+      }
+      if (*at == '\\') {
+        value.escaped = true;
+        if (++at == end) {
+          return fail();
+        }
+      }
+      at++;
+    }
+    if (at == end) {
+      return fail();
+    }
+    value.len = at - value.data;
+    at++;
+    return true;
+  }
+
+  // A string, number, boolean or null, strings without their quotes and
+  // the rest as written
+  bool scalar(TextView &value) {
+    skipSpace();
+    if (failed || at == end) {
+      return fail();
+    }
+    if (*at == '"') {
+      return string(value);
+    }
+    value.data = at;
+    value.escaped = false;
+    switch (*at) {
+    case 't':
+      token("true");
+      break;
+    case 'f':
+      token("false");
+      break;
+    case 'n':
+      token("null");
+      break;
+    default:
+      while (at != end && isNumberChar(*at)) {
+        at++;
+      }
+      if (at == value.data) {
+        return fail();
+      }
+    }
+    value.len = at - value.data;
+    return !failed;
+  }
+
+  // A whole number, anything else fails. A fraction of zeros, as in `1.0`,
+  // is taken, some serializers write whole numbers that way.
+  bool integer(long &value) {
+    skipSpace();
+    if (failed || at == end) {
+      return fail();
+    }
+    auto negative = *at == '-';
+    if (negative) {
+      at++;
+    }
+    if (at == end || *at < '0' || *at > '9') {
+      return fail();
+    }
+    value = 0;
+    while (at != end && *at >= '0' && *at <= '9') {
+      if (value > (LONG_MAX - 9) / 10) {
+        return fail();
+      }
+      value = value * 10 + (*at++ - '0');
+    }
+    if (at != end && *at == '.') {
+      if (++at == end || *at < '0' || *at > '9') {
+        return fail();
+      }
+      while (at != end && *at == '0') {
+        at++;
+      }
+    }
+    if (at != end && isNumberChar(*at)) {
+      return fail();
+    }
+    if (negative) {
+      value = -value;
+    }
+    return true;
+  }
+
+  // Fails past the range of an int, where long is the wider of the two
+  bool integer(int &value) {
+    long read;
+    if (!integer(read)) {
+      return false;
+    }
+    if (read < INT_MIN || read > INT_MAX) {
+      return fail();
+    }
+    value = (int)read;
+    return true;
+  }
+
+  // A whole number, or null which leaves `value` as it is, as if the member
+  // was not there
+  bool integerOrNull(int &value) {
+    skipSpace();
+    if (!failed && at != end && *at == 'n') {
+      return token("null");
+    }
+    return integer(value);
+  }
+
+  // Reads past any value
+  bool skip() { return skip(0); }
+};
+
+// Writes the JSON message indented, token by token as it goes, so it does
+// not have to fit a document first. Returns false when it is malformed,
+// the output stops there.
+inline bool printJsonPretty(Print &out, const char *json, size_t len) {
+  int depth = 0;
+  auto newline = [&out](int indent) {
+    out.print('\n');
+    for (int i = 0; i < indent; i++) {
+      out.print("  ");
+    }
+  };
+  for (size_t i = 0; i < len; i++) {
+    auto c = json[i];
+    switch (c) {
+    case '"': {
+      auto start = i++;
+      while (i < len && json[i] != '"') {
+        i += json[i] == '\\' ? 2 : 1;
+      }
+      if (i >= len) {
+        return false;
+      }
+      out.write((const uint8_t *)json + start, i - start + 1);
+      break;
+    }
+    case '{':
+    case '[':
+      if (++depth > JSON_MAX_DEPTH) {
+        return false;
+      }
+      out.print(c);
+      // Empty ones stay on their line
+      if (i + 1 < len && json[i + 1] != '}' && json[i + 1] != ']') {
+        newline(depth);
+      }
+      break;
+    case '}':
+    case ']':
+      if (--depth < 0) {
+        return false;
+      }
+      if (json[i - 1] != '{' && json[i - 1] != '[') {
+        newline(depth);
+      }
+      out.print(c);
+      break;
+    case ',':
+      out.print(c);
+      newline(depth);
+      break;
+    case ':':
+      out.print(": ");
+      break;
+    case ' ':
+    case '\t':
+    case '\n':
+    case '\r':
+      break;
+    default:
+      out.print(c);
+    }
+  }
+  return depth == 0;
+}
+
+#endif
@@ -0,0 +1,272 @@
+#ifndef MQTT_INBOX_H
+#define MQTT_INBOX_H
+
+#include <Arduino.h>
+#include <Channel.h>
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+
+// Messages waiting to be handled, a power of two
+#ifndef MQTT_INBOX_SLOTS
+#define MQTT_INBOX_SLOTS 16
+#endif
+
+// Longest topic and payload a message may have, longer ones are dropped
+#ifndef MQTT_TOPIC_SIZE
+#define MQTT_TOPIC_SIZE 64
+#endif
+
+#ifndef MQTT_PAYLOAD_SIZE
+#define MQTT_PAYLOAD_SIZE 512
+#endif
+
+// Longest payload of all, e.g. a config with many entries. A single buffer
+// of this size takes them one at a time, rather than every slot growing to
+// it: 4 KB against 16 times that.
+#ifndef MQTT_LARGE_PAYLOAD_SIZE
+#define MQTT_LARGE_PAYLOAD_SIZE 4096
+#endif
+
+// Most messages drain() handles per call, and the time it may take for
+// them. The first message is always handled.
+#ifndef MQTT_DRAIN_BATCH
+#define MQTT_DRAIN_BATCH 8
+#endif
+
+#ifndef MQTT_DRAIN_BUDGET_US
+#define MQTT_DRAIN_BUDGET_US 1000
+#endif
+
+typedef struct {
+  char topic[MQTT_TOPIC_SIZE + 1];
+  char payload[MQTT_PAYLOAD_SIZE + 1];
+  // Where the payload is, `payload` or the large buffer for longer ones
+  char *data;
+  size_t len;
+  unsigned long session;
+  unsigned long received_us;
+} MqttSlot;
+
+typedef struct {
+  unsigned long handled;
+  // Calls of drain() that handled anything
+  unsigned long batches;
+  size_t max_batch;
+  // Messages waiting when a batch started
+  size_t max_depth;
+  // From receiving a message to handling it
+  uint64_t total_delay_us;
+  unsigned long max_delay_us;
+  // State messages skipped for a newer value of their topic
+  unsigned long coalesced;
+} DrainStats;
+
+// Whether a topic carries state, where only the latest value matters
+typedef bool (*StateTopic)(const char *topic);
+
+// Inbound messages, from the AsyncTCP task that receives them to the task
+// that handles them. Topics and payloads are copied into preallocated
+// slots, both NUL terminated, so receiving never allocates. A payload too
+// long for its slot goes to the large buffer, while it is free. Messages
+// that do not fit, in size or in number, are counted and dropped.
+//
+// Only the receiving task may call receive() and clear(), only the handling
+// task the rest, bar the counters of dropped messages.
+class MqttInbox {
+private:
+  Tasks::Channel<MqttSlot, MQTT_INBOX_SLOTS> ring;
+  // Message being put together from its chunks
+  MqttSlot *open = nullptr;
+  std::atomic<unsigned long> session{0};
+  std::atomic<unsigned long> oversized{0};
+  char large[MQTT_LARGE_PAYLOAD_SIZE + 1];
+  // Held by a message from when its first chunk comes until it is dropped
+  std::atomic<bool> largeTaken{false};
+  DrainStats drained = {};
+  StateTopic isState = nullptr;
+
+  // Whether a newer value of the same state topic is waiting behind `slot`
+  bool superseded(const MqttSlot &slot) {
+    if (isState == nullptr || !isState(slot.topic)) {
+      return false;
+    }
+    for (size_t i = 1;; i++) {
+      auto next = ring.peek(i);
+      if (next == nullptr) {
+        return false;
+      }
+      if (next->session == slot.session &&
+          strcmp(next->topic, slot.topic) == 0) {
+        return true;
+      }
+    }
+  }
+
+  // Lets go of the message being put together, receiving side
+  void abandon() {
+    if (open != nullptr && open->data == large) {
+      largeTaken.store(false, std::memory_order_relaxed);
+    }
+    open = nullptr;
+  }
+
+  // Lets go of the oldest message, handling side
+  void release() {
+    auto slot = ring.front();
+    if (slot != nullptr && slot->data == large) {
+      largeTaken.store(false, std::memory_order_release);
+    }
+    ring.drop();
+  }
+
+public:
+  // Takes a chunk of a message, as AsyncMqttClient hands them over. False
+  // when the message is dropped.
+  bool receive(const char *topic, const char *payload, size_t len,
+               size_t index, size_t total) {
+    if (index == 0) {
+      abandon();
+      auto topic_len = strlen(topic);
+      auto isLarge = total > MQTT_PAYLOAD_SIZE;
+      if (topic_len > MQTT_TOPIC_SIZE || total > MQTT_LARGE_PAYLOAD_SIZE ||
+          (isLarge && largeTaken.exchange(true, std::memory_order_acquire))) {
+        oversized.fetch_add(1, std::memory_order_relaxed);
+        return false;
+      }
+      open = ring.claim();
+      if (open == nullptr) {
+        if (isLarge) {
+          largeTaken.store(false, std::memory_order_relaxed);
+        }
+        return false;
+      }
+      memcpy(open->topic, topic, topic_len + 1);
+      open->data = isLarge ? large : open->payload;
+      open->len = 0;
+      open->session = session.load(std::memory_order_relaxed);
+    }
+    // Rest of a dropped message
+    if (open == nullptr || index != open->len || index + len > total) {
+      abandon();
+      return false;
+    }
+    memcpy(open->data + index, payload, len);
+    open->len += len;
+    if (open->len == total) {
+      open->data[total] = '\0';
+      open->received_us = micros();
+      open = nullptr;
+      ring.commit();
+    }
+    return true;
+  }
+
+  // Forgets the messages received so far, once the session they belong to
+  // is over
+  void clear() {
+    abandon();
+    session.fetch_add(1, std::memory_order_release);
+  }
+
+  // Oldest message of the current session, nullptr when there is none
+  const MqttSlot *front() {
+    auto current = session.load(std::memory_order_acquire);
+    for (auto slot = ring.front(); slot != nullptr; slot = ring.front()) {
+      if (slot->session == current) {
+        return slot;
+      }
+      release();
+    }
+    return nullptr;
+  }
+
+  void drop() { release(); }
+
+  // Opts in to last value wins: drain() skips messages of the topics
+  // `isState` picks while a newer one of the same topic is waiting. The
+  // others, e.g. config and control topics, are all handled in order.
+  // nullptr turns it off.
+  void coalesce(StateTopic isState) { this->isState = isState; }
+
+  // Handles waiting messages in order, with `fn(slot)` returning false to
+  // leave a message waiting, until none is left or the batch is full.
+  // Returns how many were handled.
+  template <typename F>
+  size_t drain(F fn, size_t max_batch = MQTT_DRAIN_BATCH,
+               unsigned long budget_us = MQTT_DRAIN_BUDGET_US) {
+    auto start = micros();
+    auto depth = size();
+    size_t count = 0;
+    for (auto slot = front(); slot != nullptr; slot = front()) {
+      if (superseded(*slot)) {
+        drop();
+        drained.coalesced++;
+        continue;
+      }
+      auto delay = micros() - slot->received_us;
+      if (!fn(*slot)) {
+        break;
+      }
+      drop();
+      count++;
+      drained.total_delay_us += delay;
+      drained.max_delay_us = std::max(drained.max_delay_us, delay);
+      if (count == max_batch || micros() - start >= budget_us) {
+        break;
+      }
+    }
+    if (count != 0) {
+      drained.handled += count;
+      drained.batches++;
+      drained.max_batch = std::max(drained.max_batch, count);
+      drained.max_depth = std::max(drained.max_depth, depth);
+    }
+    return count;
+  }
+
+  const DrainStats &stats() const { return drained; }
+  void resetStats() { drained = {}; }
+
+  // Writes the stats as one JSON object
+  void dumpStats(Print &out) const {
+    out.print("{\"handled\":");
+    out.print(drained.handled);
+    out.print(",\"batches\":");
+    out.print(drained.batches);
+    out.print(",\"max_batch\":");
+    out.print((unsigned long)drained.max_batch);
+    out.print(",\"depth\":");
+    out.print((unsigned long)size());
+    out.print(",\"max_depth\":");
+    out.print((unsigned long)drained.max_depth);
+    out.print(",\"avg_delay_us\":");
+    out.print(drained.handled ? (unsigned long)(drained.total_delay_us /
+                                                drained.handled)
+                              : 0UL);
+    out.print(",\"max_delay_us\":");
+    out.print(drained.max_delay_us);
+    out.print(",\"coalesced\":");
+    out.print(drained.coalesced);
+    out.print(",\"full\":");
+    out.print(full());
+    out.print(",\"too_large\":");
+    out.print(tooLarge());
+    out.print("}");
+  }
+
+  size_t size() const { return ring.size(); }
+  size_t capacity() const { return ring.capacity(); }
+
+  // Messages dropped because every slot was taken
+  unsigned long full() const { return ring.full(); }
+  // Messages dropped because they did not fit a slot, or the large buffer
+  // was taken
+  unsigned long tooLarge() const {
+    return oversized.load(std::memory_order_relaxed);
+  }
+};
+
+#endif
@@ -8,6 +8,7 @@
 #endif
 
 #include <Data.h>
+#include <Tasks.h>
 #include <mDNSResolver.h>
 
 namespace MyWiFi {
@@ -29,13 +30,16 @@ typedef struct {
 } WiFiConfig;
 
 WiFiConfig conf;
-std::shared_ptr<boolean> dependency = nullptr;
+// Tasks that need a WiFi connection, cancelled on disconnect
+Tasks::Scope scope(nullptr, false);
+// Connection changes, raised from the WiFi event task
+Tasks::ScopeSignal signal(scope);
 
 void onWifiConnect(WiFiEvent_t event, WiFiEventInfo_t info) {
   lastState = true;
   Serial.print("IP address: ");
   Serial.println(WiFi.localIP());
-  dependency = std::make_shared<boolean>(true);
+  signal.renew();
   if (conf.onConnect != nullptr) {
     conf.onConnect();
   }
@@ -47,9 +51,7 @@ void onWifiDisconnect(WiFiEvent_t event, WiFiEventInfo_t info) {
   }
   lastState = false;
   Serial.println("Disconnected from WiFi");
-  if (dependency != nullptr) {
-    *dependency = false;
-  }
+  signal.cancel();
   if (conf.onDisconnect != nullptr) {
     conf.onDisconnect();
   }
@@ -0,0 +1,236 @@
+#ifndef OFFLINE_LOG_H
+#define OFFLINE_LOG_H
+
+#include <Arduino.h>
+#include <PublishQueue.h>
+#include <Tasks.h>
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+
+#if defined(ESP32) && defined(MQTT_OFFLINE_SPILL)
+#include <LittleFS.h>
+#endif
+
+// Publishes kept in RAM while offline
+#ifndef MQTT_OFFLINE_SLOTS
+#define MQTT_OFFLINE_SLOTS 64
+#endif
+
+// Publishes replayed per second once back online
+#ifndef MQTT_REPLAY_PER_S
+#define MQTT_REPLAY_PER_S 20
+#endif
+
+// Publishes kept in flash past the RAM ones, with -D MQTT_OFFLINE_SPILL
+#ifndef MQTT_OFFLINE_SPILL_RECORDS
+#define MQTT_OFFLINE_SPILL_RECORDS 1024
+#endif
+
+typedef struct {
+  char topic[MQTT_PUBLISH_TOPIC_SIZE + 1];
+  char payload[MQTT_PUBLISH_PAYLOAD_SIZE + 1];
+  uint8_t qos;
+} OfflineRecord;
+
+typedef struct {
+  unsigned long captured;
+  unsigned long replayed;
+  // Oldest records overwritten once full, or too large to keep
+  unsigned long dropped;
+  unsigned long spilled;
+} OfflineStats;
+
+// Older records than the RAM ring holds, e.g. in flash. Records come back
+// in the order they went in.
+class OfflineSpill {
+public:
+  virtual ~OfflineSpill() {}
+  virtual bool write(const OfflineRecord &record) = 0;
+  // The oldest record, false when there is none
+  virtual bool front(OfflineRecord &record) = 0;
+  virtual void drop() = 0;
+  virtual size_t size() const = 0;
+};
+
+// Publishes made while the broker is out of reach, kept in order and sent
+// once it is back: one by one at a bounded rate, or compacted to the last
+// value of each topic. The oldest records are overwritten once the RAM ring
+// is full, or first handed to the spill if there is one.
+//
+// Not thread safe, it lives with the client.
+class OfflineLog {
+private:
+  OfflineRecord records[MQTT_OFFLINE_SLOTS];
+  size_t head = 0;
+  size_t count = 0;
+  unsigned long next_ms = 0;
+  OfflineSpill *spill;
+  OfflineStats counters = {};
+
+  OfflineRecord &oldest() { return records[head]; }
+
+  void dropOldest() {
+    head = (head + 1) % MQTT_OFFLINE_SLOTS;
+    count--;
+  }
+
+public:
+  OfflineLog(OfflineSpill *spill = nullptr) : spill(spill) {}
+
+  bool append(const char *topic, const char *payload, uint8_t qos) {
+    if (strlen(topic) > MQTT_PUBLISH_TOPIC_SIZE ||
+        strlen(payload) > MQTT_PUBLISH_PAYLOAD_SIZE) {
+      counters.dropped++;
+      return false;
+    }
+    if (count == MQTT_OFFLINE_SLOTS) {
+      if (spill != nullptr && spill->write(oldest())) {
+        counters.spilled++;
+      } else {
+        counters.dropped++;
+      }
+      dropOldest();
+    }
+    auto &record = records[(head + count) % MQTT_OFFLINE_SLOTS];
+    strcpy(record.topic, topic);
+    strcpy(record.payload, payload);
+    record.qos = qos;
+    count++;
+    counters.captured++;
+    return true;
+  }
+
+  // Sends the records due with `send(record)`, which returns false when the
+  // client did not take it, at most `per_s` of them a second. Returns how
+  // many went out.
+  template <typename F> size_t replay(F send, unsigned long per_s) {
+    auto now = Tasks::now();
+    auto interval = 1000 / std::max(per_s, 1UL);
+    // Unused time does not pile up into a burst
+    if ((long)(now - next_ms) > (long)interval) {
+      next_ms = now;
+    }
+    size_t sent = 0;
+    OfflineRecord spilled;
+    while (size() != 0 && (long)(now - next_ms) >= 0) {
+      auto from_spill = spill != nullptr && spill->front(spilled);
+      if (!from_spill && count == 0) {
+        break;
+      }
+      if (!send(from_spill ? spilled : oldest())) {
+        break;
+      }
+      if (from_spill) {
+        spill->drop();
+      } else {
+        dropOldest();
+      }
+      next_ms += interval;
+      counters.replayed++;
+      sent++;
+    }
+    return sent;
+  }
+
+  // Hands every record over at once with `offer(record)`, oldest first, so
+  // only the last value of each topic is left pending there
+  template <typename F> void compact(F offer) {
+    OfflineRecord spilled;
+    while (spill != nullptr && spill->front(spilled)) {
+      offer(spilled);
+      spill->drop();
+      counters.replayed++;
+    }
+    for (; count != 0; dropOldest()) {
+      offer(oldest());
+      counters.replayed++;
+    }
+  }
+
+  size_t size() const {
+    return count + (spill != nullptr ? spill->size() : 0);
+  }
+  bool empty() const { return size() == 0; }
+
+  const OfflineStats &stats() const { return counters; }
+
+  // Writes the stats as one JSON object
+  void dumpStats(Print &out) const {
+    out.print("{\"captured\":");
+    out.print(counters.captured);
+    out.print(",\"replayed\":");
+    out.print(counters.replayed);
+    out.print(",\"dropped\":");
+    out.print(counters.dropped);
+    out.print(",\"spilled\":");
+    out.print(counters.spilled);
+    out.print(",\"waiting\":");
+    out.print((unsigned long)size());
+    out.print("}");
+  }
+};
+
+#if defined(ESP32) && defined(MQTT_OFFLINE_SPILL)
+// Ring of fixed size records in a LittleFS file. Positions are kept in RAM
+// and the file starts over on boot, along with the RAM records.
+class FlashSpill : public OfflineSpill {
+private:
+  const char *path;
+  File file;
+  // Records ever written and read, the file holds the ones in between
+  unsigned long written = 0;
+  unsigned long read = 0;
+
+  bool seek(unsigned long index) {
+    return file.seek((index % MQTT_OFFLINE_SPILL_RECORDS) *
+                     sizeof(OfflineRecord));
+  }
+
+public:
+  FlashSpill(const char *path = "/mqtt-offline.bin") : path(path) {}
+
+  bool begin() {
+    if (!LittleFS.begin(true)) {
+      Serial.println("Could not mount LittleFS, offline spill disabled");
+      return false;
+    }
+    file = LittleFS.open(path, "w+");
+    return (bool)file;
+  }
+
+  bool write(const OfflineRecord &record) override {
+    if (!file || !seek(written)) {
+      return false;
+    }
+    if (file.write((const uint8_t *)&record, sizeof(record)) !=
+        sizeof(record)) {
+      return false;
+    }
+    written++;
+    // Full, the oldest record was overwritten
+    if (written - read > MQTT_OFFLINE_SPILL_RECORDS) {
+      read = written - MQTT_OFFLINE_SPILL_RECORDS;
+    }
+    return true;
+  }
+
+  bool front(OfflineRecord &record) override {
+    if (read == written || !seek(read)) {
+      return false;
+    }
+    return file.read((uint8_t *)&record, sizeof(record)) == sizeof(record);
+  }
+
+  void drop() override {
+    if (read != written) {
+      read++;
+    }
+  }
+
+  size_t size() const override { return written - read; }
+};
+#endif
+
+#endif
@@ -0,0 +1,314 @@
+#ifndef PUBLISH_QUEUE_H
+#define PUBLISH_QUEUE_H
+
+#include <Arduino.h>
+#include <Tasks.h>
+#include <algorithm>
+#include <climits>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+
+// Topics the queue keeps track of, pending or recently published
+#ifndef MQTT_PUBLISH_SLOTS
+#define MQTT_PUBLISH_SLOTS 8
+#endif
+
+#ifndef MQTT_PUBLISH_TOPIC_SIZE
+#define MQTT_PUBLISH_TOPIC_SIZE 32
+#endif
+
+#ifndef MQTT_PUBLISH_PAYLOAD_SIZE
+#define MQTT_PUBLISH_PAYLOAD_SIZE 64
+#endif
+
+// Shortest time between two publishes of a topic
+#ifndef MQTT_PUBLISH_INTERVAL_MS
+#define MQTT_PUBLISH_INTERVAL_MS 100
+#endif
+
+// QoS 1 publishes awaiting their PUBACK at once
+#ifndef MQTT_INFLIGHT_WINDOW
+#define MQTT_INFLIGHT_WINDOW 4
+#endif
+
+// Time without a PUBACK before a QoS 1 publish is sent again
+#ifndef MQTT_RETRY_MS
+#define MQTT_RETRY_MS 2000
+#endif
+
+// What offer() does with a new topic when every slot has a pending value
+enum class Overflow { DropOldest, Reject };
+
+typedef struct {
+  char topic[MQTT_PUBLISH_TOPIC_SIZE + 1];
+  char payload[MQTT_PUBLISH_PAYLOAD_SIZE + 1];
+  // Queued since, orders the pending values
+  unsigned long seq;
+  unsigned long sent_ms;
+  bool pending;
+  bool sent;
+  uint8_t qos;
+  // Packet awaiting its PUBACK, 0 for none
+  uint16_t packet_id;
+  unsigned long first_sent_ms;
+} PublishSlot;
+
+typedef struct {
+  unsigned long offered;
+  unsigned long published;
+  // Pending values replaced by a newer one of their topic
+  unsigned long coalesced;
+  // Values lost to a full queue, or too large to queue
+  unsigned long dropped;
+  // Flushes cut short because the client would not take more
+  unsigned long blocked;
+  unsigned long acked;
+  unsigned long retransmits;
+  // Unacknowledged publishes given up for a newer value of their topic
+  unsigned long superseded;
+  // From the first transmission of a QoS 1 publish to its PUBACK
+  unsigned long total_ack_ms;
+  unsigned long max_ack_ms;
+} PublishStats;
+
+// Outbound values, between the agents and the client. Each topic has at
+// most one pending value, newer values replace it, and is published at most
+// once per interval. flush() publishes the pending values oldest first and
+// stops as soon as the client refuses one, e.g. while its TCP buffer is
+// full, so a noisy output costs at most one publish per interval.
+//
+// QoS 1 values stay in their slot until acked(), up to a window of them,
+// and are sent again, flagged as duplicates, while no PUBACK comes. A newer
+// value of the topic supersedes an unacknowledged one. QoS 0 values are not
+// held back by a full window.
+//
+// Not thread safe, it lives with the client.
+class PublishQueue {
+private:
+  PublishSlot slots[MQTT_PUBLISH_SLOTS] = {};
+  unsigned long next_seq = 0;
+  unsigned long interval_ms;
+  Overflow overflow;
+  PublishStats counters = {};
+
+  PublishSlot *find(const char *topic) {
+    for (auto &slot : slots) {
+      if ((slot.pending || slot.sent) && strcmp(slot.topic, topic) == 0) {
+        return &slot;
+      }
+    }
+    return nullptr;
+  }
+
+  // Slot for a new topic, preferring the one published longest ago
+  PublishSlot *claim() {
+    PublishSlot *oldest = nullptr;
+    for (auto &slot : slots) {
+      if (!slot.pending && !slot.sent) {
+        return &slot;
+      }
+      if (!slot.pending && slot.packet_id == 0 &&
+          (oldest == nullptr || slot.sent_ms - oldest->sent_ms > LONG_MAX)) {
+        oldest = &slot;
+      }
+    }
+    if (oldest != nullptr || overflow == Overflow::Reject) {
+      return oldest;
+    }
+    for (auto &slot : slots) {
+      if (oldest == nullptr || slot.seq - oldest->seq > LONG_MAX) {
+        oldest = &slot;
+      }
+    }
+    counters.dropped++;
+    oldest->packet_id = 0;
+    return oldest;
+  }
+
+public:
+  PublishQueue(unsigned long interval_ms = MQTT_PUBLISH_INTERVAL_MS,
+               Overflow overflow = Overflow::DropOldest)
+      : interval_ms(interval_ms), overflow(overflow) {}
+
+  // Queues the value, replacing a pending or unacknowledged one of the
+  // topic. False when it could not be queued.
+  bool offer(const char *topic, const char *payload, uint8_t qos = 0) {
+    counters.offered++;
+    if (strlen(topic) > MQTT_PUBLISH_TOPIC_SIZE ||
+        strlen(payload) > MQTT_PUBLISH_PAYLOAD_SIZE) {
+      counters.dropped++;
+      return false;
+    }
+    auto slot = find(topic);
+    if (slot == nullptr) {
+      slot = claim();
+      if (slot == nullptr) {
+        counters.dropped++;
+        return false;
+      }
+      strcpy(slot->topic, topic);
+      slot->sent = false;
+      slot->pending = false;
+      slot->packet_id = 0;
+    }
+    if (slot->packet_id != 0) {
+      slot->packet_id = 0;
+      counters.superseded++;
+    }
+    if (slot->pending) {
+      counters.coalesced++;
+    } else {
+      slot->pending = true;
+      slot->seq = next_seq++;
+    }
+    strcpy(slot->payload, payload);
+    slot->qos = qos;
+    return true;
+  }
+
+  // Whether offer() would queue a value of the topic without replacing a
+  // pending or unacknowledged one, or dropping one of another topic. Values
+  // handed over one by one, e.g. a replay, wait for it to keep their order.
+  bool accepts(const char *topic) const {
+    auto room = false;
+    for (auto &slot : slots) {
+      if ((slot.pending || slot.sent) && strcmp(slot.topic, topic) == 0) {
+        return !slot.pending && slot.packet_id == 0;
+      }
+      room |= !slot.pending && slot.packet_id == 0;
+    }
+    return room;
+  }
+
+  // A PUBACK came for the packet
+  void acked(uint16_t packet_id) {
+    if (packet_id == 0) {
+      return;
+    }
+    for (auto &slot : slots) {
+      if (slot.packet_id == packet_id) {
+        slot.packet_id = 0;
+        auto latency = Tasks::now() - slot.first_sent_ms;
+        counters.acked++;
+        counters.total_ack_ms += latency;
+        counters.max_ack_ms = std::max(counters.max_ack_ms, latency);
+        return;
+      }
+    }
+  }
+
+  // Sends unacknowledged values again as new publishes, for a session that
+  // does not know about them
+  void requeue() {
+    for (auto &slot : slots) {
+      if (slot.packet_id != 0) {
+        slot.packet_id = 0;
+        slot.pending = true;
+      }
+    }
+  }
+
+  // Publishes the pending values due, and sends again the unacknowledged
+  // ones, with `send(topic, payload, qos, dup, packet_id)`. It returns the
+  // id of the packet, any but 0 for QoS 0, or 0 when the client did not take
+  // it. Returns how many went out.
+  template <typename F> size_t flush(F send) {
+    size_t count = 0;
+    auto now = Tasks::now();
+    for (auto &slot : slots) {
+      if (slot.packet_id == 0 || now - slot.sent_ms < MQTT_RETRY_MS) {
+        continue;
+      }
+      if (send(slot.topic, slot.payload, slot.qos, true, slot.packet_id) ==
+          0) {
+        counters.blocked++;
+        return count;
+      }
+      slot.sent_ms = now;
+      counters.retransmits++;
+      count++;
+    }
+    auto window = MQTT_INFLIGHT_WINDOW - inflight();
+    while (true) {
+      PublishSlot *next = nullptr;
+      for (auto &slot : slots) {
+        if (!slot.pending || (slot.sent && now - slot.sent_ms < interval_ms) ||
+            (slot.qos != 0 && window == 0)) {
+          continue;
+        }
+        if (next == nullptr || slot.seq - next->seq > LONG_MAX) {
+          next = &slot;
+        }
+      }
+      if (next == nullptr) {
+        return count;
+      }
+      auto packet_id = send(next->topic, next->payload, next->qos, false, 0);
+      if (packet_id == 0) {
+        counters.blocked++;
+        return count;
+      }
+      next->pending = false;
+      next->sent = true;
+      next->sent_ms = now;
+      if (next->qos != 0) {
+        next->packet_id = packet_id;
+        next->first_sent_ms = now;
+        window--;
+      }
+      counters.published++;
+      count++;
+    }
+  }
+
+  size_t pending() const {
+    size_t count = 0;
+    for (auto &slot : slots) {
+      count += slot.pending;
+    }
+    return count;
+  }
+
+  // QoS 1 publishes awaiting their PUBACK
+  size_t inflight() const {
+    size_t count = 0;
+    for (auto &slot : slots) {
+      count += slot.packet_id != 0;
+    }
+    return count;
+  }
+
+  const PublishStats &stats() const { return counters; }
+
+  // Writes the stats as one JSON object
+  void dumpStats(Print &out) const {
+    out.print("{\"offered\":");
+    out.print(counters.offered);
+    out.print(",\"published\":");
+    out.print(counters.published);
+    out.print(",\"coalesced\":");
+    out.print(counters.coalesced);
+    out.print(",\"dropped\":");
+    out.print(counters.dropped);
+    out.print(",\"blocked\":");
+    out.print(counters.blocked);
+    out.print(",\"pending\":");
+    out.print((unsigned long)pending());
+    out.print(",\"inflight\":");
+    out.print((unsigned long)inflight());
+    out.print(",\"acked\":");
+    out.print(counters.acked);
+    out.print(",\"retransmits\":");
+    out.print(counters.retransmits);
+    out.print(",\"superseded\":");
+    out.print(counters.superseded);
+    out.print(",\"avg_ack_ms\":");
+    out.print(counters.acked ? counters.total_ack_ms / counters.acked : 0UL);
+    out.print(",\"max_ack_ms\":");
+    out.print(counters.max_ack_ms);
+    out.print("}");
+  }
+};
+
+#endif
@@ -0,0 +1,78 @@
+#ifndef TASK_POOL_H
+#define TASK_POOL_H
+
+#include <cstddef>
+
+// Number of tasks (including the inner tasks of composites) alive at once
+#ifndef TASKS_POOL_SIZE
+#define TASKS_POOL_SIZE 32
+#endif
+
+// Size of one pool block, must fit the largest task type
+#ifndef TASKS_POOL_BLOCK
+#define TASKS_POOL_BLOCK (48 * sizeof(void *))
+#endif
+
+namespace Tasks {
+
+typedef struct {
+  size_t capacity;
+  size_t used;
+  size_t peak;
+  unsigned long exhausted;
+} PoolStats;
+
+// Fixed-capacity slab of equally sized blocks threaded on a free list.
+// Allocation never falls back to the heap, it fails and counts instead.
+template <size_t BlockSize, size_t Count> class Pool {
+private:
+  union Block {
+    Block *next;
+    alignas(std::max_align_t) unsigned char data[BlockSize];
+  };
+
+  Block blocks[Count];
+  Block *free_list = nullptr;
+  PoolStats stats = {.capacity = Count, .used = 0, .peak = 0, .exhausted = 0};
+
+public:
+  Pool() {
+    for (size_t i = Count; i > 0; i--) {
+      blocks[i - 1].next = free_list;
+      free_list = &blocks[i - 1];
+    }
+  }
+
+  void *allocate(size_t size) {
+    if (size > BlockSize || free_list == nullptr) {
+      stats.exhausted++;
+      return nullptr;
+    }
+    auto block = free_list;
+    free_list = block->next;
+    if (++stats.used > stats.peak) {
+      stats.peak = stats.used;
+    }
+    return block->data;
+  }
+
+  void deallocate(void *ptr) {
+    if (ptr == nullptr) {
+      return;
+    }
+    auto block = static_cast<Block *>(ptr);
+    block->next = free_list;
+    free_list = block;
+    stats.used--;
+  }
+
+  bool owns(const void *ptr) const {
+    return ptr >= (const void *)blocks && ptr < (const void *)(blocks + Count);
+  }
+
+  const PoolStats &getStats() const { return stats; }
+};
+
+} // namespace Tasks
+
+#endif
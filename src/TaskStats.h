@@ -0,0 +1,203 @@
+#ifndef TASK_STATS_H
+#define TASK_STATS_H
+
+#include <Arduino.h>
+#include <cstring>
+
+// Scheduler instrumentation, compiled in with -D TASKS_STATS. Without it the
+// probes are empty and the loop is untouched.
+//
+// Tasks are accounted per name (see Tasks::name()), so stats survive the
+// tasks themselves, e.g. across reconnects. Unnamed tasks share one slot.
+
+// Distinct task names tracked, the last slot collects the overflow
+#ifndef TASKS_STATS_SLOTS
+#define TASKS_STATS_SLOTS 12
+#endif
+
+// Default check budget, longer checks are counted as overruns
+#ifndef TASKS_STATS_BUDGET_US
+#define TASKS_STATS_BUDGET_US 5000
+#endif
+
+// Loop latency histogram buckets: [0, 64us), [64us, 128us), ... doubling
+#define TASKS_STATS_BUCKETS 12
+
+namespace Tasks {
+
+enum class Phase { Setup, Check, Finish };
+
+typedef struct {
+  const char *name;
+  unsigned long count[3];
+  unsigned long micros[3];
+  unsigned long overruns;
+} TaskStats;
+
+#ifdef TASKS_STATS
+namespace Stats {
+
+typedef struct {
+  unsigned long loops;
+  unsigned long overruns;
+  unsigned long budget_us;
+  unsigned long since_us;
+  unsigned long histogram[TASKS_STATS_BUCKETS];
+} LoopStats;
+
+namespace {
+TaskStats slots[TASKS_STATS_SLOTS];
+size_t slotCount = 0;
+LoopStats loopStats = {.loops = 0,
+                       .overruns = 0,
+                       .budget_us = TASKS_STATS_BUDGET_US,
+                       .since_us = 0,
+                       .histogram = {}};
+
+const char *const phaseNames[] = {"setup", "check", "finish"};
+} // namespace
+
+TaskStats *slotFor(const char *name) {
+  if (name == nullptr) {
+    name = "task";
+  }
+  for (size_t i = 0; i < slotCount; i++) {
+    if (strcmp(slots[i].name, name) == 0) {
+      return &slots[i];
+    }
+  }
+  if (slotCount == TASKS_STATS_SLOTS - 1 && strcmp(name, "other") != 0) {
+    return slotFor("other");
+  }
+  auto slot = &slots[slotCount++];
+  *slot = {};
+  slot->name = name;
+  return slot;
+}
+
+void setBudget(unsigned long budget_us) { loopStats.budget_us = budget_us; }
+
+const LoopStats &loops() { return loopStats; }
+const TaskStats *tasks(size_t &count) {
+  count = slotCount;
+  return slots;
+}
+
+void reset() {
+  for (size_t i = 0; i < slotCount; i++) {
+    auto name = slots[i].name;
+    slots[i] = {};
+    slots[i].name = name;
+  }
+  auto budget = loopStats.budget_us;
+  loopStats = {};
+  loopStats.budget_us = budget;
+  loopStats.since_us = micros();
+}
+
+void recordLoop(unsigned long elapsed_us) {
+  loopStats.loops++;
+  size_t bucket = 0;
+  for (auto us = elapsed_us >> 6; us != 0 && bucket < TASKS_STATS_BUCKETS - 1;
+       us >>= 1) {
+    bucket++;
+  }
+  loopStats.histogram[bucket]++;
+}
+
+void record(TaskStats *slot, Phase phase, unsigned long elapsed_us) {
+  auto i = (size_t)phase;
+  slot->count[i]++;
+  slot->micros[i] += elapsed_us;
+  if (phase == Phase::Check && elapsed_us > loopStats.budget_us) {
+    slot->overruns++;
+    loopStats.overruns++;
+  }
+}
+
+// Compact JSON, e.g. for a serial console or an MQTT diagnostics topic:
+// {"loops":..,"loops_per_s":..,"budget_us":..,"overruns":..,
+//  "loop_us_hist":[..],"tasks":{"<name>":{"setup":[count,us],
+//  "check":[count,us],"finish":[count,us],"overruns":..},..}}
+void dump(Print &out) {
+  auto elapsed_us = micros() - loopStats.since_us;
+  out.print("{\"loops\":");
+  out.print(loopStats.loops);
+  out.print(",\"loops_per_s\":");
+  out.print(elapsed_us ? (unsigned long)(loopStats.loops * 1000000.0 /
+                                         elapsed_us)
+                       : 0UL);
+  out.print(",\"budget_us\":");
+  out.print(loopStats.budget_us);
+  out.print(",\"overruns\":");
+  out.print(loopStats.overruns);
+  out.print(",\"loop_us_hist\":[");
+  for (size_t i = 0; i < TASKS_STATS_BUCKETS; i++) {
+    if (i != 0) {
+      out.print(',');
+    }
+    out.print(loopStats.histogram[i]);
+  }
+  out.print("],\"tasks\":{");
+  for (size_t i = 0; i < slotCount; i++) {
+    auto &slot = slots[i];
+    if (i != 0) {
+      out.print(',');
+    }
+    out.print('"');
+    out.print(slot.name);
+    out.print("\":{");
+    for (size_t phase = 0; phase < 3; phase++) {
+      out.print('"');
+      out.print(phaseNames[phase]);
+      out.print("\":[");
+      out.print(slot.count[phase]);
+      out.print(',');
+      out.print(slot.micros[phase]);
+      out.print("],");
+    }
+    out.print("\"overruns\":");
+    out.print(slot.overruns);
+    out.print('}');
+  }
+  out.print("}}");
+}
+
+} // namespace Stats
+
+// Times the enclosing scope into a task's slot
+class Probe {
+private:
+  TaskStats *slot;
+  Phase phase;
+  unsigned long start;
+
+public:
+  Probe(TaskStats *slot, Phase phase)
+      : slot(slot), phase(phase), start(micros()) {}
+  ~Probe() { Stats::record(slot, phase, micros() - start); }
+};
+
+class LoopProbe {
+private:
+  unsigned long start;
+
+public:
+  LoopProbe() : start(micros()) {}
+  ~LoopProbe() { Stats::recordLoop(micros() - start); }
+};
+#else
+class Probe {
+public:
+  Probe(TaskStats *slot, Phase phase) {}
+};
+
+class LoopProbe {
+public:
+  LoopProbe() {}
+};
+#endif
+
+} // namespace Tasks
+
+#endif
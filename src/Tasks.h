@@ -2,77 +2,208 @@
 #define TASKS_H
 
 #include <Arduino.h>
-#include <list>
-#include <map>
-#include <memory>
-#include <set>
-#include <variant>
+#include <Callable.h>
+#include <TaskPool.h>
+#include <TaskStats.h>
+#include <atomic>
+#include <climits>
+#include <cstdint>
+#include <type_traits>
+
+// Inline per-task state, enough for a timestamp plus a counter
+#ifndef TASKS_STATE_CAPACITY
+#define TASKS_STATE_CAPACITY (2 * sizeof(unsigned long))
+#endif
+
+// Time a loop pass may run for, realtime tasks included, before the I/O and
+// background tasks left are deferred to the next pass. Realtime tasks are
+// never deferred, and the I/O and background classes still check one task
+// each per pass once it is spent, so they are never starved.
+#ifndef TASKS_PASS_BUDGET_US
+#define TASKS_PASS_BUDGET_US 2000
+#endif
+
+// How late a parked task may be checked before it counts as a deadline miss
+#ifndef TASKS_DEADLINE_SLACK_MS
+#define TASKS_DEADLINE_SLACK_MS 2
+#endif
 
 namespace Tasks {
 
 // DEFINITIONS
 class TaskRef;
+class ITask;
+class Scope;
+class Scheduler;
 void NoOp(const TaskRef *ref);
 bool True(const TaskRef *ref);
+void cancel(const TaskRef *ref);
+void name(const TaskRef *ref, const char *name);
+
+// Scheduling classes, checked in this order on every loop pass
+enum class Priority { Realtime, Io, Background };
+const size_t PRIORITIES = 3;
+
+void prioritize(const TaskRef *ref, Priority priority);
 // DEFINITIONS END
 
 // INTERNALS
-using void_type =
-    std::variant<std::function<void(const TaskRef *)>, std::function<void()>>;
-using bool_type =
-    std::variant<std::function<bool(const TaskRef *)>, std::function<bool()>>;
-
+// Adapts callables that ignore the task reference without wrapping them in
+// another type-erased layer
 struct fn_discriminator {
-  std::function<void(const TaskRef *)>
-  operator()(const std::function<void(const TaskRef *)> &fn) const {
-    return [fn](const TaskRef *ref) { fn(ref); };
-  }
-  std::function<void(const TaskRef *)>
-  operator()(const std::function<void()> &fn) const {
-    return [fn](const TaskRef *ignored) { fn(); };
-  }
-
-  std::function<bool(const TaskRef *)>
-  operator()(const std::function<bool(const TaskRef *)> &fn) const {
-    // BUT WHY DO I SUCK AT PROGRAMMING
-    return [fn](const TaskRef *ref) { return fn(ref); };
-  }
-  std::function<bool(const TaskRef *)>
-  operator()(const std::function<bool()> &fn) const {
-    return [fn](const TaskRef *ignored) { return fn(); };
+  template <typename F> auto operator()(F fn) const {
+    if constexpr (std::is_invocable<F &, const TaskRef *>::value) {
+      return fn;
+    } else {
+      return [fn](const TaskRef *ignored) { return fn(); };
+    }
   }
 };
 const fn_discriminator discriminator;
+
+template <typename R> class TaskFn : public Callable<R(const TaskRef *)> {
+public:
+  template <typename F,
+            typename = std::enable_if_t<
+                !std::is_base_of<Callable<R(const TaskRef *)>,
+                                 std::decay_t<F>>::value>>
+  TaskFn(F fn) : Callable<R(const TaskRef *)>(discriminator(std::move(fn))) {}
+};
+
+using void_type = TaskFn<void>;
+using bool_type = TaskFn<bool>;
 // INTERNALS END
 
 // CLASSES
-class TaskRef {};
+class TaskRef {
+private:
+  mutable unsigned long wake_at = 0;
+  mutable bool sleeping = false;
+  alignas(std::max_align_t) mutable unsigned char
+      state_slot[TASKS_STATE_CAPACITY] = {};
+
+protected:
+  mutable bool cancelled = false;
+
+  // Consumes a pending sleepUntil() request, if any
+  bool takeWake(unsigned long &at) const {
+    if (!sleeping) {
+      return false;
+    }
+    sleeping = false;
+    at = wake_at;
+    return true;
+  }
+
+public:
+  // Parks the task until now() reaches `at` instead of checking it on
+  // every loop pass. Only honored when the current check returns false.
+  void sleepUntil(unsigned long at) const {
+    wake_at = at;
+    sleeping = true;
+  }
+
+  // Typed view over the state stored inline in the task, zero initialized.
+  // A task should only ever use a single type for its state.
+  template <typename T> T &state() const {
+    static_assert(sizeof(T) <= TASKS_STATE_CAPACITY,
+                  "Task state exceeds TASKS_STATE_CAPACITY");
+    static_assert(std::is_trivially_copyable<T>::value &&
+                      std::is_trivially_destructible<T>::value,
+                  "Task state must be a trivial type");
+    return *reinterpret_cast<T *>(state_slot);
+  }
+
+  // Set once the task was cancelled, it will not be checked nor finished
+  bool isCancelled() const { return cancelled; }
+};
 
 class ITask : public TaskRef {
+  friend class TaskList;
+  friend class TimerHeap;
+  friend class Scope;
+  friend class Scheduler;
+  friend void cancel(const TaskRef *ref);
+  friend void name(const TaskRef *ref, const char *name);
+  friend void prioritize(const TaskRef *ref, Priority priority);
+
+private:
+  static const size_t NOT_PARKED = SIZE_MAX;
+
+  // Scheduler bookkeeping
+  ITask *prev = nullptr;
+  ITask *next = nullptr;
+  size_t heap_index = NOT_PARKED;
+  Scheduler *owner = nullptr;
+  Priority priority = Priority::Io;
+  // Deadline the task was last woken for, until it is checked
+  bool due = false;
+  unsigned long due_at = 0;
+
+  // Scope membership
+  Scope *scope = nullptr;
+  ITask *scope_prev = nullptr;
+  ITask *scope_next = nullptr;
+
+#ifdef TASKS_STATS
+  const char *stats_name = nullptr;
+  TaskStats *stats = nullptr;
+#endif
+
 protected:
   boolean started = false;
 
 public:
-  virtual ~ITask(){};
+  virtual ~ITask();
+
+  // Where the task is accounted, nullptr when instrumentation is disabled
+  TaskStats *statsSlot() {
+#ifdef TASKS_STATS
+    if (stats == nullptr) {
+      stats = Stats::slotFor(stats_name);
+    }
+    return stats;
+#else
+    return nullptr;
+#endif
+  }
+
+  // Every task lives in the fixed task pool, nullptr when it is exhausted
+  static void *operator new(size_t size) noexcept;
+  static void operator delete(void *ptr);
 
   virtual boolean isStarted() = 0;
   virtual void setup() = 0;
   virtual boolean isFinished() = 0;
   virtual void finish() = 0;
+
+  // Deadline requested during the last isFinished() call, if any
+  virtual bool nextWake(unsigned long &at) { return takeWake(at); }
+
+  Priority getPriority() const { return priority; }
+
+  // Deadline the task was woken for, consumed by the check that follows
+  bool takeDue(unsigned long &at) {
+    if (!due) {
+      return false;
+    }
+    due = false;
+    at = due_at;
+    return true;
+  }
 };
 
 class Task : public ITask {
 private:
-  std::function<void(const TaskRef *)> setup_fn;
-  std::function<bool(const TaskRef *)> check_fn;
-  std::function<void(const TaskRef *)> callback_fn;
+  void_type setup_fn;
+  bool_type check_fn;
+  void_type callback_fn;
 
 public:
   Task(void_type setupFn = NoOp, bool_type checkFn = True,
        void_type callbackFn = NoOp)
-      : setup_fn(std::visit(discriminator, setupFn)),
-        check_fn(std::visit(discriminator, checkFn)),
-        callback_fn(std::visit(discriminator, callbackFn)) {}
+      : setup_fn(std::move(setupFn)), check_fn(std::move(checkFn)),
+        callback_fn(std::move(callbackFn)) {}
 
   ~Task() { Serial.println("destructor called"); }
 
@@ -88,29 +219,556 @@ public:
     callback_fn(this);
   }
 };
+
+// Intrusive doubly linked list, links live inside the tasks themselves
+class TaskList {
+private:
+  ITask *head = nullptr;
+  ITask *tail = nullptr;
+
+public:
+  ITask *front() const { return head; }
+  ITask *next(const ITask *task) const { return task->next; }
+  bool empty() const { return head == nullptr; }
+
+  void push_back(ITask *task) {
+    task->prev = tail;
+    task->next = nullptr;
+    if (tail != nullptr) {
+      tail->next = task;
+    } else {
+      head = task;
+    }
+    tail = task;
+  }
+
+  void remove(ITask *task) {
+    if (task->prev != nullptr) {
+      task->prev->next = task->next;
+    } else {
+      head = task->next;
+    }
+    if (task->next != nullptr) {
+      task->next->prev = task->prev;
+    } else {
+      tail = task->prev;
+    }
+    task->prev = task->next = nullptr;
+  }
+
+  // Makes `task` the head, the tasks before it wrap around to the tail
+  void rotateTo(ITask *task) {
+    if (task == head) {
+      return;
+    }
+    auto last = task->prev;
+    last->next = nullptr;
+    tail->next = head;
+    head->prev = tail;
+    head = task;
+    tail = last;
+    task->prev = nullptr;
+  }
+};
+
+// Min-heap of parked tasks ordered by deadline. Every task is either polled
+// or parked so it never outgrows the pool. Tasks track their own index, which
+// lets a cancelled task be removed from the middle.
+class TimerHeap {
+private:
+  struct Timer {
+    unsigned long at;
+    ITask *task;
+  };
+
+  Timer timers[TASKS_POOL_SIZE];
+  size_t count = 0;
+
+  // Wrap-safe as long as deadlines are < 2^31 ms apart
+  static bool later(const Timer &a, const Timer &b) {
+    return (long)(a.at - b.at) > 0;
+  }
+
+  void place(size_t i, const Timer &timer) {
+    timers[i] = timer;
+    timer.task->heap_index = i;
+  }
+
+  void siftUp(size_t i) {
+    auto timer = timers[i];
+    while (i > 0) {
+      auto parent = (i - 1) / 2;
+      if (!later(timers[parent], timer)) {
+        break;
+      }
+      place(i, timers[parent]);
+      i = parent;
+    }
+    place(i, timer);
+  }
+
+  void siftDown(size_t i) {
+    auto timer = timers[i];
+    while (true) {
+      auto child = 2 * i + 1;
+      if (child >= count) {
+        break;
+      }
+      if (child + 1 < count && later(timers[child], timers[child + 1])) {
+        child++;
+      }
+      if (!later(timer, timers[child])) {
+        break;
+      }
+      place(i, timers[child]);
+      i = child;
+    }
+    place(i, timer);
+  }
+
+public:
+  bool empty() const { return count == 0; }
+  unsigned long nextAt() const { return timers[0].at; }
+
+  // Unparks the earliest task, which remembers the deadline it was due at
+  ITask *pop() {
+    auto task = timers[0].task;
+    task->due = true;
+    task->due_at = timers[0].at;
+    remove(task);
+    return task;
+  }
+
+  void push(ITask *task, unsigned long at) {
+    timers[count] = {.at = at, .task = task};
+    siftUp(count++);
+  }
+
+  void remove(ITask *task) {
+    auto i = task->heap_index;
+    task->heap_index = ITask::NOT_PARKED;
+    if (i != --count) {
+      auto moved = timers[count].task;
+      timers[i] = timers[count];
+      siftDown(i);
+      siftUp(moved->heap_index);
+    }
+  }
+};
+
+// Cancellation scope: cancelling it drops every task attached to it and to
+// its child scopes right away, without finishing them. Live tasks pay
+// nothing per pass for it.
+class Scope {
+private:
+  Scope *parent;
+  Scope *children = nullptr;
+  Scope *sibling = nullptr;
+  ITask *attached = nullptr;
+  bool active;
+
+public:
+  Scope(Scope *parent = nullptr, bool active = true)
+      : parent(parent), active(active) {
+    if (parent != nullptr) {
+      sibling = parent->children;
+      parent->children = this;
+    }
+  }
+
+  // Drops the tasks still attached and leaves the parent scope
+  ~Scope() {
+    cancel();
+    if (parent == nullptr) {
+      return;
+    }
+    for (auto link = &parent->children; *link != nullptr;
+         link = &(*link)->sibling) {
+      if (*link == this) {
+        *link = sibling;
+        break;
+      }
+    }
+  }
+
+  // Active when neither this scope nor any ancestor is cancelled
+  bool isActive() const {
+    return active && (parent == nullptr || parent->isActive());
+  }
+
+  void attach(ITask *task) {
+    task->scope = this;
+    task->scope_prev = nullptr;
+    task->scope_next = attached;
+    if (attached != nullptr) {
+      attached->scope_prev = task;
+    }
+    attached = task;
+  }
+
+  void detach(ITask *task) {
+    if (task->scope_prev != nullptr) {
+      task->scope_prev->scope_next = task->scope_next;
+    } else {
+      attached = task->scope_next;
+    }
+    if (task->scope_next != nullptr) {
+      task->scope_next->scope_prev = task->scope_prev;
+    }
+    task->scope = nullptr;
+    task->scope_prev = task->scope_next = nullptr;
+  }
+
+  void cancel() {
+    active = false;
+    for (auto child = children; child != nullptr; child = child->sibling) {
+      child->cancel();
+    }
+    while (attached != nullptr) {
+      Tasks::cancel(attached);
+    }
+  }
+
+  // Accepts tasks again, child scopes have to be renewed on their own
+  void renew() { active = true; }
+};
+
+// Cancel and renew requests for a scope, made from contexts that must not
+// touch the scheduler, e.g. WiFi events or AsyncTCP callbacks. They only set
+// flags; apply() carries them out on the thread driving the scheduler the
+// scope's tasks run on.
+class ScopeSignal {
+private:
+  Scope &scope;
+  std::atomic<bool> wanted{false};
+  std::atomic<bool> cancelRequested{false};
+  std::atomic<bool> renewRequested{false};
+
+public:
+  ScopeSignal(Scope &scope) : scope(scope) {}
+
+  void renew() {
+    wanted.store(true);
+    renewRequested.store(true);
+  }
+
+  // A renew coming before the next apply() still drops the tasks attached
+  // until now
+  void cancel() {
+    wanted.store(false);
+    cancelRequested.store(true);
+  }
+
+  // Carries out the requests made since the last call, false so it can be
+  // polled as a task
+  bool apply() {
+    if (cancelRequested.exchange(false)) {
+      scope.cancel();
+    }
+    if (renewRequested.exchange(false) && wanted.load()) {
+      scope.renew();
+    }
+    return false;
+  }
+};
 // CLASSES END
 
 // MAIN LOGIC
-std::map<const TaskRef *, unsigned long> millisDataStore;
-std::list<std::shared_ptr<Task>> tasks;
+const unsigned long NO_DEADLINE = ULONG_MAX;
+
+namespace {
+unsigned long (*clock_fn)() = millis;
+} // namespace
+
+// Time source of the scheduler and of the tasks it ships with, millis()
+// unless replaced, e.g. by a virtual clock in host builds
+void setClock(unsigned long (*fn)()) { clock_fn = fn; }
+unsigned long now() { return clock_fn(); }
+
+typedef struct {
+  unsigned long checks;
+  // Passes in which the budget ran out before every task of the class ran
+  unsigned long deferred;
+  // Parked tasks checked more than TASKS_DEADLINE_SLACK_MS after waking
+  unsigned long misses;
+  unsigned long max_late_ms;
+} ClassStats;
+
+namespace {
+// Every scheduler, so a task block can be handed back to its own pool
+Scheduler *schedulers = nullptr;
+
+const char *const priorityNames[] = {"realtime", "io", "background"};
+
+bool isDue(unsigned long at, unsigned long now) { return (long)(now - at) >= 0; }
+} // namespace
+
+// One task pool, run queue and timer heap. A scheduler is only ever driven
+// from the thread it is bound to; other threads talk to its tasks through
+// channels (see Channel.h), never through the scheduler itself.
+class Scheduler {
+private:
+  Pool<TASKS_POOL_BLOCK, TASKS_POOL_SIZE> pool;
+  // Tasks checked on every pass, one list per class
+  TaskList tasks[PRIORITIES];
+  // Tasks parked until their deadline
+  TimerHeap timers;
+  // Task being run by loop(), it is only flagged when cancelled meanwhile
+  ITask *current = nullptr;
+  unsigned long pass_budget = TASKS_PASS_BUDGET_US;
+  ClassStats classes[PRIORITIES] = {};
+  Scheduler *next_scheduler;
+
+  TaskList &listOf(const ITask *task) {
+    return tasks[(size_t)task->getPriority()];
+  }
+
+  void wakeDueTimers(unsigned long now) {
+    while (!timers.empty() && isDue(timers.nextAt(), now)) {
+      auto task = timers.pop();
+      listOf(task).push_back(task);
+    }
+  }
+
+  static void trackLateness(ITask *task, ClassStats &stats) {
+    unsigned long due_at;
+    if (!task->takeDue(due_at)) {
+      return;
+    }
+    auto late = now() - due_at;
+    if (late > stats.max_late_ms) {
+      stats.max_late_ms = late;
+    }
+    if (late > TASKS_DEADLINE_SLACK_MS) {
+      stats.misses++;
+    }
+  }
+
+  // Checks the tasks of one class until the pass has run for `budget_us`,
+  // at least one of them, the remaining ones go first on the next pass
+  void runClass(size_t cls, unsigned long pass_start, unsigned long budget_us) {
+    auto &list = tasks[cls];
+    auto &stats = classes[cls];
+    auto first = true;
+    for (auto task = list.front(); task != nullptr; first = false) {
+      if (!first && micros() - pass_start >= budget_us) {
+        list.rotateTo(task);
+        stats.deferred++;
+        return;
+      }
+      stats.checks++;
+      trackLateness(task, stats);
 
-std::set<const TaskRef *> intervals;
+      current = task;
+      if (!task->isStarted()) {
+        Probe probe(task->statsSlot(), Phase::Setup);
+        task->setup();
+      }
+      auto finished = false;
+      if (!task->isCancelled()) {
+        Probe probe(task->statsSlot(), Phase::Check);
+        finished = task->isFinished();
+      }
+      if (finished && !task->isCancelled()) {
+        Probe probe(task->statsSlot(), Phase::Finish);
+        task->finish();
+      }
+      current = nullptr;
+
+      auto next = list.next(task);
+      unsigned long at;
+      if (finished || task->isCancelled()) {
+        list.remove(task);
+        delete task;
+      } else if (task->nextWake(at)) {
+        list.remove(task);
+        timers.push(task, at);
+      } else if ((size_t)task->getPriority() != cls) {
+        // Reprioritized while running
+        list.remove(task);
+        listOf(task).push_back(task);
+      }
+      task = next;
+    }
+  }
 
-void loop() {
-  for (auto it = tasks.begin(); it != tasks.end();) {
-    auto &task = **it;
+public:
+  Scheduler() : next_scheduler(schedulers) { schedulers = this; }
 
-    if (!task.isStarted()) {
-      task.setup();
+  ~Scheduler() {
+    for (auto link = &schedulers; *link != nullptr;
+         link = &(*link)->next_scheduler) {
+      if (*link == this) {
+        *link = next_scheduler;
+        break;
+      }
     }
-    if (task.isFinished()) {
-      task.finish();
-      it = tasks.erase(it);
+  }
+
+  // Scheduler whose pool `ptr` was allocated from
+  static Scheduler *owning(const void *ptr) {
+    for (auto scheduler = schedulers; scheduler != nullptr;
+         scheduler = scheduler->next_scheduler) {
+      if (scheduler->pool.owns(ptr)) {
+        return scheduler;
+      }
+    }
+    return nullptr;
+  }
+
+  void *allocate(size_t size) { return pool.allocate(size); }
+  void deallocate(void *ptr) { pool.deallocate(ptr); }
+  const PoolStats &poolStats() const { return pool.getStats(); }
+
+  TaskRef *queue(ITask *task, Scope *scope) {
+    if (scope != nullptr) {
+      if (!scope->isActive()) {
+        delete task;
+        return nullptr;
+      }
+      scope->attach(task);
+    }
+    task->owner = this;
+    listOf(task).push_back(task);
+    return task;
+  }
+
+  void cancel(ITask *task) {
+    if (task == current) {
+      return;
+    }
+    if (task->heap_index != ITask::NOT_PARKED) {
+      timers.remove(task);
     } else {
-      ++it;
+      listOf(task).remove(task);
+    }
+    delete task;
+  }
+
+  void prioritize(ITask *task, Priority priority) {
+    if (task != current && task->heap_index == ITask::NOT_PARKED) {
+      listOf(task).remove(task);
+      task->priority = priority;
+      listOf(task).push_back(task);
+    } else {
+      // Parked, or running, in which case loop() moves it
+      task->priority = priority;
+    }
+  }
+
+  // Milliseconds until the next task needs a check: 0 while any task is
+  // polled, NO_DEADLINE when nothing is scheduled at all
+  unsigned long nextDeadline() {
+    for (auto &list : tasks) {
+      if (!list.empty()) {
+        return 0;
+      }
+    }
+    if (timers.empty()) {
+      return NO_DEADLINE;
+    }
+    auto left = (long)(timers.nextAt() - now());
+    return left > 0 ? left : 0;
+  }
+
+  unsigned long loop() {
+    LoopProbe loopProbe;
+    auto pass_start = micros();
+    wakeDueTimers(now());
+
+    runClass((size_t)Priority::Realtime, pass_start, ULONG_MAX);
+    for (size_t cls = (size_t)Priority::Io; cls < PRIORITIES; cls++) {
+      runClass(cls, pass_start, pass_budget);
+    }
+
+    return nextDeadline();
+  }
+
+  // Time the I/O and background classes may take per pass, in microseconds
+  void setPassBudget(unsigned long budget_us) { pass_budget = budget_us; }
+
+  const ClassStats &classStats(Priority priority) const {
+    return classes[(size_t)priority];
+  }
+
+  void resetClassStats() {
+    for (auto &stats : classes) {
+      stats = {};
     }
   }
+};
+
+// Runs the tasks queued from setup() and loop()
+Scheduler defaultScheduler;
+
+namespace {
+// Scheduler the calling thread queues to and runs
+thread_local Scheduler *bound = &defaultScheduler;
+} // namespace
+
+Scheduler &scheduler() { return *bound; }
+
+// Makes `scheduler` the one the calling thread queues to and runs, to be
+// called once at the start of the thread driving it
+void bind(Scheduler &scheduler) { bound = &scheduler; }
+
+// Binds the calling thread for the guard's lifetime, e.g. to queue the
+// first tasks of a scheduler before the thread driving it is started
+class Binding {
+private:
+  Scheduler *previous;
+
+public:
+  Binding(Scheduler &scheduler) : previous(bound) { bound = &scheduler; }
+  ~Binding() { bound = previous; }
+};
+
+void *ITask::operator new(size_t size) noexcept {
+  auto ptr = scheduler().allocate(size);
+  if (ptr == nullptr) {
+    Serial.print("Task pool exhausted, could not allocate ");
+    Serial.print((unsigned long)size);
+    Serial.println(" bytes");
+  }
+  return ptr;
+}
+
+void ITask::operator delete(void *ptr) {
+  auto owner = Scheduler::owning(ptr);
+  if (owner != nullptr) {
+    owner->deallocate(ptr);
+  }
+}
+
+const PoolStats &poolStats() { return scheduler().poolStats(); }
+
+ITask::~ITask() {
+  if (scope != nullptr) {
+    scope->detach(this);
+  }
+}
+
+// Drops a queued task without finishing it, right away unless it is the
+// one currently running, which loop() then drops once it returns
+void cancel(const TaskRef *ref) {
+  if (ref == nullptr || ref->isCancelled()) {
+    return;
+  }
+  auto task = static_cast<ITask *>(const_cast<TaskRef *>(ref));
+  task->cancelled = true;
+  if (task->scope != nullptr) {
+    task->scope->detach(task);
+  }
+  if (task->owner != nullptr) {
+    task->owner->cancel(task);
+  } else {
+    delete task;
+  }
 }
+
+unsigned long nextDeadline() { return scheduler().nextDeadline(); }
+
+unsigned long loop() { return scheduler().loop(); }
 // MAIN LOGIC END
 
 // API
@@ -118,57 +776,122 @@ void NoOp(const TaskRef *ref) {}
 
 bool True(const TaskRef *ref) { return true; }
 
-TaskRef *queueTask(Task *task) {
-  tasks.push_back(std::move(std::shared_ptr<Task>(task)));
-  return tasks.back().get();
+// Takes ownership of a task created with `new`, which yields nullptr once
+// the pool is exhausted. Returns nullptr in that case too, or when the
+// scope the task should be bound to is already cancelled.
+TaskRef *queueTask(ITask *task, Scope *scope = nullptr) {
+  if (task == nullptr) {
+    Serial.println("Task dropped: task pool exhausted");
+    return nullptr;
+  }
+  return scheduler().queue(task, scope);
 }
 
+TaskRef *queueTask(ITask *task, Scope &scope) { return queueTask(task, &scope); }
+
 void setMillis(const TaskRef *ref, unsigned long millis) {
-  millisDataStore[ref] = millis;
+  ref->state<unsigned long>() = millis;
 }
 
 unsigned long getMillis(const TaskRef *ref) {
-  auto it = millisDataStore.find(ref);
-  return it != millisDataStore.end() ? it->second : 0;
+  return ref->state<unsigned long>();
 }
 
-void clearMillis(const TaskRef *ref) { millisDataStore.erase(ref); }
+void clearMillis(const TaskRef *ref) { ref->state<unsigned long>() = 0; }
 
-void setTimeout(std::function<void()> callback, unsigned long ms) {
-  tasks.push_back(std::make_shared<Task>(
-      [](const TaskRef *ref) { setMillis(ref, millis()); },
-      [ms](const TaskRef *ref) { return millis() - getMillis(ref) >= ms; },
-      [callback](const TaskRef *ref) {
-        clearMillis(ref);
-        callback();
-      }));
+template <typename F> TaskRef *setTimeout(F callback, unsigned long ms) {
+  return queueTask(new Task(
+      [](const TaskRef *ref) { setMillis(ref, now()); },
+      [ms](const TaskRef *ref) {
+        auto start = getMillis(ref);
+        if (now() - start >= ms) {
+          return true;
+        }
+        ref->sleepUntil(start + ms);
+        return false;
+      },
+      [callback](const TaskRef *ref) { callback(); }));
 }
 
-TaskRef *setInterval(std::function<void()> doWork, unsigned long ms,
-                     bool immediate = true) {
-  tasks.push_back(std::make_shared<Task>(
+template <typename F>
+TaskRef *setInterval(F doWork, unsigned long ms, bool immediate = true) {
+  return queueTask(new Task(
       [ms, immediate](const TaskRef *ref) {
-        intervals.emplace(ref);
-        setMillis(ref, millis() - ms * immediate);
+        setMillis(ref, now() - ms * immediate);
       },
       [ms, doWork](const TaskRef *ref) {
-        if (intervals.find(ref) == intervals.end()) {
-          return true;
-        }
-
-        auto curr_millis = millis();
+        auto curr_millis = now();
         if (curr_millis - getMillis(ref) >= ms) {
           setMillis(ref, curr_millis);
           doWork();
         }
 
+        ref->sleepUntil(getMillis(ref) + ms);
         return false;
       },
       NoOp));
-  return tasks.back().get();
 }
 
-void clearInterval(const TaskRef *ref) { intervals.erase(ref); }
+void clearInterval(const TaskRef *ref) { cancel(ref); }
+
+// Names the task in the scheduler stats, tasks sharing a name are accounted
+// together. The name must outlive the stats, use string literals.
+void name(const TaskRef *ref, const char *name) {
+#ifdef TASKS_STATS
+  if (ref == nullptr) {
+    return;
+  }
+  auto task = static_cast<ITask *>(const_cast<TaskRef *>(ref));
+  task->stats_name = name;
+  task->stats = nullptr;
+#endif
+}
+
+// Moves the task to another scheduling class, tasks start in Priority::Io
+void prioritize(const TaskRef *ref, Priority priority) {
+  if (ref == nullptr) {
+    return;
+  }
+  auto task = static_cast<ITask *>(const_cast<TaskRef *>(ref));
+  if (task->owner != nullptr) {
+    task->owner->prioritize(task, priority);
+  } else {
+    task->priority = priority;
+  }
+}
+
+void setPassBudget(unsigned long budget_us) {
+  scheduler().setPassBudget(budget_us);
+}
+
+const ClassStats &classStats(Priority priority) {
+  return scheduler().classStats(priority);
+}
+
+void resetClassStats() { scheduler().resetClassStats(); }
+
+// {"realtime":{"checks":..,"deferred":..,"misses":..,"max_late_ms":..},..}
+void dumpClassStats(Print &out) {
+  out.print('{');
+  for (size_t cls = 0; cls < PRIORITIES; cls++) {
+    auto &stats = classStats((Priority)cls);
+    if (cls != 0) {
+      out.print(',');
+    }
+    out.print('"');
+    out.print(priorityNames[cls]);
+    out.print("\":{\"checks\":");
+    out.print(stats.checks);
+    out.print(",\"deferred\":");
+    out.print(stats.deferred);
+    out.print(",\"misses\":");
+    out.print(stats.misses);
+    out.print(",\"max_late_ms\":");
+    out.print(stats.max_late_ms);
+    out.print('}');
+  }
+  out.print('}');
+}
 // }
 // API END
 
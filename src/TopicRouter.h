@@ -0,0 +1,361 @@
+#ifndef TOPIC_ROUTER_H
+#define TOPIC_ROUTER_H
+
+#include <Arduino.h>
+#include <cstdint>
+#include <cstring>
+#include <functional>
+#include <memory>
+#include <vector>
+
+// Called with the payload of a message, not NUL terminated
+typedef std::function<void(const char *payload, size_t len)> TopicHandler;
+
+// One route of a topic, as subscribe() hands it out
+typedef struct {
+  String topic;
+  // 0 for none
+  uint32_t id = 0;
+} Subscription;
+
+// Routes topics to handlers by segment, following MQTT filter rules: `+`
+// matches one segment, a trailing `#` matches the parent and everything
+// below it, and neither matches topics starting with `$`. Filters are
+// split once when added. Dispatching walks the topic in place, hashing
+// each segment to binary search its level, and does not allocate.
+//
+// A filter may have any number of routes, each identified by the id add()
+// returned. Handlers may add and remove routes while they run. Routes added
+// meanwhile may miss the message being dispatched, routes removed meanwhile
+// are not called anymore and freed once the dispatch is over.
+class TopicRouter {
+private:
+  struct Node;
+
+  struct Route {
+    // 0 once removed
+    uint32_t id;
+    TopicHandler handler;
+  };
+
+  struct Link {
+    uint32_t hash;
+    std::unique_ptr<Node> node;
+  };
+
+  struct Node {
+    String segment;
+    // Literal children ordered by hash, wildcards kept aside
+    std::vector<Link> children;
+    std::unique_ptr<Node> any;
+    std::unique_ptr<Node> rest;
+    // Boxed so a running handler stays put when routes are added
+    std::vector<std::unique_ptr<Route>> routes;
+    size_t live = 0;
+  };
+
+  Node root;
+  size_t live = 0;
+  uint32_t last_id = 0;
+  int dispatching = 0;
+  bool stale = false;
+
+  static const char *segmentEnd(const char *segment) {
+    auto end = segment;
+    while (*end != '/' && *end != '\0') {
+      end++;
+    }
+    return end;
+  }
+
+  // FNV-1a
+  static uint32_t hashOf(const char *begin, size_t len) {
+    uint32_t hash = 2166136261u;
+    for (size_t i = 0; i < len; i++) {
+      hash = (hash ^ (uint8_t)begin[i]) * 16777619u;
+    }
+    return hash;
+  }
+
+  static bool isWildcard(const char *begin, size_t len, char wildcard) {
+    return len == 1 && *begin == wildcard;
+  }
+
+  // First child whose hash is not below `hash`
+  static size_t lowerBound(const Node *parent, uint32_t hash) {
+    size_t low = 0;
+    size_t high = parent->children.size();
+    while (low < high) {
+      auto mid = (low + high) / 2;
+      if (parent->children[mid].hash < hash) {
+        low = mid + 1;
+      } else {
+        high = mid;
+      }
+    }
+    return low;
+  }
+
+  static Node *find(const Node *parent, const char *begin, size_t len,
+                    uint32_t hash) {
+    auto &children = parent->children;
+    for (auto i = lowerBound(parent, hash);
+         i < children.size() && children[i].hash == hash; i++) {
+      auto node = children[i].node.get();
+      if (node->segment.length() == len &&
+          memcmp(node->segment.c_str(), begin, len) == 0) {
+        return node;
+      }
+    }
+    return nullptr;
+  }
+
+  static Node *child(const Node *parent, const char *begin, size_t len) {
+    if (isWildcard(begin, len, '+')) {
+      return parent->any.get();
+    }
+    if (isWildcard(begin, len, '#')) {
+      return parent->rest.get();
+    }
+    return find(parent, begin, len, hashOf(begin, len));
+  }
+
+  static Node *findOrAdd(Node *parent, const char *begin, size_t len) {
+    auto existing = child(parent, begin, len);
+    if (existing != nullptr) {
+      return existing;
+    }
+    auto node = new Node();
+    node->segment = String(begin, len);
+    if (isWildcard(begin, len, '+')) {
+      parent->any.reset(node);
+    } else if (isWildcard(begin, len, '#')) {
+      parent->rest.reset(node);
+    } else {
+      auto hash = hashOf(begin, len);
+      auto &children = parent->children;
+      children.insert(children.begin() + lowerBound(parent, hash),
+                      Link{hash, std::unique_ptr<Node>(node)});
+    }
+    return node;
+  }
+
+  // Node of an existing filter, nullptr if it was never added
+  Node *lookup(const char *filter) {
+    auto node = &root;
+    for (auto segment = filter; node != nullptr;) {
+      auto end = segmentEnd(segment);
+      node = child(node, segment, end - segment);
+      if (*end == '\0') {
+        return node;
+      }
+      segment = end + 1;
+    }
+    return nullptr;
+  }
+
+  static size_t invoke(const Node *node, const char *payload, size_t len) {
+    if (node == nullptr) {
+      return 0;
+    }
+    size_t hits = 0;
+    auto count = node->routes.size();
+    for (size_t i = 0; i < count; i++) {
+      auto &route = *node->routes[i];
+      if (route.id != 0) {
+        route.handler(payload, len);
+        hits++;
+      }
+    }
+    return hits;
+  }
+
+  // Matches the children of `node` against the topic from `segment` on
+  static size_t match(const Node *node, const char *segment, bool top,
+                      const char *payload, size_t len) {
+    auto end = segmentEnd(segment);
+    auto segment_len = end - segment;
+    auto last = *end == '\0';
+    auto wildcards = !(top && *segment == '$');
+
+    size_t hits = 0;
+    const Node *matches[] = {
+        find(node, segment, segment_len, hashOf(segment, segment_len)),
+                             wildcards ? node->any.get() : nullptr};
+    for (auto next : matches) {
+      if (next == nullptr) {
+        continue;
+      }
+      if (!last) {
+        hits += match(next, end + 1, false, payload, len);
+        continue;
+      }
+      hits += invoke(next, payload, len);
+      // `a/#` matches `a` as well
+      hits += invoke(next->rest.get(), payload, len);
+    }
+    if (wildcards) {
+      hits += invoke(node->rest.get(), payload, len);
+    }
+    return hits;
+  }
+
+  template <typename F>
+  static void forEachFilter(const Node *node, bool top, String &filter,
+                            F &fn) {
+    auto visit = [&](const Node *child) {
+      auto length = filter.length();
+      if (!top) {
+        filter += "/";
+      }
+      filter += child->segment;
+      if (child->live != 0) {
+        fn(filter.c_str());
+      }
+      forEachFilter(child, false, filter, fn);
+      filter.remove(length);
+    };
+    for (auto &link : node->children) {
+      visit(link.node.get());
+    }
+    if (node->any != nullptr) {
+      visit(node->any.get());
+    }
+    if (node->rest != nullptr) {
+      visit(node->rest.get());
+    }
+  }
+
+  // Frees the nodes left without routes, true when `node` itself is empty
+  static bool prune(Node *node) {
+    auto &children = node->children;
+    for (size_t i = 0; i < children.size();) {
+      if (prune(children[i].node.get())) {
+        children.erase(children.begin() + i);
+      } else {
+        i++;
+      }
+    }
+    if (node->any != nullptr && prune(node->any.get())) {
+      node->any.reset();
+    }
+    if (node->rest != nullptr && prune(node->rest.get())) {
+      node->rest.reset();
+    }
+    auto &routes = node->routes;
+    for (size_t i = 0; i < routes.size();) {
+      if (routes[i]->id == 0) {
+        routes.erase(routes.begin() + i);
+      } else {
+        i++;
+      }
+    }
+    return routes.empty() && children.empty() && node->any == nullptr &&
+           node->rest == nullptr;
+  }
+
+public:
+  // Routes the filter to `handler` as well, returns the id of the route
+  uint32_t add(const char *filter, TopicHandler handler) {
+    auto node = &root;
+    for (auto segment = filter;;) {
+      auto end = segmentEnd(segment);
+      node = findOrAdd(node, segment, end - segment);
+      if (*end == '\0') {
+        break;
+      }
+      segment = end + 1;
+    }
+    if (++last_id == 0) {
+      last_id = 1;
+    }
+    node->routes.emplace_back(new Route{last_id, std::move(handler)});
+    node->live++;
+    live++;
+    return last_id;
+  }
+
+  // False when the filter had no such route
+  bool remove(const char *filter, uint32_t id) {
+    auto node = lookup(filter);
+    if (node == nullptr || id == 0) {
+      return false;
+    }
+    for (auto &route : node->routes) {
+      if (route->id != id) {
+        continue;
+      }
+      route->id = 0;
+      node->live--;
+      live--;
+      if (dispatching != 0) {
+        stale = true;
+      } else {
+        prune(&root);
+      }
+      return true;
+    }
+    return false;
+  }
+
+  // Routes of exactly this filter
+  size_t count(const char *filter) {
+    auto node = lookup(filter);
+    return node != nullptr ? node->live : 0;
+  }
+
+  // Calls the handler of every filter matching `topic` with the payload,
+  // in place, returns how many
+  size_t dispatch(const char *topic, const char *payload, size_t len) {
+    dispatching++;
+    auto hits = match(&root, topic, true, payload, len);
+    if (--dispatching == 0 && stale) {
+      stale = false;
+      prune(&root);
+    }
+    return hits;
+  }
+
+  size_t dispatch(const char *topic, const char *payload) {
+    return dispatch(topic, payload, strlen(payload));
+  }
+
+  size_t size() const { return live; }
+
+  // Calls `fn` with every filter that has routes
+  template <typename F> void forEachFilter(F fn) const {
+    String filter;
+    forEachFilter(&root, true, filter, fn);
+  }
+
+  // Whether every topic matching `topic`, itself possibly a filter, also
+  // matches `filter`
+  static bool covers(const char *filter, const char *topic) {
+    auto wildcards = *topic != '$';
+    while (true) {
+      auto filter_end = segmentEnd(filter);
+      auto topic_end = segmentEnd(topic);
+      auto len = filter_end - filter;
+      if (len == 1 && *filter == '#') {
+        return wildcards;
+      }
+      if (topic_end - topic == 1 && *topic == '#') {
+        return false;
+      }
+      auto any = len == 1 && *filter == '+' && wildcards;
+      if (!any && (len != topic_end - topic || memcmp(filter, topic, len))) {
+        return false;
+      }
+      if (*filter_end == '\0' || *topic_end == '\0') {
+        // `a/#` covers `a` as well
+        return *filter_end == *topic_end ||
+               (*topic_end == '\0' && strcmp(filter_end, "/#") == 0);
+      }
+      filter = filter_end + 1;
+      topic = topic_end + 1;
+      wildcards = true;
+    }
+  }
+};
+
+#endif
@@ -0,0 +1,234 @@
+#ifndef VALUE_H
+#define VALUE_H
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+
+// Longest text encodeValue() writes, with its terminator
+#ifndef VALUE_TEXT_SIZE
+#define VALUE_TEXT_SIZE 24
+#endif
+
+// Keeps the scaled value of fixed point numbers within an int64_t
+#define VALUE_MAX_DECIMALS 8
+
+enum class ValueType : uint8_t { None, Bool, Int, Fixed, Enum };
+
+// What a slot takes or an output publishes, declared in the blueprint
+typedef struct {
+  ValueType type;
+  // Bounds values are clamped to, in units of the last decimal for fixed
+  // point ones
+  int32_t min;
+  int32_t max;
+  // Digits past the point of fixed point values, up to VALUE_MAX_DECIMALS
+  uint8_t decimals;
+  // Names of enum values, by index
+  const char *const *names;
+  size_t nameCount;
+} ValueSpec;
+
+constexpr ValueSpec boolValue() {
+  return {ValueType::Bool, 0, 1, 0, nullptr, 0};
+}
+
+constexpr ValueSpec intValue(int32_t min = INT32_MIN,
+                             int32_t max = INT32_MAX) {
+  return {ValueType::Int, min, max, 0, nullptr, 0};
+}
+
+// `fixedValue(1, 0, 1000)` takes 0.0 to 100.0 and hands over 0 to 1000
+constexpr ValueSpec fixedValue(uint8_t decimals, int32_t min = INT32_MIN,
+                               int32_t max = INT32_MAX) {
+  return {ValueType::Fixed, min, max, decimals, nullptr, 0};
+}
+
+template <size_t N>
+constexpr ValueSpec enumValue(const char *const (&names)[N]) {
+  return {ValueType::Enum, 0, (int32_t)N - 1, 0, names, N};
+}
+
+// A value decoded from its text, the spec it was decoded with tells how to
+// read it back. Values of type None were missing or malformed.
+struct Value {
+  ValueType type = ValueType::None;
+  int32_t raw = 0;
+
+  bool isSet() const { return type != ValueType::None; }
+  bool asBool() const { return raw != 0; }
+  // Fixed point values in units of their last decimal
+  int32_t asInt() const { return raw; }
+  size_t asEnum() const { return (size_t)raw; }
+
+  bool operator==(const Value &other) const {
+    return type == other.type && raw == other.raw;
+  }
+  bool operator!=(const Value &other) const { return !(*this == other); }
+
+  static Value ofBool(bool value) { return {ValueType::Bool, value}; }
+  static Value ofInt(int32_t value) { return {ValueType::Int, value}; }
+  static Value ofFixed(int32_t raw) { return {ValueType::Fixed, raw}; }
+  static Value ofEnum(size_t index) {
+    return {ValueType::Enum, (int32_t)index};
+  }
+};
+
+namespace {
+bool equalsIgnoreCase(const char *text, size_t len, const char *word) {
+  for (size_t i = 0; i < len; i++) {
+    if (word[i] == '\0' || (text[i] | 0x20) != word[i]) {
+      return false;
+    }
+  }
+  return word[len] == '\0';
+}
+
+// A decimal number with up to `decimals` digits past the point, scaled to
+// units of the last one. Further digits are cut off.
+bool parseFixed(const char *text, size_t len, uint8_t decimals,
+                int64_t &raw) {
+  size_t i = 0;
+  auto negative = len > 0 && text[0] == '-';
+  if (negative || (len > 0 && text[0] == '+')) {
+    i++;
+  }
+  auto digits = false;
+  raw = 0;
+  for (; i < len && text[i] >= '0' && text[i] <= '9'; i++) {
+    // Stops past any int32_t, it is clamped later on
+    if (raw <= INT32_MAX) {
+      raw = raw * 10 + (text[i] - '0');
+    }
+    digits = true;
+  }
+  uint8_t read = 0;
+  if (i < len && text[i] == '.') {
+    for (i++; i < len && text[i] >= '0' && text[i] <= '9'; i++) {
+      if (read < decimals) {
+        raw = raw * 10 + (text[i] - '0');
+        read++;
+      }
+      digits = true;
+    }
+  }
+  if (!digits || i != len) {
+    return false;
+  }
+  for (; read < decimals; read++) {
+    raw *= 10;
+  }
+  if (negative) {
+    raw = -raw;
+  }
+  return true;
+}
+
+// Writes `value` backwards, ending right before `end`, with a point
+// `decimals` digits from the right. Returns where it starts.
+char *formatFixed(char *end, int32_t value, uint8_t decimals) {
+  auto negative = value < 0;
+  // As unsigned, INT32_MIN has no positive counterpart
+  auto magnitude = negative ? 0u - (uint32_t)value : (uint32_t)value;
+  auto at = end;
+  for (uint8_t i = 0; i < decimals; i++) {
+    *--at = '0' + magnitude % 10;
+    magnitude /= 10;
+  }
+  if (decimals != 0) {
+    *--at = '.';
+  }
+  do {
+    *--at = '0' + magnitude % 10;
+    magnitude /= 10;
+  } while (magnitude != 0);
+  if (negative) {
+    *--at = '-';
+  }
+  return at;
+}
+} // namespace
+
+// Reads the text of a value, as it comes off a topic or a config. Booleans
+// are true for "true" or "1" and false for anything else, numbers are
+// clamped to the bounds of the spec. Returns false, and a value of type
+// None, for text that does not hold one.
+bool decodeValue(const ValueSpec &spec, const char *text, size_t len,
+                 Value &value) {
+  value = {};
+  switch (spec.type) {
+  case ValueType::Bool:
+    value = Value::ofBool(equalsIgnoreCase(text, len, "true") ||
+                          (len == 1 && text[0] == '1'));
+    return true;
+  case ValueType::Int:
+  case ValueType::Fixed: {
+    int64_t raw;
+    if (spec.decimals > VALUE_MAX_DECIMALS ||
+        !parseFixed(text, len, spec.decimals, raw)) {
+      return false;
+    }
+    raw = raw < spec.min ? spec.min : raw > spec.max ? spec.max : raw;
+    value = {spec.type, (int32_t)raw};
+    return true;
+  }
+  case ValueType::Enum:
+    for (size_t i = 0; i < spec.nameCount; i++) {
+      if (strlen(spec.names[i]) == len &&
+          memcmp(spec.names[i], text, len) == 0) {
+        value = Value::ofEnum(i);
+        return true;
+      }
+    }
+    return false;
+  case ValueType::None:
+    return false;
+  }
+  return false;
+}
+
+// Writes the text of a value into `out`, terminated. Returns its length,
+// 0 when it does not fit or is not of the type of the spec.
+size_t encodeValue(const ValueSpec &spec, const Value &value, char *out,
+                   size_t size) {
+  if (value.type != spec.type) {
+    return 0;
+  }
+  const char *text = nullptr;
+  size_t len = 0;
+  // Sign, ten digits and a point
+  char digits[16];
+  switch (spec.type) {
+  case ValueType::Bool:
+    text = value.asBool() ? "true" : "false";
+    len = strlen(text);
+    break;
+  case ValueType::Int:
+  case ValueType::Fixed: {
+    if (spec.decimals > VALUE_MAX_DECIMALS) {
+      return 0;
+    }
+    auto end = digits + sizeof(digits);
+    text = formatFixed(end, value.raw, spec.decimals);
+    len = end - text;
+    break;
+  }
+  case ValueType::Enum:
+    if (value.asEnum() >= spec.nameCount) {
+      return 0;
+    }
+    text = spec.names[value.asEnum()];
+    len = strlen(text);
+    break;
+  case ValueType::None:
+    return 0;
+  }
+  if (len + 1 > size) {
+    return 0;
+  }
+  memcpy(out, text, len);
+  out[len] = '\0';
+  return len;
+}
+
+#endif
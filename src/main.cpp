@@ -1,10 +1,18 @@
+// Agents hosted by this firmware, any of VLX_LED, VLX_SWITCH and VLX_SLIDER
 #define VLX_SLIDER
 
+#if !defined(VLX_LED) && !defined(VLX_SWITCH) && !defined(VLX_SLIDER)
+#error "Define at least one of VLX_LED, VLX_SWITCH and VLX_SLIDER"
+#endif
+
 #include <Agents.h>
 #include <Arduino.h>
+#include <Channel.h>
 #include <Constants.h>
+#include <Cores.h>
 #include <CredentialsRetriever.h>
 #include <CustomTasks.h>
+#include <Flow.h>
 #include <MyWiFi.h>
 #include <Tasks.h>
 #include <esp_now.h>
@@ -14,6 +22,33 @@
 #include <vector>
 
 #define VOLEX_PREFIX "[volex-conn]"
+// Upper bound for idling between loop passes, so callbacks coming from
+// other contexts (WiFi events, MQTT) are picked up promptly
+#define MAX_IDLE_MS 10
+// Period of the scheduler stats dump when built with -D TASKS_STATS
+#define STATS_DUMP_MS 60000
+// Longest random wait before asking the server to confirm a cached config,
+// spreads the requests of devices powered up together
+#ifndef CONFIG_CONFIRM_JITTER_MS
+#define CONFIG_CONFIRM_JITTER_MS 5000
+#endif
+// Wait before asking again for a cached config the server did not confirm,
+// doubled on every attempt up to the max
+#ifndef CONFIG_CONFIRM_RETRY_MS
+#define CONFIG_CONFIRM_RETRY_MS 2000
+#endif
+#ifndef CONFIG_CONFIRM_RETRY_MAX_MS
+#define CONFIG_CONFIRM_RETRY_MAX_MS 60000
+#endif
+
+// Pin of the switch when hosted with the LED, which keeps LED_PIN
+#ifndef SWITCH_PIN_WITH_LED
+#define SWITCH_PIN_WITH_LED 4
+#endif
+
+#if defined(TASKS_DUAL_CORE) && defined(TASKS_STATS)
+#error "TASKS_STATS accounts a single scheduler, disable TASKS_DUAL_CORE"
+#endif
 
 // ESP-NOW
 uint8_t broadcastAddress[] = {0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF};
@@ -59,7 +94,10 @@ void esp_now_setup() {
 
 void request_credentials() {
   String s(VOLEX_PREFIX);
-  s += AGENT_BLUEPRINT;
+  // The blueprint of the first agent, as single agent builds announce it.
+  // The others name theirs when asking for their config, see
+  // Agent::configRequestOf(). There is always one, see VLX_SLIDER above.
+  s += Agent::all().front()->name();
 
   esp_err_t result =
       esp_now_send(broadcastAddress, (uint8_t *)s.c_str(), s.length() + 1);
@@ -69,6 +107,130 @@ void request_credentials() {
 }
 // ESP-NOW END
 
+// CORES
+// With -D TASKS_DUAL_CORE, WiFi, MQTT and the connect flow run on their own
+// scheduler pinned to the core of the network stack, while the agent, its
+// samplers and its topic handlers keep the Arduino loop() core. The two
+// only talk through SPSC channels: the agent drains received messages
+// straight from the MQTT inbox, lifecycle changes go to it in agentInbox
+// and client calls come back in Mqtt::outbox. Neither side ever cancels the
+// tasks of the other, connection changes are applied to their scopes on the
+// I/O core, see apply_connection_changes().
+#ifdef TASKS_DUAL_CORE
+#define IO_CORE 0
+
+Tasks::Scheduler io;
+
+enum class AgentOp { Connected, Listen };
+
+typedef struct {
+  AgentOp op;
+} AgentMessage;
+
+// Lifecycle changes, never dropped
+Tasks::LosslessChannel<AgentMessage, MQTT_CHANNEL_SIZE> agentInbox;
+#endif
+
+// Agent lifecycle, driven from the connect flow. Drops leave the agents
+// running on their config.
+void agent_connected() {
+#ifdef TASKS_DUAL_CORE
+  agentInbox.push({.op = AgentOp::Connected});
+#else
+  Agent::subscribeConfigs();
+#endif
+}
+
+void agent_listen() {
+#ifdef TASKS_DUAL_CORE
+  agentInbox.push({.op = AgentOp::Listen});
+#else
+  Agent::setupListeners();
+#endif
+}
+
+#ifdef TASKS_DUAL_CORE
+// Agent side of the channels, batched as the drain on the I/O core
+bool handle_agent_messages() {
+  // Requests that did not fit in the outbox on the last pass
+  Mqtt::outbox.flush();
+  auto start = micros();
+  AgentMessage message;
+  for (size_t count = 0; count < MQTT_DRAIN_BATCH && agentInbox.pop(message);
+       count++) {
+    switch (message.op) {
+    case AgentOp::Connected:
+      Agent::subscribeConfigs();
+      break;
+    case AgentOp::Listen:
+      Agent::setupListeners();
+      break;
+    }
+    if (micros() - start >= MQTT_DRAIN_BUDGET_US) {
+      break;
+    }
+  }
+  return false;
+}
+
+// I/O side of the channels
+bool run_agent_requests() {
+  agentInbox.flush();
+  while (run_next_request()) {
+  }
+  return false;
+}
+#endif
+// CORES END
+
+// AGENTS
+// Every agent defined above, on its default pins. Agents of the same type,
+// or sharing a pin, need their own pins here.
+void register_agents() {
+#ifdef VLX_LED
+  Agent::add(new Agent::Led(LED_PIN));
+#endif
+#if defined(VLX_SWITCH) && defined(VLX_LED)
+  Agent::add(new Agent::Switch(SWITCH_PIN_WITH_LED));
+#elif defined(VLX_SWITCH)
+  Agent::add(new Agent::Switch(SWITCH_PIN));
+#endif
+#ifdef VLX_SLIDER
+  Agent::add(new Agent::Slider(SLIDER_PIN));
+#endif
+}
+
+// Asks for the configs the agents are missing, or with `cached` for those
+// they only have from the cache
+void request_configs(bool cached) {
+  for (auto agent : Agent::all()) {
+    if (agent->hasConfig() == cached && !agent->isConfirmed()) {
+      mqttClient.publish(REQUEST_CONFIG, 0, false,
+                         agent->configRequest().c_str());
+    }
+  }
+}
+
+bool awaiting_confirmation() {
+  for (auto agent : Agent::all()) {
+    if (agent->hasConfig() && !agent->isConfirmed()) {
+      return true;
+    }
+  }
+  return false;
+}
+
+// Whether the broker was told about every config topic
+bool configs_subscribed() {
+  for (auto agent : Agent::all()) {
+    if (!mqttFilters.has(agent->identity().c_str())) {
+      return false;
+    }
+  }
+  return true;
+}
+// AGENTS END
+
 // WiFi
 void wifi_try_connect() {
   auto c = CredentialsRetriever::getCredentials();
@@ -76,103 +238,225 @@ void wifi_try_connect() {
   MyWiFi::connectToWifi(c);
 }
 
-void onWifiConnect() {
-  Tasks::queueTask(new DependentTask(
-      {MyWiFi::dependency},
-      new TimedTask(
-          []() {
-            Serial.print("Resolving IP address for ");
-            Serial.print(MQTT_HOST);
-            Serial.println("...");
+bool resolve_broker() {
+  Serial.print("Resolving IP address for ");
+  Serial.print(MQTT_HOST);
+  Serial.println("...");
 
-            auto ip = MyWiFi::resolveBrokerIp(MQTT_HOST);
-            if (ip == INADDR_NONE) {
-              Serial.println("Could not find MQTT host. Retrying in 2 seconds");
-              return false;
-            }
-
-            Serial.print("MQTT host IP address: ");
-            Serial.println(ip);
-            setMqttAddr(ip);
-            return true;
-          },
-          connectToMqtt, 2000)));
-}
+  auto ip = MyWiFi::resolveBrokerIp(MQTT_HOST);
+  if (ip == INADDR_NONE) {
+    return false;
+  }
 
-void onWifiDisconnect() {
-  Serial.println("Trying to reconnect in 2 seconds");
-  Agent::reset();
-  Tasks::setTimeout(wifi_try_connect, 2000);
+  Serial.print("MQTT host IP address: ");
+  Serial.println(ip);
+  setMqttAddr(ip);
+  return true;
 }
 // WiFi END
 
 // MQTT
-void mqtt_try_connect() {
-  if (WiFi.isConnected()) {
-    connectToMqtt();
-  } else {
-    Serial.println("MQTT is waiting for a WiFi connection");
-  }
+Tasks::Event mqttDropped;
+
+// Handles a batch of received messages per pass, so a burst is applied at
+// once instead of one message per pass. Payloads are handed over in place,
+// from their inbox slot, on the core of the agent.
+bool handle_events() {
+  mqttInbox.drain([](const MqttSlot &slot) {
+    handle(slot);
+    return true;
+  });
+  report_inbox_drops();
+  return false;
 }
 
 void onMqttConnect() {
   // Listen for config settings
-  subscribe(WiFi.macAddress().c_str(), Agent::applyConfig);
-
-  // Request config
-  Tasks::queueTask(
-      new DependentTask(std::vector{MyWiFi::dependency, Mqtt::dependency},
-                        new TimedTask(
-                            []() {
-                              if (Agent::hasConfig()) {
-                                return true;
-                              }
-
-                              mqttClient.publish(REQUEST_CONFIG, 0, false,
-                                                 WiFi.macAddress().c_str());
-                              return false;
-                            },
-                            Agent::setupListeners, 2000)));
+  restart_subscriptions();
+  agent_connected();
+  auto subscriber = Tasks::spawn(
+      Tasks::dependent(Mqtt::scope, Tasks::poll(flush_subscriptions)));
+  Tasks::name(subscriber, "mqtt-subscribe");
 
+#ifndef TASKS_DUAL_CORE
   // Handle mqtt events
-  Tasks::queueTask(
-      new DependentTask(std::vector{MyWiFi::dependency, Mqtt::dependency},
-                        new Tasks::Task(
-                            Tasks::NoOp,
-                            []() {
-                              if (mqttEventQueue.size() != 0) {
-                                auto &event = mqttEventQueue.front();
-                                handle(event);
-                                mqttEventQueue.pop();
-                              }
-                              return false;
-                            },
-                            Tasks::NoOp)));
-}
-
-void onMqttDisconnect() {
-  Serial.println("Trying to reconnect in 2 seconds");
-  Agent::reset();
-  Tasks::setTimeout(mqtt_try_connect, 2000);
+  auto drain = Tasks::spawn(
+      Tasks::dependent(Mqtt::scope, Tasks::poll(handle_events)));
+  Tasks::name(drain, "mqtt-drain");
+#endif
+
+  // Publish what the agent queued
+  restart_publishes();
+  auto publisher = Tasks::spawn(
+      Tasks::dependent(Mqtt::scope, Tasks::poll(flush_publishes)));
+  Tasks::name(publisher, "mqtt-publish");
 }
+
+void onMqttDisconnect() { mqttDropped.set(); }
 // MQTT END
 
+// Provisioning and connection pipeline, from credentials to an applied
+// config. Drops send it back to the first step that has to be redone and
+// every step is timed, so time-to-connected shows up on the serial log.
+class ConnectFlow : public Tasks::Flow<ConnectFlow> {
+private:
+  unsigned long confirm_backoff = 0;
+
+public:
+  ConnectFlow() : Flow("connect") {}
+
+  Tasks::Status run() {
+    FLOW_BEGIN();
+
+    while (!CredentialsRetriever::hasCredentials()) {
+      request_credentials();
+      FLOW_AWAIT_FOR(CredentialsRetriever::hasCredentials(), 2000);
+    }
+    mark("credentials");
+
+    while (true) {
+      wifi_try_connect();
+      FLOW_AWAIT(MyWiFi::scope.isActive());
+      mark("wifi");
+
+      while (MyWiFi::scope.isActive()) {
+        if (!resolve_broker()) {
+          Serial.println("Could not find MQTT host. Retrying in 2 seconds");
+          FLOW_SLEEP(2000);
+          continue;
+        }
+        mark("broker address");
+
+        mqttDropped.clear();
+        connectToMqtt();
+        FLOW_AWAIT(Mqtt::scope.isActive() || mqttDropped.take() ||
+                   !MyWiFi::scope.isActive());
+        if (Mqtt::scope.isActive()) {
+          mark("mqtt");
+          onMqttConnect();
+          // Replies come on the config topics, they have to be subscribed to
+          // before any request goes out
+          FLOW_AWAIT_FOR(configs_subscribed() || !Mqtt::scope.isActive(),
+                         2000);
+
+          // Agents running on their cached config, a request each has the
+          // server confirm or replace it
+          if (awaiting_confirmation()) {
+            FLOW_AWAIT_FOR(!Mqtt::scope.isActive(),
+                           random(CONFIG_CONFIRM_JITTER_MS));
+            if (Mqtt::scope.isActive()) {
+              request_configs(true);
+            }
+          }
+
+          while (Mqtt::scope.isActive() && !Agent::hasConfig()) {
+            request_configs(false);
+            FLOW_AWAIT_FOR(Agent::hasConfig() || !Mqtt::scope.isActive(),
+                           2000);
+            // The agents configured so far do not wait for the others
+            agent_listen();
+          }
+          if (Agent::hasConfig()) {
+            mark("config");
+            agent_listen();
+          }
+
+          // The request or its reply may have been lost, the cached configs
+          // are asked for again until the server has answered for them
+          confirm_backoff = CONFIG_CONFIRM_RETRY_MS;
+          while (Mqtt::scope.isActive() && awaiting_confirmation()) {
+            FLOW_AWAIT_FOR(!awaiting_confirmation() || !Mqtt::scope.isActive(),
+                           confirm_backoff);
+            if (Mqtt::scope.isActive() && awaiting_confirmation()) {
+              request_configs(true);
+              confirm_backoff =
+                  std::min(2 * confirm_backoff,
+                           (unsigned long)CONFIG_CONFIRM_RETRY_MAX_MS);
+            }
+          }
+
+          FLOW_AWAIT(!Mqtt::scope.isActive());
+        }
+        if (!MyWiFi::scope.isActive()) {
+          break;
+        }
+
+        Serial.println("Trying to reconnect to MQTT in 2 seconds");
+        FLOW_SLEEP(2000);
+        restartClock();
+      }
+
+      Serial.println("Trying to reconnect in 2 seconds");
+      FLOW_SLEEP(2000);
+      restartClock();
+    }
+
+    FLOW_END();
+  }
+};
+
 void setup() {
   Serial.begin(115200);
   Serial.println();
 
+  register_agents();
   Agent::setup();
   esp_now_setup();
-  MyWiFi::wifi_setup(
-      {.onConnect = onWifiConnect, .onDisconnect = onWifiDisconnect});
-  mqtt_setup({.onConnect = onMqttConnect, .onDisconnect = onMqttDisconnect});
+  MyWiFi::wifi_setup({.onConnect = nullptr, .onDisconnect = nullptr});
+  mqtt_setup({.onConnect = nullptr, .onDisconnect = onMqttDisconnect});
+#ifdef MQTT_COALESCE
+  mqttInbox.coalesce(Agent::isStateTopic);
+#endif
+  // The agents run on the config of the previous run until the server has
+  // a say
+  Agent::restoreConfigs();
+  Agent::setupListeners();
+
+#ifdef TASKS_DUAL_CORE
+  auto inbox = Tasks::spawn(Tasks::poll(handle_agent_messages));
+  Tasks::name(inbox, "agent-inbox");
+  // Not tied to Mqtt::scope, which belongs to the I/O core. The inbox skips
+  // the messages of a session that is over.
+  auto drain = Tasks::spawn(Tasks::poll(handle_events));
+  Tasks::name(drain, "mqtt-drain");
+  // Everything below runs on the I/O core
+  Tasks::Binding on(io);
+  auto outbox = Tasks::spawn(Tasks::poll(run_agent_requests));
+  Tasks::name(outbox, "agent-outbox");
+#endif
+
+  // The scopes the connect flow and the MQTT tasks depend on only change
+  // here, never from the callbacks reporting the changes
+  auto links = Tasks::spawn(Tasks::poll(apply_connection_changes));
+  Tasks::name(links, "link-state");
+
+  auto connect = Tasks::queueTask(new ConnectFlow());
+  Tasks::prioritize(connect, Tasks::Priority::Background);
+
+#ifdef TASKS_STATS
+  auto stats = Tasks::setInterval(
+      []() {
+        Tasks::Stats::dump(Serial);
+        Serial.println();
+        Tasks::dumpClassStats(Serial);
+        Serial.println();
+        mqttInbox.dumpStats(Serial);
+        Serial.println();
+        mqttPublishes.dumpStats(Serial);
+        Serial.println();
+        mqttOffline.dumpStats(Serial);
+        Serial.println();
+        Agent::dumpStats(Serial);
+        Serial.println();
+      },
+      STATS_DUMP_MS, false);
+  Tasks::name(stats, "stats");
+  Tasks::prioritize(stats, Tasks::Priority::Background);
+#endif
 
-  auto interval = Tasks::setInterval(request_credentials, 2000);
-  Tasks::queueTask(new Tasks::Task(
-      Tasks::NoOp, CredentialsRetriever::hasCredentials, [interval]() {
-        Tasks::clearInterval(interval);
-        wifi_try_connect();
-      }));
+#ifdef TASKS_DUAL_CORE
+  Tasks::runPinned(io, "io", IO_CORE, MAX_IDLE_MS);
+#endif
 }
 
-void loop() { Tasks::loop(); }
\ No newline at end of file
+void loop() { delay(std::min(Tasks::loop(), (unsigned long)MAX_IDLE_MS)); }
\ No newline at end of file
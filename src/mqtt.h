@@ -1,43 +1,108 @@
 #ifndef MQTT_H
 #define MQTT_H
 
-#include <ArduinoJson.h>
 #include <AsyncMqttClient.h>
+#include <Channel.h>
+#include <FilterSync.h>
+#include <JsonReader.h>
+#include <MqttInbox.h>
+#include <MyWiFi.h>
+#include <OfflineLog.h>
+#include <PublishQueue.h>
+#include <Tasks.h>
+#include <TopicRouter.h>
+#include <atomic>
 #include <map>
-#include <queue>
 
 #define MQTT_HOST "volex.local"
 #define MQTT_PORT 1883
 
+// With -D MQTT_PERSISTENT_SESSION the broker keeps the subscriptions, and
+// queues what they match, across reconnects. Not across reboots: the first
+// session of a boot starts clean, see connectToMqtt().
+#ifdef MQTT_PERSISTENT_SESSION
+#define MQTT_SUBSCRIBE_QOS 1
+#else
+#define MQTT_SUBSCRIBE_QOS 0
+#endif
+
+// Slots of the channels between the agent and the I/O core
+#ifndef MQTT_CHANNEL_SIZE
+#define MQTT_CHANNEL_SIZE 16
+#endif
+
 namespace Mqtt {
-std::shared_ptr<boolean> dependency = nullptr;
+// Tasks that need the broker connection, nested in the WiFi scope
+Tasks::Scope scope(&MyWiFi::scope, false);
+// Connection changes, raised from the AsyncTCP task
+Tasks::ScopeSignal signal(scope);
+// Whether the broker kept the session of the last connection
+std::atomic<bool> sessionPresent{false};
+// Whether a connection of this boot was set up, used with the client
+bool connectedOnce = false;
 };
 
 AsyncMqttClient mqttClient;
 
-typedef std::function<void(const String &)> TopicHandler;
+// Handlers of the subscribed topics and filters
+TopicRouter mqttRouter;
 
-// Map to associate topics with their corresponding handlers
-std::map<String, TopicHandler> mqttTopicHandlers;
+// Broker subscriptions, used with the client
+FilterSync mqttFilters;
 
-typedef struct {
-  String topic;
-  String payload;
-} MqttEvent;
+// Broker subscriptions held without a handler of their own, by number of
+// holders. The topics they cover are routed locally only.
+std::map<String, unsigned int> mqttHolds;
 
 typedef struct {
   std::function<void()> onConnect;
   std::function<void()> onDisconnect;
 } MqttConfig;
 
-std::queue<MqttEvent> mqttEventQueue;
+// Received messages, filled from the AsyncTCP task
+MqttInbox mqttInbox;
+
+// Values the agents publish, used with the client
+PublishQueue mqttPublishes;
+
+// Values published while offline, and after that until they are all sent
+#if defined(ESP32) && defined(MQTT_OFFLINE_SPILL)
+FlashSpill mqttSpill;
+OfflineLog mqttOffline(&mqttSpill);
+#else
+OfflineLog mqttOffline;
+#endif
+
+enum class MqttOp { Publish, Subscribe, Unsubscribe };
+
+typedef struct {
+  MqttOp op;
+  String topic;
+  String payload;
+  uint8_t qos;
+} MqttCommand;
+
+namespace Mqtt {
+// PUBACKs, from the AsyncTCP task to the publishing one
+Tasks::Channel<uint16_t, MQTT_CHANNEL_SIZE> acks;
+} // namespace Mqtt
+
+#ifdef TASKS_DUAL_CORE
+namespace Mqtt {
+// Client calls requested by the agent core, made by the I/O core.
+// Subscription changes are never dropped, publishes are once it is full.
+Tasks::LosslessChannel<MqttCommand, MQTT_CHANNEL_SIZE> outbox;
+} // namespace Mqtt
+#endif
 
 namespace {
 MqttConfig config;
+unsigned long reportedDrops = 0;
 
 void _onMqttConnect(bool sessionPresent) {
   Serial.println("Connected to MQTT broker!");
-  Mqtt::dependency = std::make_shared<boolean>(true);
+  Mqtt::sessionPresent.store(sessionPresent);
+  Mqtt::signal.renew();
   if (config.onConnect != nullptr) {
     config.onConnect();
   }
@@ -74,11 +139,9 @@ void _onMqttDisconnect(AsyncMqttClientDisconnectReason reason) {
     Serial.println("unknown cause");
     break;
   }
-  if (Mqtt::dependency != nullptr) {
-    *Mqtt::dependency = false;
-  }
+  Mqtt::signal.cancel();
 
-  std::queue<MqttEvent>().swap(mqttEventQueue);
+  mqttInbox.clear();
 
   if (config.onDisconnect != nullptr) {
     config.onDisconnect();
@@ -102,84 +165,274 @@ void _onMqttDisconnect(AsyncMqttClientDisconnectReason reason) {
 void onMqttMessage(char *topic, char *payload,
                    AsyncMqttClientMessageProperties properties, size_t len,
                    size_t index, size_t total) {
-  Serial.println("Received message from MQTT broker:");
-  Serial.print("  topic: ");
-  Serial.println(topic);
-  Serial.print("  payload: ");
-  Serial.println(String(payload, len));
-  Serial.print("  len: ");
-  Serial.println(len);
-  Serial.print("  index: ");
-  Serial.println(index);
-  Serial.print("  total: ");
-  Serial.println(total);
-  mqttEventQueue.push(
-      {.topic = String(topic), .payload = String(payload, len)});
-}
-
-// void onMqttPublish(uint16_t packetId) {
-//   Serial.println("Publish acknowledged.");
-//   Serial.print("  packetId: ");
-//   Serial.println(packetId);
-// }
+  mqttInbox.receive(topic, payload, len, index, total);
+}
+
+// A lost ack only costs a retransmission
+void onMqttPublish(uint16_t packetId) { Mqtt::acks.push(packetId); }
 } // namespace
 
-void prettyPrintHandler(const String &payload) {
-  StaticJsonDocument<256> doc;
-  auto err = deserializeJson(doc, payload);
-  if (err) {
+void prettyPrintHandler(const char *payload, size_t len) {
+  Serial.println("Received:");
+  if (!printJsonPretty(Serial, payload, len)) {
+    Serial.println();
     Serial.println("Failed to parse JSON");
-    return;
   }
-  String json;
-  serializeJsonPretty(doc, json);
-  Serial.println("Received:");
-  Serial.println(json);
+  Serial.println();
   Serial.println("====");
-  doc.clear();
 }
 
-void handle(const MqttEvent &e) {
+// Hands a received message to its routes, straight from its inbox slot
+void handle(const MqttSlot &slot) {
   Serial.print("Starting to handle: ");
-  Serial.println(e.topic);
-  auto handlerIter = mqttTopicHandlers.find(e.topic);
-  if (handlerIter == mqttTopicHandlers.end()) {
+  Serial.println(slot.topic);
+  if (mqttRouter.dispatch(slot.topic, slot.data, slot.len) == 0) {
     Serial.println("No handler found");
+  }
+}
+
+// Applies the connection changes the WiFi and MQTT callbacks reported to
+// their scopes, on the scheduler running the tasks of those scopes
+bool apply_connection_changes() {
+  MyWiFi::signal.apply();
+  Mqtt::signal.apply();
+  return false;
+}
+
+// Reports the messages the inbox dropped since the last call
+void report_inbox_drops() {
+  auto drops = mqttInbox.full() + mqttInbox.tooLarge();
+  if (drops == reportedDrops) {
+    return;
+  }
+  Serial.print("MQTT inbox dropped messages: ");
+  Serial.print(drops - reportedDrops);
+  Serial.print(" (full ");
+  Serial.print(mqttInbox.full());
+  Serial.print(", too large ");
+  Serial.print(mqttInbox.tooLarge());
+  Serial.println(" so far)");
+  reportedDrops = drops;
+}
+
+// Queues a value for the topic, on the side of the client. Values come
+// after those published while offline, until these are all sent.
+void queue_publish(const char *topic, const char *payload, uint8_t qos) {
+  if (!Mqtt::scope.isActive() || !mqttOffline.empty()) {
+    mqttOffline.append(topic, payload, qos);
+  } else {
+    mqttPublishes.offer(topic, payload, qos);
+  }
+}
+
+// Carries out a request on the side of the client. Values are queued,
+// subscription changes staged, see flush_publishes() and
+// flush_subscriptions().
+void perform(MqttOp op, const char *topic, const char *payload, uint8_t qos) {
+  switch (op) {
+  case MqttOp::Publish:
+    queue_publish(topic, payload, qos);
+    break;
+  case MqttOp::Subscribe:
+    mqttFilters.subscribe(topic);
+    break;
+  case MqttOp::Unsubscribe:
+    mqttFilters.unsubscribe(topic);
+    break;
+  }
+}
+
+// Makes a client call, through the I/O core in dual core builds where the
+// client is only ever used from there
+void request(MqttOp op, const char *topic, const char *payload = "",
+             uint8_t qos = 0) {
+#ifdef TASKS_DUAL_CORE
+  MqttCommand command = {.op = op,
+                         .topic = String(topic),
+                         .payload = String(payload),
+                         .qos = qos};
+  if (op != MqttOp::Publish) {
+    // Missing one would leave the broker subscriptions out of sync for good
+    Mqtt::outbox.push(std::move(command));
+  } else if (!Mqtt::outbox.offer(std::move(command))) {
+    Serial.print("MQTT outbox full, dropped value for: ");
+    Serial.println(topic);
+  }
+#else
+  perform(op, topic, payload, qos);
+#endif
+}
+
+// Queues a value for the topic, see PublishQueue and OfflineLog
+void publish(const char *topic, const char *payload, uint8_t qos = 0) {
+  request(MqttOp::Publish, topic, payload, qos);
+}
+
+// Publishes the queued values the client takes, then replays the ones
+// published offline
+bool flush_publishes() {
+  uint16_t packet_id;
+  while (Mqtt::acks.pop(packet_id)) {
+    mqttPublishes.acked(packet_id);
+  }
+#ifdef MQTT_REPLAY_COMPACT
+  mqttOffline.compact([](const OfflineRecord &record) {
+    mqttPublishes.offer(record.topic, record.payload, record.qos);
+  });
+#else
+  // Through the queue, for its window and acks, one record of a topic at a
+  // time so none is coalesced away
+  mqttOffline.replay(
+      [](const OfflineRecord &record) {
+        return mqttPublishes.accepts(record.topic) &&
+               mqttPublishes.offer(record.topic, record.payload, record.qos);
+      },
+      MQTT_REPLAY_PER_S);
+#endif
+  mqttPublishes.flush([](const char *topic, const char *payload, uint8_t qos,
+                         bool dup, uint16_t packet_id) {
+    return mqttClient.publish(topic, qos, false, payload, strlen(payload),
+                              dup, packet_id);
+  });
+  return false;
+}
+
+// Forgets the packets of the previous session, their values are sent anew
+void restart_publishes() {
+  uint16_t packet_id;
+  while (Mqtt::acks.pop(packet_id)) {
+  }
+  mqttPublishes.requeue();
+}
+
+// Whether a held filter, other than `except`, covers the topic
+bool isHeld(const char *topic, const char *except = nullptr) {
+  for (auto &hold : mqttHolds) {
+    if ((except == nullptr || hold.first != except) &&
+        TopicRouter::covers(hold.first.c_str(), topic)) {
+      return true;
+    }
+  }
+  return false;
+}
+
+// Subscribes to a filter, e.g. `pin/#`, without handling it. Until it is
+// released, the topics it covers need no broker subscription of their own.
+void hold(const char *filter) {
+  if (mqttHolds[String(filter)]++ != 0) {
+    return;
+  }
+  Serial.print("Holding: ");
+  Serial.println(filter);
+  if (!isHeld(filter, filter)) {
+    request(MqttOp::Subscribe, filter);
+  }
+  mqttRouter.forEachFilter([filter](const char *routed) {
+    if (strcmp(routed, filter) != 0 && TopicRouter::covers(filter, routed) &&
+        !isHeld(routed, filter)) {
+      request(MqttOp::Unsubscribe, routed);
+    }
+  });
+}
+
+void release(const char *filter) {
+  auto hold = mqttHolds.find(String(filter));
+  if (hold == mqttHolds.end() || --hold->second != 0) {
+    return;
+  }
+  mqttHolds.erase(hold);
+  Serial.print("Releasing: ");
+  Serial.println(filter);
+  // Topics still routed below it need their own subscription again
+  mqttRouter.forEachFilter([filter](const char *routed) {
+    if (strcmp(routed, filter) != 0 && TopicRouter::covers(filter, routed) &&
+        !isHeld(routed)) {
+      request(MqttOp::Subscribe, routed);
+    }
+  });
+  if (mqttRouter.count(filter) == 0 && !isHeld(filter)) {
+    request(MqttOp::Unsubscribe, filter);
+  }
+}
+
+// Adds a handler to a topic or filter. The broker is only asked for the
+// first route of a topic and told to forget it with the last, see
+// unsubscribe().
+Subscription subscribe(const char *topic,
+                       TopicHandler handler = prettyPrintHandler) {
+  auto id = mqttRouter.add(topic, std::move(handler));
+  if (mqttRouter.count(topic) == 1 && !isHeld(topic)) {
+    Serial.print("Subscribing to: ");
+    Serial.println(topic);
+    request(MqttOp::Subscribe, topic);
+  }
+  return {.topic = String(topic), .id = id};
+}
+
+void unsubscribe(const Subscription &subscription) {
+  auto topic = subscription.topic.c_str();
+  if (!mqttRouter.remove(topic, subscription.id)) {
     return;
   }
-  handlerIter->second(e.payload);
+  if (mqttRouter.count(topic) == 0 && !isHeld(topic)) {
+    Serial.print("Unsubscribing from: ");
+    Serial.println(topic);
+    request(MqttOp::Unsubscribe, topic);
+  }
+}
+
+// Sends the subscription changes staged since the last pass
+bool flush_subscriptions() {
+  mqttFilters.flush(
+      [](const char *filter) {
+        return mqttClient.subscribe(filter, MQTT_SUBSCRIBE_QOS) != 0;
+      },
+      [](const char *filter) { return mqttClient.unsubscribe(filter) != 0; });
+  return false;
 }
 
-void subscribe(const char *topic, TopicHandler handler = prettyPrintHandler) {
-  Serial.print("Subscribing to: ");
-  Serial.println(topic);
-  mqttTopicHandlers.emplace(String(topic), handler);
-  mqttClient.subscribe(topic, 0);
-  Serial.print("Subscribed to: ");
-  Serial.println(topic);
+// Starts over with a new connection, whose broker may not know about the
+// subscriptions anymore
+void restart_subscriptions() {
+  mqttFilters.restart(Mqtt::sessionPresent.load());
+  Mqtt::connectedOnce = true;
 }
 
-void unsubscribe(const char *topic) {
-  Serial.print("Unsubscribing from: ");
-  Serial.println(topic);
-  mqttClient.unsubscribe(topic);
-  mqttTopicHandlers.erase(String(topic));
+#ifdef TASKS_DUAL_CORE
+// Makes the client calls the agent core asked for, on the I/O core
+bool run_next_request() {
+  MqttCommand command;
+  if (!Mqtt::outbox.pop(command)) {
+    return false;
+  }
+  perform(command.op, command.topic.c_str(), command.payload.c_str(),
+          command.qos);
+  return true;
 }
+#endif
 
 void mqtt_setup(MqttConfig user_config) {
   config = user_config;
+#if defined(ESP32) && defined(MQTT_OFFLINE_SPILL)
+  mqttSpill.begin();
+#endif
   mqttClient.onConnect(_onMqttConnect);
   mqttClient.onDisconnect(_onMqttDisconnect);
   // mqttClient.onSubscribe(onMqttSubscribe);
   // mqttClient.onUnsubscribe(onMqttUnsubscribe);
   mqttClient.onMessage(onMqttMessage);
-  // mqttClient.onPublish(onMqttPublish);
+  mqttClient.onPublish(onMqttPublish);
 }
 
 void setMqttAddr(IPAddress ip) { mqttClient.setServer(ip, MQTT_PORT); }
 
 void connectToMqtt() {
   Serial.println("Connecting to MQTT...");
+#ifdef MQTT_PERSISTENT_SESSION
+  // A session left from before the boot may hold filters of an older
+  // config, which nothing here knows about to unsubscribe from
+  mqttClient.setCleanSession(!Mqtt::connectedOnce);
+#endif
   mqttClient.connect();
 }
 
@@ -0,0 +1,44 @@
+#ifndef ALLOCATIONS_H
+#define ALLOCATIONS_H
+
+#include <atomic>
+#include <cstdlib>
+#include <new>
+
+// Counts every heap allocation made by the test binary. Include it from the
+// test file only, it replaces the global operator new and its deletes.
+std::atomic<unsigned long> allocations{0};
+
+// All of them stay out of line, so the compiler never pairs a free() it
+// inlined with its own built-in operator new
+__attribute__((noinline)) void *operator new(size_t size) {
+  allocations++;
+  if (auto ptr = std::malloc(size != 0 ? size : 1)) {
+    return ptr;
+  }
+  throw std::bad_alloc();
+}
+
+__attribute__((noinline)) void *operator new[](size_t size) {
+  return operator new(size);
+}
+
+__attribute__((noinline)) void operator delete(void *ptr) noexcept {
+  std::free(ptr);
+}
+
+__attribute__((noinline)) void operator delete(void *ptr,
+                                               size_t size) noexcept {
+  std::free(ptr);
+}
+
+__attribute__((noinline)) void operator delete[](void *ptr) noexcept {
+  std::free(ptr);
+}
+
+__attribute__((noinline)) void operator delete[](void *ptr,
+                                                 size_t size) noexcept {
+  std::free(ptr);
+}
+
+#endif
@@ -0,0 +1,102 @@
+#ifndef ARDUINO_SHIM_H
+#define ARDUINO_SHIM_H
+
+// Minimal Arduino API for host builds of the scheduler headers. Only what
+// src/ actually uses off-device is provided.
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <functional>
+#include <string>
+#include <strings.h>
+
+typedef bool boolean;
+
+inline unsigned long micros() {
+  static auto start = std::chrono::steady_clock::now();
+  return std::chrono::duration_cast<std::chrono::microseconds>(
+             std::chrono::steady_clock::now() - start)
+      .count();
+}
+
+inline unsigned long millis() { return micros() / 1000; }
+
+inline void delay(unsigned long ms) {}
+inline void yield() {}
+
+class String : public std::string {
+public:
+  String() {}
+  String(const char *s) : std::string(s != nullptr ? s : "") {}
+  String(const char *s, size_t len) : std::string(s, len) {}
+  String(const std::string &s) : std::string(s) {}
+  String(char c) : std::string(1, c) {}
+  String(int v) : std::string(std::to_string(v)) {}
+  String(unsigned int v) : std::string(std::to_string(v)) {}
+  String(long v) : std::string(std::to_string(v)) {}
+  String(unsigned long v) : std::string(std::to_string(v)) {}
+
+  long toInt() const { return std::atol(c_str()); }
+  void remove(unsigned int index) { erase(index); }
+  int indexOf(const char *s) const {
+    auto at = find(s);
+    return at == npos ? -1 : (int)at;
+  }
+  bool equalsIgnoreCase(const String &other) const {
+    return strcasecmp(c_str(), other.c_str()) == 0;
+  }
+};
+
+inline String operator+(const String &a, const String &b) {
+  return String(static_cast<const std::string &>(a) +
+                static_cast<const std::string &>(b));
+}
+inline String operator+(const char *a, const String &b) {
+  return String(a) + b;
+}
+inline String operator+(const String &a, const char *b) {
+  return a + String(b);
+}
+
+class Print {
+public:
+  virtual ~Print() {}
+
+  virtual size_t write(const uint8_t *buf, size_t len) = 0;
+
+  size_t write(uint8_t c) { return write(&c, 1); }
+  size_t print(const char *s) { return write((const uint8_t *)s, strlen(s)); }
+  size_t print(const String &s) { return print(s.c_str()); }
+  size_t print(char c) { return write((uint8_t)c); }
+  size_t print(int v) { return print(String(v)); }
+  size_t print(unsigned int v) { return print(String(v)); }
+  size_t print(long v) { return print(String(v)); }
+  size_t print(unsigned long v) { return print(String(v)); }
+  size_t print(double v) { return print(String(std::to_string(v))); }
+
+  template <typename T> size_t println(const T &v) {
+    return print(v) + println();
+  }
+  size_t println() { return print("\n"); }
+};
+
+// Discards output unless `echo` is set, the scheduler logs a lot
+class HardwareSerial : public Print {
+public:
+  bool echo = false;
+
+  void begin(unsigned long baud) {}
+  virtual size_t write(const uint8_t *buf, size_t len) override {
+    return echo ? fwrite(buf, 1, len, stdout) : len;
+  }
+  using Print::write;
+};
+
+inline HardwareSerial Serial;
+
+#endif
@@ -0,0 +1,62 @@
+#ifndef PREFERENCES_SHIM_H
+#define PREFERENCES_SHIM_H
+
+// NVS for host builds, kept in memory by namespace and key. Only what src/
+// actually uses off-device is provided.
+
+#include <Arduino.h>
+#include <map>
+
+class Preferences {
+private:
+  std::map<String, String> *space = nullptr;
+  bool readOnly = false;
+
+public:
+  // Every namespace, so tests can look at what was written
+  static std::map<String, std::map<String, String>> &storage() {
+    static std::map<String, std::map<String, String>> spaces;
+    return spaces;
+  }
+
+  bool begin(const char *name, bool readOnly = false) {
+    if (readOnly && storage().count(String(name)) == 0) {
+      return false;
+    }
+    space = &storage()[String(name)];
+    this->readOnly = readOnly;
+    return true;
+  }
+
+  void end() { space = nullptr; }
+
+  String getString(const char *key, const String &fallback = String()) {
+    auto value = space->find(String(key));
+    return value != space->end() ? value->second : fallback;
+  }
+
+  uint32_t getUInt(const char *key, uint32_t fallback = 0) {
+    auto value = space->find(String(key));
+    return value != space->end() ? (uint32_t)strtoul(value->second.c_str(),
+                                                     nullptr, 10)
+                                 : fallback;
+  }
+
+  size_t putString(const char *key, const String &value) {
+    if (readOnly) {
+      return 0;
+    }
+    (*space)[String(key)] = value;
+    return value.length();
+  }
+
+  size_t putUInt(const char *key, uint32_t value) {
+    if (readOnly) {
+      return 0;
+    }
+    (*space)[String(key)] = String((unsigned long)value);
+    return sizeof(value);
+  }
+};
+
+#endif
@@ -0,0 +1,240 @@
+// Configs merged into the applied one: entries added, updated and removed,
+// inputs rebound, shared topics held once and invalid configs left out. And
+// agents hosted together, each with its own config topic and cache.
+
+#include <AgentConfig.h>
+#include <Arduino.h>
+#include <ConfigCache.h>
+#include <Preferences.h>
+#include <TopicRouter.h>
+#include <map>
+#include <set>
+#include <unity.h>
+
+const Blueprint limits = {.params = 2, .inputs = 2, .outputs = 0};
+
+// Routes on a router of its own, slots that record what they were handed
+class Recorder : public Agent::Binder {
+public:
+  TopicRouter router;
+  std::map<String, unsigned int> holds;
+  // Routes taken and let go of
+  String routes;
+  String invoked;
+
+  Subscription subscribe(const char *topic, TopicHandler handler) override {
+    routes += "+" + String(topic) + ";";
+    return {.topic = String(topic), .id = router.add(topic, handler)};
+  }
+  void unsubscribe(const Subscription &subscription) override {
+    if (router.remove(subscription.topic.c_str(), subscription.id)) {
+      routes += "-" + subscription.topic + ";";
+    }
+  }
+  void hold(const char *filter) override { holds[String(filter)]++; }
+  void release(const char *filter) override {
+    if (--holds[String(filter)] == 0) {
+      holds.erase(String(filter));
+    }
+  }
+
+  const ValueSpec &paramType(size_t slot) const override { return spec; }
+  const ValueSpec &inputType(size_t slot) const override { return spec; }
+  void invokeParam(size_t slot, const Value &value) override {
+    invoked += "p" + String((int)slot) + "=" + String(value.asInt()) + ";";
+  }
+  void invokeInput(size_t slot, const Value &value) override {
+    invoked += "i" + String((int)slot) + "=" + String(value.asInt()) + ";";
+  }
+
+private:
+  ValueSpec spec = intValue(0, 100);
+};
+
+Recorder *recorder;
+Agent::AppliedConfig *config;
+
+ConfigError load(const char *json) {
+  recorder->routes = "";
+  recorder->invoked = "";
+  return config->load(json, strlen(json), limits);
+}
+
+void setUp() {
+  recorder = new Recorder();
+  config = new Agent::AppliedConfig(*recorder);
+}
+
+void tearDown() {
+  delete config;
+  delete recorder;
+}
+
+void test_adds_updates_and_removes_params() {
+  TEST_ASSERT_TRUE(load("{\"id\":1,\"params\":[{\"id\":10,\"value\":\"1\"},"
+                        "{\"id\":11,\"value\":\"2\"}]}") == ConfigError::None);
+  TEST_ASSERT_TRUE(recorder->routes == "+param/10;+param/11;");
+  TEST_ASSERT_TRUE(recorder->invoked == "p0=1;p1=2;");
+  TEST_ASSERT_EQUAL(2, config->lastChanges().params.added);
+
+  // The second slot takes another entry, the new topic before the old goes
+  load("{\"id\":1,\"params\":[{\"id\":10,\"value\":\"1\"},"
+       "{\"id\":12,\"value\":\"3\"}]}");
+  TEST_ASSERT_TRUE(recorder->routes == "+param/12;-param/11;");
+  TEST_ASSERT_TRUE(recorder->invoked == "p1=3;");
+  TEST_ASSERT_EQUAL(1, config->lastChanges().params.unchanged);
+  TEST_ASSERT_EQUAL(1, config->lastChanges().params.updated);
+
+  // Another value for the first, the second is gone
+  load("{\"id\":1,\"params\":[{\"id\":10,\"value\":\"5\"}]}");
+  TEST_ASSERT_TRUE(recorder->routes == "-param/12;");
+  TEST_ASSERT_TRUE(recorder->invoked == "p0=5;");
+  TEST_ASSERT_EQUAL(1, config->lastChanges().params.updated);
+  TEST_ASSERT_EQUAL(1, config->lastChanges().params.removed);
+  TEST_ASSERT_FALSE(config->get().params[1].used);
+}
+
+void test_keeps_the_live_value() {
+  load("{\"id\":1,\"params\":[{\"id\":10,\"value\":\"1\"}]}");
+  recorder->router.dispatch("param/10", "7");
+  TEST_ASSERT_TRUE(recorder->invoked == "p0=1;p0=7;");
+
+  // The config caught up with the topic, nothing to hand over
+  load("{\"id\":1,\"params\":[{\"id\":10,\"value\":\"7\"}]}");
+  TEST_ASSERT_TRUE(recorder->routes == "");
+  TEST_ASSERT_TRUE(recorder->invoked == "");
+  TEST_ASSERT_EQUAL(1, config->lastChanges().params.unchanged);
+}
+
+void test_rebinds_inputs_to_another_source() {
+  load("{\"id\":1,\"inputs\":[{\"id\":3,\"src\":4,\"value\":\"1\"}]}");
+  TEST_ASSERT_TRUE(recorder->routes == "+pin/4;+pin/3;+pin/3/src;");
+  TEST_ASSERT_EQUAL(1, config->lastChanges().inputs.added);
+
+  load("{\"id\":1,\"inputs\":[{\"id\":3,\"src\":5,\"value\":\"1\"}]}");
+  TEST_ASSERT_TRUE(recorder->routes == "+pin/5;-pin/4;");
+  TEST_ASSERT_EQUAL(1, config->lastChanges().inputs.updated);
+  recorder->router.dispatch("pin/4", "8");
+  recorder->router.dispatch("pin/5", "9");
+  TEST_ASSERT_TRUE(recorder->invoked == "i0=9;");
+
+  // Rebound by the server on `pin/<id>/src`, with the value of the source
+  recorder->routes = "";
+  recorder->invoked = "";
+  recorder->router.dispatch("pin/3/src", "{\"id\":6,\"value\":\"2\"}");
+  TEST_ASSERT_TRUE(recorder->routes == "+pin/6;-pin/5;");
+  TEST_ASSERT_TRUE(recorder->invoked == "i0=2;");
+  TEST_ASSERT_EQUAL(6, config->get().inputs[0].src);
+}
+
+void test_shared_topics_are_held_once_per_agent() {
+  Agent::AppliedConfig other(*recorder);
+  const char *json =
+      "{\"id\":1,\"inputs\":[{\"id\":3,\"src\":4,\"value\":\"1\"},"
+      "{\"id\":5,\"src\":4,\"value\":\"1\"}]}";
+  load(json);
+  other.load(json, strlen(json), limits);
+  TEST_ASSERT_EQUAL(2, recorder->holds[String("pin/#")]);
+  // Every input has a route of its own
+  TEST_ASSERT_EQUAL(4, recorder->router.count("pin/4"));
+
+  // Inputs dropped, the filter is held by the other agent alone
+  load("{\"id\":2}");
+  TEST_ASSERT_EQUAL(1, recorder->holds[String("pin/#")]);
+  TEST_ASSERT_EQUAL(2, recorder->router.count("pin/4"));
+
+  other.clear();
+  TEST_ASSERT_EQUAL(0, recorder->holds.count(String("pin/#")));
+  TEST_ASSERT_EQUAL(0, recorder->router.count("pin/4"));
+  TEST_ASSERT_TRUE(other.empty());
+}
+
+void test_invalid_config_changes_nothing() {
+  load("{\"id\":1,\"params\":[{\"id\":10,\"value\":\"1\"}],"
+       "\"inputs\":[{\"id\":3,\"src\":4,\"value\":\"1\"}]}");
+  auto routes = recorder->router.size();
+
+  // Cut short after its first entry
+  TEST_ASSERT_TRUE(load("{\"id\":2,\"params\":[{\"id\":11,\"value\":\"2\"},") ==
+                   ConfigError::Malformed);
+  TEST_ASSERT_TRUE(load("{\"id\":2,\"params\":[{\"id\":11},{\"id\":12},"
+                        "{\"id\":13}]}") == ConfigError::TooManyParams);
+  TEST_ASSERT_TRUE(recorder->routes == "");
+  TEST_ASSERT_TRUE(recorder->invoked == "");
+  TEST_ASSERT_EQUAL(1, config->get().id);
+  TEST_ASSERT_EQUAL(10, config->get().params[0].id);
+  TEST_ASSERT_EQUAL(routes, recorder->router.size());
+  TEST_ASSERT_EQUAL(1, recorder->holds[String("pin/#")]);
+}
+
+void test_clear_drops_every_route() {
+  load("{\"id\":1,\"params\":[{\"id\":10,\"value\":\"1\"}],"
+       "\"inputs\":[{\"id\":3,\"src\":4,\"value\":\"1\"}]}");
+  config->clear();
+  TEST_ASSERT_TRUE(config->empty());
+  TEST_ASSERT_EQUAL(0, recorder->router.size());
+  TEST_ASSERT_EQUAL(0, recorder->holds.size());
+}
+
+void test_agents_have_their_own_identity() {
+  String mac("AA:BB:CC:DD:EE:FF");
+  TEST_ASSERT_TRUE(Agent::identityOf(mac, 0) == mac);
+  TEST_ASSERT_TRUE(Agent::identityOf(mac, 2) == "AA:BB:CC:DD:EE:FF-2");
+
+  std::set<String> identities;
+  for (size_t index = 0; index < 12; index++) {
+    auto identity = Agent::identityOf(mac, index);
+    // A config topic reaches its agent alone
+    for (auto &other : identities) {
+      TEST_ASSERT_FALSE(TopicRouter::covers(other.c_str(), identity.c_str()));
+    }
+    identities.insert(identity);
+  }
+  TEST_ASSERT_EQUAL(12, identities.size());
+}
+
+void test_agents_past_the_first_name_their_blueprint() {
+  String mac("AA:BB:CC:DD:EE:FF");
+  TEST_ASSERT_TRUE(Agent::configRequestOf(mac, 0, "vlx_led") == mac);
+  TEST_ASSERT_TRUE(Agent::configRequestOf(mac, 2, "vlx_switch") ==
+                   "AA:BB:CC:DD:EE:FF-2|vlx_switch");
+}
+
+void test_agents_have_their_own_cache() {
+  Preferences::storage().clear();
+  ConfigCache first(0);
+  ConfigCache second(1);
+  ConfigCache eleventh(11);
+  TEST_ASSERT_TRUE(first.store("{\"id\":1}"));
+  TEST_ASSERT_TRUE(second.store("{\"id\":2}"));
+  TEST_ASSERT_TRUE(eleventh.store("{\"id\":11}"));
+
+  std::set<String> keys;
+  for (auto &entry : Preferences::storage()[CONFIG_CACHE_NAMESPACE]) {
+    keys.insert(entry.first);
+  }
+  TEST_ASSERT_TRUE(keys == std::set<String>({"config", "hash", "config1",
+                                             "hash1", "config11", "hash11"}));
+
+  // As after a reboot
+  String config;
+  TEST_ASSERT_TRUE(ConfigCache(1).load(config));
+  TEST_ASSERT_TRUE(config == "{\"id\":2}");
+  TEST_ASSERT_TRUE(ConfigCache(0).load(config));
+  TEST_ASSERT_TRUE(config == "{\"id\":1}");
+  TEST_ASSERT_FALSE(ConfigCache(2).load(config));
+}
+
+int main(int argc, char **argv) {
+  UNITY_BEGIN();
+  RUN_TEST(test_adds_updates_and_removes_params);
+  RUN_TEST(test_keeps_the_live_value);
+  RUN_TEST(test_rebinds_inputs_to_another_source);
+  RUN_TEST(test_shared_topics_are_held_once_per_agent);
+  RUN_TEST(test_invalid_config_changes_nothing);
+  RUN_TEST(test_clear_drops_every_route);
+  RUN_TEST(test_agents_have_their_own_identity);
+  RUN_TEST(test_agents_past_the_first_name_their_blueprint);
+  RUN_TEST(test_agents_have_their_own_cache);
+  return UNITY_END();
+}
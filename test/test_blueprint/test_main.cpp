@@ -0,0 +1,203 @@
+// Blueprint tables and the cost of dispatching a value from a route of the
+// applied config to its slot, decoded as the slot declares, against the
+// std::map of std::function it replaced.
+
+#include <AgentConfig.h>
+#include <Arduino.h>
+#include <Blueprint.h>
+#include <TopicRouter.h>
+#include <chrono>
+#include <cstdio>
+#include <functional>
+#include <iterator>
+#include <map>
+#include <unity.h>
+
+unsigned long calls = 0;
+
+// An agent type, as Agents.h declares them
+struct Probe {
+  String last;
+
+  void first(const Value &value) {
+    calls++;
+    last = value.asBool() ? "first on" : "first off";
+  }
+  void second(const Value &value) {
+    calls++;
+    last = "second " + String((long)value.asInt());
+  }
+};
+
+constexpr Slot<Probe> paramSlots[] = {
+    {"first", boolValue(), &Probe::first},
+    {"second", intValue(0, 100), &Probe::second}};
+constexpr ValueSpec probeOutputs[] = {boolValue()};
+constexpr AgentBlueprint<Probe> blueprint = {
+    "test",       paramSlots, std::size(paramSlots), nullptr, 0,
+    probeOutputs, std::size(probeOutputs)};
+
+static_assert(blueprint.limits().params == 2, "counted from the table");
+static_assert(blueprint.limits().inputs == 0, "no input slots");
+static_assert(blueprint.limits().outputs == 1, "one output");
+
+void setUp() { calls = 0; }
+
+void tearDown() {}
+
+void test_slots_dispatch_by_position() {
+  Probe probe;
+  (probe.*blueprint.params[1].handler)(Value::ofInt(42));
+  TEST_ASSERT_EQUAL_STRING("second 42", probe.last.c_str());
+  TEST_ASSERT_EQUAL_STRING("first", blueprint.params[0].name);
+}
+
+void test_slots_declare_their_values() {
+  auto &slot = blueprint.params[1];
+  Value value;
+  TEST_ASSERT_TRUE(decodeValue(slot.value, "250", 3, value));
+  Probe probe;
+  (probe.*slot.handler)(value);
+  TEST_ASSERT_EQUAL_STRING("second 100", probe.last.c_str());
+  TEST_ASSERT_EQUAL(ValueType::Bool, blueprint.outputs[0].type);
+}
+
+void test_limits_bound_configs() {
+  auto json = String("{\"params\":[{\"id\":1},{\"id\":2},{\"id\":3}],"
+                     "\"outputs\":[4]}");
+  TEST_ASSERT_EQUAL(ConfigError::TooManyParams,
+                    checkConfig(json.c_str(), json.length(),
+                                blueprint.limits()));
+}
+
+// BENCHMARKS
+long total = 0;
+
+// Parses the text on every update, as handlers did before
+void count(const String &value) {
+  calls++;
+  total += value.toInt();
+}
+
+// As the config kept its entries before, with a handler copied in each
+struct MappedEntry {
+  String value;
+  std::function<void(const String &s)> handler;
+};
+
+// Routes on a router of its own, as agents route on the shared one
+class Host : public Agent::Binder {
+public:
+  TopicRouter router;
+
+  Subscription subscribe(const char *topic, TopicHandler handler) override {
+    return {.topic = String(topic), .id = router.add(topic, handler)};
+  }
+  void unsubscribe(const Subscription &subscription) override {
+    router.remove(subscription.topic.c_str(), subscription.id);
+  }
+  void hold(const char *filter) override {}
+  void release(const char *filter) override {}
+};
+
+// An agent type bound to its blueprint as Agent::Kind binds them
+class Counter : public Agent::Slots<Counter, Host> {
+public:
+  long total = 0;
+
+  static const AgentBlueprint<Counter> &blueprint();
+
+  void count(const Value &value) {
+    calls++;
+    total += value.asInt();
+  }
+};
+
+// Slots of the size benchmarked, filled in by bench()
+Slot<Counter> counterSlots[256];
+AgentBlueprint<Counter> counterBlueprint = {"counter", counterSlots, 0};
+
+const AgentBlueprint<Counter> &Counter::blueprint() {
+  return counterBlueprint;
+}
+
+void bench(size_t size) {
+  // Looked up by id with [], which inserts on a miss
+  std::map<int, MappedEntry> byId;
+  for (size_t i = 0; i < size; i++) {
+    byId[100 + i] = {"", count};
+  }
+  auto *mappedEntries = &byId;
+  int id = 100 + size - 1;
+  TopicRouter mappedRouter;
+  // The payload was handed over as a String
+  mappedRouter.add("param/x", [mappedEntries, id](const char *payload,
+                                                  size_t len) {
+    String value(payload, len);
+    auto &entry = (*mappedEntries)[id];
+    entry.value = value;
+    entry.handler(value);
+  });
+
+  // The config applied to an agent, its routes dispatch to the slots
+  for (size_t i = 0; i < size; i++) {
+    counterSlots[i] = {"count", intValue(), &Counter::count};
+  }
+  counterBlueprint.paramCount = size;
+  Counter counter;
+  Agent::AppliedConfig applied(counter);
+  String json = "{\"id\":1,\"params\":[";
+  for (size_t i = 0; i < size; i++) {
+    json += i ? ",{\"id\":" : "{\"id\":";
+    json += String((unsigned long)(100 + i)) + ",\"value\":\"0\"}";
+  }
+  json += "]}";
+  TEST_ASSERT_TRUE(applied.load(json.c_str(), json.length(),
+                                Counter::blueprint().limits()) ==
+                   ConfigError::None);
+  auto topic = "param/" + String(id);
+  calls = 0;
+
+  String payload("42");
+  const int rounds = 500000;
+  auto start = std::chrono::steady_clock::now();
+  for (int i = 0; i < rounds; i++) {
+    mappedRouter.dispatch("param/x", payload.c_str(), payload.length());
+  }
+  auto mappedTime = std::chrono::steady_clock::now() - start;
+
+  start = std::chrono::steady_clock::now();
+  for (int i = 0; i < rounds; i++) {
+    counter.router.dispatch(topic.c_str(), payload.c_str(), payload.length());
+  }
+  auto denseTime = std::chrono::steady_clock::now() - start;
+
+  char line[128];
+  snprintf(line, sizeof(line), "entries=%-4zu map %6.1f ns  dense %6.1f ns",
+           size,
+           (double)std::chrono::nanoseconds(mappedTime).count() / rounds,
+           (double)std::chrono::nanoseconds(denseTime).count() / rounds);
+  TEST_MESSAGE(line);
+  TEST_ASSERT_EQUAL(2 * rounds, calls);
+  TEST_ASSERT_EQUAL(42L * rounds, total);
+  TEST_ASSERT_EQUAL(42L * rounds, counter.total);
+  TEST_ASSERT_EQUAL(42, applied.get().params[size - 1].value.asInt());
+  total = 0;
+  calls = 0;
+}
+
+void test_benchmark_dispatch() {
+  for (size_t size : {2, 16, 256}) {
+    bench(size);
+  }
+}
+// BENCHMARKS END
+
+int main(int argc, char **argv) {
+  UNITY_BEGIN();
+  RUN_TEST(test_slots_dispatch_by_position);
+  RUN_TEST(test_slots_declare_their_values);
+  RUN_TEST(test_limits_bound_configs);
+  RUN_TEST(test_benchmark_dispatch);
+  return UNITY_END();
+}
@@ -0,0 +1,216 @@
+// Config ingestion: reading in place, blueprint checks, pretty printing and
+// parse cost by config size.
+
+#include <Allocations.h>
+#include <Arduino.h>
+#include <ConfigParser.h>
+#include <JsonReader.h>
+#include <chrono>
+#include <cstdio>
+#include <unity.h>
+
+// Output kept in a string
+class StringPrint : public Print {
+public:
+  String text;
+
+  size_t write(const uint8_t *buf, size_t len) override {
+    text += String((const char *)buf, len);
+    return len;
+  }
+  using Print::write;
+};
+
+const Blueprint blueprint = {.params = 2, .inputs = 2, .outputs = 1};
+String seen;
+
+ConfigError parse(const String &json, int &id) {
+  seen = "";
+  return parseConfig(
+      json.c_str(), json.length(), blueprint, id,
+      [](const ParamView &param, size_t slot) {
+        seen += "p" + String(param.id) + "@" + String((int)slot) + "=" +
+                param.value.toString() + ";";
+      },
+      [](const InputView &input, size_t slot) {
+        seen += "i" + String(input.id) + "<" + String(input.src) + "@" +
+                String((int)slot) + "=" + input.value.toString() + ";";
+      },
+      [](int output) { seen += "o" + String(output) + ";"; });
+}
+
+// A config with `inputs` inputs, as the server would send it
+String config(size_t inputs) {
+  String json = "{\"id\":1,\"params\":[{\"id\":2,\"value\":\"true\"}],"
+                "\"inputs\":[";
+  for (size_t i = 0; i < inputs; i++) {
+    json += i ? "," : "";
+    json += "{\"id\":" + String((unsigned long)(100 + i)) +
+            ",\"src\":" + String((unsigned long)(500 + i)) +
+            ",\"value\":\"" + String((unsigned long)i) + "\"}";
+  }
+  return json + "],\"outputs\":[7]}";
+}
+
+void setUp() {}
+void tearDown() {}
+
+void test_reads_every_entry_in_order() {
+  int id;
+  auto json = String("{ \"id\": 9, \"name\": {\"skip\": [1, {}]},\n"
+                     "  \"params\": [{\"id\": 1, \"value\": \"on\"},"
+                     " {\"value\": 50, \"id\": 2}],\n"
+                     "  \"inputs\": [{\"id\": 3, \"src\": 4, \"value\": "
+                     "false}],\n"
+                     "  \"outputs\": [5] }");
+  TEST_ASSERT_EQUAL(ConfigError::None, parse(json, id));
+  TEST_ASSERT_EQUAL(9, id);
+  TEST_ASSERT_EQUAL_STRING("p1@0=on;p2@1=50;i3<4@0=false;o5;", seen.c_str());
+}
+
+void test_checks_against_the_blueprint() {
+  int id;
+  TEST_ASSERT_EQUAL(ConfigError::TooManyParams,
+                    parse("{\"params\":[{},{},{}],\"outputs\":[1]}", id));
+  TEST_ASSERT_EQUAL(ConfigError::TooManyInputs,
+                    parse("{\"inputs\":[{},{},{}],\"outputs\":[1]}", id));
+  TEST_ASSERT_EQUAL(ConfigError::MissingOutputs,
+                    parse("{\"params\":[{\"id\":1}]}", id));
+  TEST_ASSERT_EQUAL(ConfigError::None, parse("{\"outputs\":[1]}", id));
+}
+
+void test_rejects_malformed_configs() {
+  const char *configs[] = {
+      "",
+      "{\"outputs\":[1]",
+      "{\"outputs\":[1]} x",
+      "{\"id\":\"1\",\"outputs\":[1]}",
+      "{\"id\":1.5,\"outputs\":[1]}",
+      "{\"id\":1.,\"outputs\":[1]}",
+      "{\"id\":1e3,\"outputs\":[1]}",
+      "{\"outputs\":[null]}",
+      "{\"params\":[{\"id\":1,}],\"outputs\":[1]}",
+      "{\"params\":[{\"id\":1,\"value\":\"a\nb\"}],\"outputs\":[1]}",
+      "{\"id\":99999999999999999999999,\"outputs\":[1]}",
+      "{\"id\":3000000000,\"outputs\":[1]}",
+      "{\"params\":[{\"id\":-2147483649}],\"outputs\":[1]}",
+      "{\"x\":[[[[[[[[[[[[[[[[[[[[]]]]]]]]]]]]]]]]]]]],\"outputs\":[1]}",
+  };
+  for (auto json : configs) {
+    TEST_ASSERT_EQUAL_MESSAGE(
+        ConfigError::Malformed,
+        checkConfig(json, strlen(json), blueprint), json);
+  }
+}
+
+void test_reads_ids_as_the_server_writes_them() {
+  int id;
+  // Whole numbers written as floats, and null as if the id was not there
+  TEST_ASSERT_EQUAL(ConfigError::None,
+                    parse("{\"id\":4.0,\"params\":[{\"id\":null,\"value\":1}],"
+                          "\"inputs\":[{\"id\":-3.00,\"src\":null}],"
+                          "\"outputs\":[5.0]}",
+                          id));
+  TEST_ASSERT_EQUAL(4, id);
+  TEST_ASSERT_EQUAL_STRING("p0@0=1;i-3<0@0=;o5;", seen.c_str());
+  TEST_ASSERT_EQUAL(ConfigError::None,
+                    parse("{\"id\":null,\"outputs\":[1]}", id));
+  TEST_ASSERT_EQUAL(0, id);
+}
+
+void test_reads_values_in_place() {
+  auto json = String("{\"id\":1,\"value\":\"plain\"}");
+  ParamView param;
+  TEST_ASSERT_TRUE(parseParam(json.c_str(), json.length(), param));
+  TEST_ASSERT_TRUE(param.value.data == json.c_str() + 17);
+  TEST_ASSERT_TRUE(param.value.equals("plain"));
+  TEST_ASSERT_FALSE(param.value.equals("plai"));
+
+  json = "{\"id\":2,\"value\":\"a\\\"b\\\\c\\n\\u00e9\\ud83d\\ude00\"}";
+  TEST_ASSERT_TRUE(parseParam(json.c_str(), json.length(), param));
+  TEST_ASSERT_TRUE(param.value.escaped);
+  TEST_ASSERT_EQUAL_STRING("a\"b\\c\n\xc3\xa9\xf0\x9f\x98\x80",
+                           param.value.toString().c_str());
+  TEST_ASSERT_TRUE(param.value.equals("a\"b\\c\n\xc3\xa9\xf0\x9f\x98\x80"));
+}
+
+void test_parsing_does_not_allocate() {
+  auto json = config(32);
+  size_t inputs = 0;
+  int id;
+  auto before = allocations.load();
+  auto error = parseConfig(
+      json.c_str(), json.length(), {.params = 1, .inputs = 32, .outputs = 1},
+      id, [](const ParamView &param, size_t slot) {},
+      [&inputs](const InputView &input, size_t slot) { inputs++; },
+      [](int output) {});
+  TEST_ASSERT_EQUAL(before, allocations.load());
+  TEST_ASSERT_EQUAL(ConfigError::None, error);
+  TEST_ASSERT_EQUAL(32, inputs);
+}
+
+void test_prints_json_indented() {
+  StringPrint out;
+  auto json = "{\"a\":[1,{\"b\":\"x,{y}\"}],\"c\":{}}";
+  TEST_ASSERT_TRUE(printJsonPretty(out, json, strlen(json)));
+  TEST_ASSERT_EQUAL_STRING("{\n"
+                           "  \"a\": [\n"
+                           "    1,\n"
+                           "    {\n"
+                           "      \"b\": \"x,{y}\"\n"
+                           "    }\n"
+                           "  ],\n"
+                           "  \"c\": {}\n"
+                           "}",
+                           out.text.c_str());
+
+  StringPrint cut;
+  TEST_ASSERT_FALSE(printJsonPretty(cut, "{\"a\":[1", 7));
+}
+
+// BENCHMARKS
+void bench(size_t inputs) {
+  auto json = config(inputs);
+  const Blueprint fits = {.params = 1, .inputs = inputs, .outputs = 1};
+  const int rounds = 20000 / inputs + 10;
+  unsigned long seen = 0;
+
+  auto start = std::chrono::steady_clock::now();
+  for (int i = 0; i < rounds; i++) {
+    int id;
+    parseConfig(
+        json.c_str(), json.length(), fits, id,
+        [](const ParamView &param, size_t slot) {},
+        [&seen](const InputView &input, size_t slot) { seen += input.src; },
+        [](int output) {});
+  }
+  auto parsed = std::chrono::steady_clock::now() - start;
+
+  char line[128];
+  auto ns = (double)std::chrono::nanoseconds(parsed).count() / rounds;
+  snprintf(line, sizeof(line),
+           "inputs=%-4zu bytes=%-6zu %9.1f us/config  %6.1f ns/byte", inputs,
+           json.length(), ns / 1000, ns / json.length());
+  TEST_MESSAGE(line);
+  TEST_ASSERT_TRUE(seen != 0);
+}
+
+void test_benchmark_config_sizes() {
+  for (size_t inputs : {1, 4, 16, 64, 256}) {
+    bench(inputs);
+  }
+}
+// BENCHMARKS END
+
+int main(int argc, char **argv) {
+  UNITY_BEGIN();
+  RUN_TEST(test_reads_every_entry_in_order);
+  RUN_TEST(test_checks_against_the_blueprint);
+  RUN_TEST(test_rejects_malformed_configs);
+  RUN_TEST(test_reads_ids_as_the_server_writes_them);
+  RUN_TEST(test_reads_values_in_place);
+  RUN_TEST(test_parsing_does_not_allocate);
+  RUN_TEST(test_prints_json_indented);
+  RUN_TEST(test_benchmark_config_sizes);
+  return UNITY_END();
+}
@@ -0,0 +1,214 @@
+// Two schedulers driven from two threads, talking through SPSC channels, as on
+// the two ESP32 cores with -D TASKS_DUAL_CORE.
+
+#include <Arduino.h>
+#include <Channel.h>
+#include <CustomTasks.h>
+#include <Tasks.h>
+#include <atomic>
+#include <thread>
+#include <unity.h>
+
+Tasks::Scheduler sampling;
+Tasks::Scheduler io;
+
+void setUp() {}
+void tearDown() {}
+
+// Drives the scheduler until it has no task left
+void drive(Tasks::Scheduler &scheduler) {
+  Tasks::bind(scheduler);
+  while (Tasks::loop() != Tasks::NO_DEADLINE) {
+    std::this_thread::yield();
+  }
+}
+
+void test_channel_keeps_order_and_counts_rejections() {
+  Tasks::Channel<int, 4> channel;
+  for (int i = 0; i < 6; i++) {
+    channel.push(i);
+  }
+  TEST_ASSERT_EQUAL(4, channel.size());
+  TEST_ASSERT_EQUAL(2, channel.full());
+
+  int value;
+  for (int i = 0; i < 4; i++) {
+    TEST_ASSERT_TRUE(channel.pop(value));
+    TEST_ASSERT_EQUAL(i, value);
+  }
+  TEST_ASSERT_FALSE(channel.pop(value));
+  TEST_ASSERT_TRUE(channel.empty());
+}
+
+void test_binding_queues_to_another_scheduler() {
+  auto before = Tasks::poolStats().used;
+  {
+    Tasks::Binding on(io);
+    Tasks::spawn(Tasks::once([]() {}));
+  }
+  TEST_ASSERT_EQUAL(before, Tasks::poolStats().used);
+  TEST_ASSERT_EQUAL(1, io.poolStats().used);
+
+  drive(io);
+  TEST_ASSERT_EQUAL(0, io.poolStats().used);
+  Tasks::bind(Tasks::defaultScheduler);
+}
+
+const unsigned long SAMPLES = 200000;
+
+// Samples flow from the sampling thread to the I/O thread and come back
+// acknowledged, every value in order, each side only running its tasks
+void test_schedulers_exchange_through_channels() {
+  static Tasks::Channel<unsigned long, 64> samples;
+  static Tasks::Channel<unsigned long, 64> acks;
+  unsigned long received = 0;
+  unsigned long acked = 0;
+  bool samples_ordered = true;
+  bool acks_ordered = true;
+  std::thread::id sampling_thread;
+  std::thread::id io_thread;
+  bool foreign = false;
+
+  {
+    Tasks::Binding on(sampling);
+    Tasks::spawn(Tasks::poll([&, next = 1UL]() mutable {
+      sampling_thread = std::this_thread::get_id();
+      while (next <= SAMPLES && samples.push(next)) {
+        next++;
+      }
+      return next > SAMPLES;
+    }));
+    Tasks::spawn(Tasks::poll([&]() {
+      foreign |= std::this_thread::get_id() != sampling_thread;
+      unsigned long ack;
+      while (acks.pop(ack)) {
+        acks_ordered &= ack == ++acked;
+      }
+      return acked == SAMPLES;
+    }));
+  }
+  {
+    Tasks::Binding on(io);
+    Tasks::spawn(Tasks::poll([&, pending = 0UL]() mutable {
+      io_thread = std::this_thread::get_id();
+      while (true) {
+        if (pending == 0 && !samples.pop(pending)) {
+          break;
+        }
+        if (!acks.push(pending)) {
+          break;
+        }
+        samples_ordered &= pending == ++received;
+        pending = 0;
+      }
+      return received == SAMPLES;
+    }));
+  }
+
+  std::thread samplingThread(drive, std::ref(sampling));
+  std::thread ioThread(drive, std::ref(io));
+  samplingThread.join();
+  ioThread.join();
+
+  TEST_ASSERT_EQUAL(SAMPLES, received);
+  TEST_ASSERT_EQUAL(SAMPLES, acked);
+  TEST_ASSERT_TRUE(samples_ordered);
+  TEST_ASSERT_TRUE(acks_ordered);
+  TEST_ASSERT_FALSE(foreign);
+  TEST_ASSERT_TRUE(sampling_thread != io_thread);
+  TEST_ASSERT_EQUAL(0, sampling.poolStats().used);
+  TEST_ASSERT_EQUAL(0, io.poolStats().used);
+}
+
+// A burst of requests far larger than the channel, as a config with many
+// routes makes, arrives whole and in order while the consumer keeps popping
+void test_lossless_channel_keeps_bursts() {
+  static Tasks::LosslessChannel<unsigned long, 16> requests;
+  const unsigned long count = 5000;
+  unsigned long received = 0;
+  bool ordered = true;
+
+  std::thread consumer([&]() {
+    unsigned long value;
+    while (received < count) {
+      if (requests.pop(value)) {
+        ordered &= value == ++received;
+      } else {
+        std::this_thread::yield();
+      }
+    }
+  });
+  for (unsigned long i = 1; i <= count; i++) {
+    requests.push(i);
+  }
+  // Values offered while the backlog is not empty are refused, they would
+  // overtake it
+  auto refused = !requests.offer(0) || requests.backlogged() == 0;
+  while (requests.backlogged() != 0) {
+    requests.flush();
+    std::this_thread::yield();
+  }
+  consumer.join();
+
+  TEST_ASSERT_TRUE(refused);
+  TEST_ASSERT_EQUAL(count, received);
+  TEST_ASSERT_TRUE(ordered);
+}
+
+// Connection callbacks signal a scope from their own thread while the
+// scheduler running its tasks keeps going, only that scheduler touches them
+void test_scope_signalled_from_another_thread() {
+  static Tasks::Scope link(nullptr, false);
+  static Tasks::ScopeSignal signal(link);
+  const int rounds = 2000;
+  std::atomic<int> applied{0};
+  std::atomic<bool> done{false};
+  unsigned long checks = 0;
+
+  {
+    Tasks::Binding on(io);
+    Tasks::spawn(Tasks::poll([&]() {
+      signal.apply();
+      applied++;
+      // As the MQTT tasks respawned on every connect
+      if (link.isActive()) {
+        Tasks::spawn(Tasks::dependent(link, Tasks::poll([&]() {
+                                        checks++;
+                                        return false;
+                                      })));
+        Tasks::spawn(Tasks::dependent(link, Tasks::timed(
+                                                5, []() { return false; })));
+      }
+      return done.load();
+    }));
+  }
+  std::thread ioThread(drive, std::ref(io));
+  for (int i = 0; i < rounds; i++) {
+    auto seen = applied.load();
+    i % 2 == 0 ? signal.renew() : signal.cancel();
+    while (applied.load() - seen < 2) {
+      std::this_thread::yield();
+    }
+  }
+  signal.cancel();
+  auto seen = applied.load();
+  while (applied.load() - seen < 2) {
+    std::this_thread::yield();
+  }
+  done = true;
+  ioThread.join();
+
+  TEST_ASSERT_FALSE(link.isActive());
+  TEST_ASSERT_TRUE(checks > 0);
+  TEST_ASSERT_EQUAL(0, io.poolStats().used);
+}
+
+int main(int argc, char **argv) {
+  UNITY_BEGIN();
+  RUN_TEST(test_channel_keeps_order_and_counts_rejections);
+  RUN_TEST(test_binding_queues_to_another_scheduler);
+  RUN_TEST(test_schedulers_exchange_through_channels);
+  RUN_TEST(test_lossless_channel_keeps_bursts);
+  RUN_TEST(test_scope_signalled_from_another_thread);
+  return UNITY_END();
+}
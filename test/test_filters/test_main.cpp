@@ -0,0 +1,131 @@
+// Broker subscriptions staged and sent once per pass, and restored on a new
+// session.
+
+#include <Arduino.h>
+#include <FilterSync.h>
+#include <unity.h>
+
+FilterSync *filters;
+String sent;
+bool accepting;
+
+bool subscribe(const char *filter) {
+  if (!accepting) {
+    return false;
+  }
+  sent += "+";
+  sent += filter;
+  sent += ";";
+  return true;
+}
+
+bool unsubscribe(const char *filter) {
+  if (!accepting) {
+    return false;
+  }
+  sent += "-";
+  sent += filter;
+  sent += ";";
+  return true;
+}
+
+void setUp() {
+  filters = new FilterSync();
+  sent = "";
+  accepting = true;
+}
+
+void tearDown() { delete filters; }
+
+void test_sends_staged_changes_once() {
+  filters->subscribe("param/1");
+  filters->subscribe("pin/#");
+  filters->subscribe("param/1");
+  TEST_ASSERT_EQUAL(2, filters->flush(subscribe, unsubscribe));
+  TEST_ASSERT_TRUE(sent == "+param/1;+pin/#;");
+  TEST_ASSERT_EQUAL(0, filters->pending());
+
+  sent = "";
+  filters->subscribe("pin/#");
+  filters->unsubscribe("param/1");
+  TEST_ASSERT_EQUAL(1, filters->flush(subscribe, unsubscribe));
+  TEST_ASSERT_TRUE(sent == "-param/1;");
+  TEST_ASSERT_EQUAL(1, filters->size());
+}
+
+void test_changes_that_cancel_out_are_not_sent() {
+  filters->subscribe("param/1");
+  filters->flush(subscribe, unsubscribe);
+
+  // A config replaced by one using the same topics
+  sent = "";
+  filters->unsubscribe("param/1");
+  filters->subscribe("param/1");
+  filters->subscribe("param/2");
+  filters->unsubscribe("param/2");
+  TEST_ASSERT_EQUAL(0, filters->flush(subscribe, unsubscribe));
+  TEST_ASSERT_TRUE(sent == "");
+  TEST_ASSERT_TRUE(filters->has("param/1"));
+}
+
+void test_keeps_what_the_client_refused() {
+  filters->subscribe("param/1");
+  filters->subscribe("param/2");
+  accepting = false;
+  TEST_ASSERT_EQUAL(0, filters->flush(subscribe, unsubscribe));
+  TEST_ASSERT_EQUAL(2, filters->pending());
+
+  accepting = true;
+  TEST_ASSERT_EQUAL(2, filters->flush(subscribe, unsubscribe));
+}
+
+void test_restores_filters_for_a_new_session() {
+  filters->restart(false);
+  filters->subscribe("config");
+  filters->subscribe("pin/#");
+  filters->flush(subscribe, unsubscribe);
+
+  // Dropped while offline, not sent again
+  sent = "";
+  filters->unsubscribe("pin/#");
+  filters->restart(false);
+  TEST_ASSERT_EQUAL(1, filters->flush(subscribe, unsubscribe));
+  TEST_ASSERT_TRUE(sent == "+config;");
+
+  // A broker that kept the session hears nothing
+  sent = "";
+  filters->restart(true);
+  TEST_ASSERT_EQUAL(0, filters->flush(subscribe, unsubscribe));
+  TEST_ASSERT_TRUE(filters->has("config"));
+}
+
+void test_first_session_after_boot_is_unknown() {
+  // Restored from the cache before the broker is reached, then dropped
+  filters->subscribe("config");
+  filters->subscribe("param/1");
+  filters->unsubscribe("param/1");
+  filters->unsubscribe("param/2");
+
+  // The kept session may hold anything from before the boot
+  filters->restart(true);
+  TEST_ASSERT_EQUAL(3, filters->flush(subscribe, unsubscribe));
+  TEST_ASSERT_TRUE(sent == "+config;-param/1;-param/2;");
+  TEST_ASSERT_EQUAL(1, filters->size());
+
+  // Known from then on
+  sent = "";
+  filters->unsubscribe("param/3");
+  filters->restart(true);
+  TEST_ASSERT_EQUAL(0, filters->flush(subscribe, unsubscribe));
+  TEST_ASSERT_TRUE(filters->has("config"));
+}
+
+int main(int argc, char **argv) {
+  UNITY_BEGIN();
+  RUN_TEST(test_sends_staged_changes_once);
+  RUN_TEST(test_changes_that_cancel_out_are_not_sent);
+  RUN_TEST(test_keeps_what_the_client_refused);
+  RUN_TEST(test_restores_filters_for_a_new_session);
+  RUN_TEST(test_first_session_after_boot_is_unknown);
+  return UNITY_END();
+}
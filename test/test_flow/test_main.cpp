@@ -0,0 +1,177 @@
+// Flows on a virtual clock: resuming after awaits, sleeping, timing out and
+// being cancelled part way.
+
+#include <Arduino.h>
+#include <Flow.h>
+#include <Tasks.h>
+#include <unity.h>
+
+unsigned long virtualMillis = 0;
+unsigned long virtualClock() { return virtualMillis; }
+
+// Runs passes until `duration` ms went by, jumping to the next deadline
+void runFor(unsigned long duration) {
+  auto end = virtualMillis + duration;
+  while (virtualMillis < end) {
+    auto left = Tasks::loop();
+    virtualMillis += std::max(1UL, std::min(left, end - virtualMillis));
+  }
+}
+
+bool ready = false;
+Tasks::Event event;
+// Steps reached, with the time they were reached at
+String steps;
+
+void step(const char *name) {
+  steps += name;
+  steps += "@";
+  steps += String(virtualMillis);
+  steps += ";";
+}
+
+class Steps : public Tasks::Flow<Steps> {
+public:
+  Steps() : Flow("steps") {}
+
+  Tasks::Status run() {
+    FLOW_BEGIN();
+    step("start");
+    FLOW_AWAIT(ready);
+    step("ready");
+    FLOW_SLEEP(1000);
+    step("slept");
+    FLOW_AWAIT_FOR(event.take(), 500);
+    step("waited");
+    FLOW_AWAIT_FOR(event.take(), 500);
+    step("end");
+    FLOW_END();
+  }
+};
+
+class Failing : public Tasks::Flow<Failing> {
+public:
+  Failing() : Flow("failing") {}
+
+  Tasks::Status run() {
+    FLOW_BEGIN();
+    step("start");
+    FLOW_SLEEP(100);
+    FLOW_FAIL();
+    step("unreachable");
+    FLOW_END();
+  }
+};
+
+void setUp() {
+  virtualMillis = 0;
+  Tasks::setClock(virtualClock);
+  ready = false;
+  event.clear();
+  steps = "";
+}
+
+void tearDown() {}
+
+void test_resumes_after_await() {
+  Tasks::queueTask(new Steps());
+  runFor(50);
+  TEST_ASSERT_EQUAL_STRING("start@0;", steps.c_str());
+
+  ready = true;
+  virtualMillis = 100;
+  Tasks::loop();
+  TEST_ASSERT_EQUAL_STRING("start@0;ready@100;", steps.c_str());
+  runFor(3000);
+  TEST_ASSERT_EQUAL(0, Tasks::poolStats().used);
+}
+
+void test_sleep_parks_until_the_deadline() {
+  ready = true;
+  Tasks::queueTask(new Steps());
+  Tasks::loop();
+  // Parked, nothing to check before the deadline
+  TEST_ASSERT_EQUAL(1000, Tasks::nextDeadline());
+  virtualMillis = 999;
+  Tasks::loop();
+  TEST_ASSERT_EQUAL_STRING("start@0;ready@0;", steps.c_str());
+  virtualMillis = 1000;
+  Tasks::loop();
+  TEST_ASSERT_EQUAL_STRING("start@0;ready@0;slept@1000;", steps.c_str());
+  runFor(2000);
+  TEST_ASSERT_EQUAL(0, Tasks::poolStats().used);
+}
+
+void test_await_for_times_out_or_resumes_early() {
+  ready = true;
+  Tasks::queueTask(new Steps());
+  runFor(1000);
+  // Polled while waiting, the condition may hold on any pass
+  TEST_ASSERT_EQUAL(0, Tasks::nextDeadline());
+
+  // Nothing came, the wait is over after its timeout
+  runFor(600);
+  TEST_ASSERT_EQUAL_STRING("start@0;ready@0;slept@1000;waited@1500;",
+                           steps.c_str());
+
+  // The event came before the timeout
+  virtualMillis = 1600;
+  event.set();
+  Tasks::loop();
+  TEST_ASSERT_EQUAL_STRING(
+      "start@0;ready@0;slept@1000;waited@1500;end@1600;", steps.c_str());
+  TEST_ASSERT_FALSE(event.isSet());
+  TEST_ASSERT_EQUAL(0, Tasks::poolStats().used);
+}
+
+void test_cancelled_flow_stops_mid_way() {
+  Tasks::Scope scope;
+  ready = true;
+  Tasks::queueTask(new Steps(), scope);
+  runFor(500);
+  TEST_ASSERT_EQUAL(1, Tasks::poolStats().used);
+
+  // Cancelled while sleeping, it never resumes
+  scope.cancel();
+  TEST_ASSERT_EQUAL(0, Tasks::poolStats().used);
+  runFor(3000);
+  TEST_ASSERT_EQUAL_STRING("start@0;ready@0;", steps.c_str());
+
+  // Cancelled while awaiting
+  steps = "";
+  ready = false;
+  auto ref = Tasks::queueTask(new Steps());
+  runFor(100);
+  Tasks::cancel(ref);
+  ready = true;
+  runFor(3000);
+  TEST_ASSERT_EQUAL_STRING("start@3500;", steps.c_str());
+  TEST_ASSERT_EQUAL(0, Tasks::poolStats().used);
+}
+
+void test_failed_flow_is_dropped() {
+  Tasks::queueTask(new Failing());
+  runFor(1000);
+  TEST_ASSERT_EQUAL_STRING("start@0;", steps.c_str());
+  TEST_ASSERT_EQUAL(0, Tasks::poolStats().used);
+}
+
+void test_event_is_taken_once() {
+  TEST_ASSERT_FALSE(event.take());
+  event.set();
+  event.set();
+  TEST_ASSERT_TRUE(event.isSet());
+  TEST_ASSERT_TRUE(event.take());
+  TEST_ASSERT_FALSE(event.take());
+}
+
+int main(int argc, char **argv) {
+  UNITY_BEGIN();
+  RUN_TEST(test_resumes_after_await);
+  RUN_TEST(test_sleep_parks_until_the_deadline);
+  RUN_TEST(test_await_for_times_out_or_resumes_early);
+  RUN_TEST(test_cancelled_flow_stops_mid_way);
+  RUN_TEST(test_failed_flow_is_dropped);
+  RUN_TEST(test_event_is_taken_once);
+  return UNITY_END();
+}
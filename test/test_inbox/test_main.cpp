@@ -0,0 +1,283 @@
+// Inbound MQTT messages, from the AsyncTCP task to the drain, as a thread pair,
+// and the batches they are drained in.
+
+#include <Allocations.h>
+#include <Arduino.h>
+#include <ConfigParser.h>
+#include <MqttInbox.h>
+#include <atomic>
+#include <cstdio>
+#include <thread>
+#include <unity.h>
+
+MqttInbox *inbox;
+
+void setUp() { inbox = new MqttInbox(); }
+void tearDown() { delete inbox; }
+
+bool receive(const char *topic, const char *payload) {
+  auto len = strlen(payload);
+  return inbox->receive(topic, payload, len, 0, len);
+}
+
+void test_keeps_messages_in_order() {
+  TEST_ASSERT_TRUE(receive("pin/1", "on"));
+  TEST_ASSERT_TRUE(receive("param/2", "{\"a\":1}"));
+
+  auto slot = inbox->front();
+  TEST_ASSERT_NOT_NULL(slot);
+  TEST_ASSERT_EQUAL_STRING("pin/1", slot->topic);
+  TEST_ASSERT_EQUAL_STRING("on", slot->payload);
+  TEST_ASSERT_EQUAL(2, slot->len);
+  inbox->drop();
+
+  slot = inbox->front();
+  TEST_ASSERT_NOT_NULL(slot);
+  TEST_ASSERT_EQUAL_STRING("param/2", slot->topic);
+  inbox->drop();
+  TEST_ASSERT_NULL(inbox->front());
+}
+
+void test_puts_chunks_together() {
+  TEST_ASSERT_TRUE(inbox->receive("config", "hello ", 6, 0, 11));
+  TEST_ASSERT_NULL(inbox->front());
+  TEST_ASSERT_TRUE(inbox->receive("config", "world", 5, 6, 11));
+
+  auto slot = inbox->front();
+  TEST_ASSERT_NOT_NULL(slot);
+  TEST_ASSERT_EQUAL_STRING("hello world", slot->payload);
+
+  // A chunk out of place drops its message
+  inbox->drop();
+  TEST_ASSERT_TRUE(inbox->receive("config", "hello ", 6, 0, 11));
+  TEST_ASSERT_FALSE(inbox->receive("config", "world", 5, 4, 11));
+  TEST_ASSERT_FALSE(inbox->receive("config", "world", 5, 6, 11));
+  TEST_ASSERT_NULL(inbox->front());
+}
+
+void test_counts_dropped_messages() {
+  static char large[MQTT_LARGE_PAYLOAD_SIZE + 2];
+  memset(large, 'x', sizeof(large) - 1);
+  TEST_ASSERT_FALSE(receive("pin/1", large));
+  static char topic[MQTT_TOPIC_SIZE + 2];
+  memset(topic, 't', sizeof(topic) - 1);
+  TEST_ASSERT_FALSE(receive(topic, "on"));
+  TEST_ASSERT_EQUAL(2, inbox->tooLarge());
+
+  for (size_t i = 0; i < inbox->capacity(); i++) {
+    TEST_ASSERT_TRUE(receive("pin/1", "on"));
+  }
+  TEST_ASSERT_FALSE(receive("pin/1", "off"));
+  TEST_ASSERT_EQUAL(1, inbox->full());
+  TEST_ASSERT_EQUAL(inbox->capacity(), inbox->size());
+}
+
+// Hands the message over in chunks of `chunk` bytes, as the client does
+bool receiveChunked(const char *topic, const String &payload, size_t chunk) {
+  auto received = true;
+  for (size_t index = 0; index < payload.length(); index += chunk) {
+    auto len = std::min(chunk, payload.length() - index);
+    received = inbox->receive(topic, payload.c_str() + index, len, index,
+                              payload.length());
+  }
+  return received;
+}
+
+void test_takes_large_configs_one_at_a_time() {
+  String config = "{\"id\":1,\"inputs\":[";
+  for (int i = 0; i < 16; i++) {
+    config += i ? ",{\"id\":" : "{\"id\":";
+    config += String(100 + i) + ",\"src\":" + String(200 + i) +
+              ",\"value\":\"true\"}";
+  }
+  config += "]}";
+  TEST_ASSERT_TRUE(config.length() > MQTT_PAYLOAD_SIZE);
+
+  TEST_ASSERT_TRUE(receiveChunked("AA:BB", config, 100));
+  // The large buffer is taken until the first is handled
+  TEST_ASSERT_FALSE(receiveChunked("AA:BB-1", config, 100));
+  TEST_ASSERT_TRUE(receive("pin/1", "on"));
+  TEST_ASSERT_EQUAL(1, inbox->tooLarge());
+
+  const Blueprint blueprint = {.params = 0, .inputs = 16, .outputs = 0};
+  String seen;
+  inbox->drain([&](const MqttSlot &slot) {
+    seen += String(slot.topic) + ";";
+    if (strcmp(slot.topic, "AA:BB") != 0) {
+      return true;
+    }
+    int id;
+    size_t inputs = 0;
+    auto error = parseConfig(
+        slot.data, slot.len, blueprint, id,
+        [](const ParamView &param, size_t slot) {},
+        [&](const InputView &input, size_t slot) { inputs++; },
+        [](int output) {});
+    TEST_ASSERT_TRUE(error == ConfigError::None);
+    TEST_ASSERT_EQUAL(16, inputs);
+    return true;
+  });
+  TEST_ASSERT_TRUE(seen == "AA:BB;pin/1;");
+
+  TEST_ASSERT_TRUE(receiveChunked("AA:BB-1", config, 100));
+  TEST_ASSERT_EQUAL_STRING(config.c_str(), inbox->front()->data);
+  inbox->drop();
+
+  // A message cut short lets go of the buffer
+  TEST_ASSERT_TRUE(inbox->receive("AA:BB", config.c_str(), 100, 0,
+                                  config.length()));
+  inbox->clear();
+  TEST_ASSERT_TRUE(receiveChunked("AA:BB", config, 100));
+}
+
+void test_clear_forgets_the_previous_session() {
+  receive("pin/1", "old");
+  inbox->receive("pin/2", "ol", 2, 0, 3);
+  inbox->clear();
+  TEST_ASSERT_FALSE(inbox->receive("pin/2", "d", 1, 2, 3));
+  receive("pin/3", "new");
+
+  auto slot = inbox->front();
+  TEST_ASSERT_NOT_NULL(slot);
+  TEST_ASSERT_EQUAL_STRING("pin/3", slot->topic);
+  inbox->drop();
+  TEST_ASSERT_NULL(inbox->front());
+}
+
+void test_receiving_does_not_allocate() {
+  auto before = allocations.load();
+  for (int i = 0; i < 1000; i++) {
+    receive("pin/42", "true");
+    inbox->front();
+    inbox->drop();
+  }
+  TEST_ASSERT_EQUAL(before, allocations.load());
+}
+
+void test_drains_in_batches() {
+  for (int i = 0; i < 12; i++) {
+    receive("pin/1", String(i).c_str());
+  }
+  String seen;
+  auto record = [&seen](const MqttSlot &slot) {
+    seen += slot.payload;
+    seen += ";";
+    return true;
+  };
+
+  TEST_ASSERT_EQUAL(5, inbox->drain(record, 5));
+  TEST_ASSERT_TRUE(seen == "0;1;2;3;4;");
+  TEST_ASSERT_EQUAL(7, inbox->drain(record, 10));
+  TEST_ASSERT_EQUAL(0, inbox->drain(record, 10));
+
+  auto &stats = inbox->stats();
+  TEST_ASSERT_EQUAL(12, stats.handled);
+  TEST_ASSERT_EQUAL(2, stats.batches);
+  TEST_ASSERT_EQUAL(7, stats.max_batch);
+  TEST_ASSERT_EQUAL(12, stats.max_depth);
+}
+
+void test_drain_stops_on_budget_and_refusal() {
+  for (int i = 0; i < 4; i++) {
+    receive("pin/1", "on");
+  }
+  // Over budget after the first message, which is always handled
+  TEST_ASSERT_EQUAL(1, inbox->drain([](const MqttSlot &slot) { return true; },
+                                    10, 0));
+
+  int calls = 0;
+  auto refuseSecond = [&calls](const MqttSlot &slot) { return ++calls != 2; };
+  TEST_ASSERT_EQUAL(1, inbox->drain(refuseSecond, 10));
+  TEST_ASSERT_EQUAL(2, inbox->size());
+}
+
+bool isPin(const char *topic) {
+  return strncmp(topic, "pin/", 4) == 0 && strchr(topic + 4, '/') == nullptr;
+}
+
+void test_coalesces_state_topics_only() {
+  receive("pin/1", "1");
+  receive("pin/1/src", "a");
+  receive("pin/2", "1");
+  receive("pin/1", "2");
+  receive("pin/1/src", "b");
+  receive("pin/1", "3");
+  String seen;
+  auto record = [&seen](const MqttSlot &slot) {
+    seen += slot.topic;
+    seen += "=";
+    seen += slot.payload;
+    seen += ";";
+    return true;
+  };
+
+  inbox->coalesce(isPin);
+  TEST_ASSERT_EQUAL(4, inbox->drain(record, 10));
+  TEST_ASSERT_TRUE(seen == "pin/1/src=a;pin/2=1;pin/1/src=b;pin/1=3;");
+  TEST_ASSERT_EQUAL(2, inbox->stats().coalesced);
+
+  // Every value is handled once turned off
+  seen = "";
+  inbox->coalesce(nullptr);
+  receive("pin/1", "1");
+  receive("pin/1", "2");
+  TEST_ASSERT_EQUAL(2, inbox->drain(record, 10));
+  TEST_ASSERT_TRUE(seen == "pin/1=1;pin/1=2;");
+}
+
+const unsigned long MESSAGES = 100000;
+
+// Every message arrives intact and in order while both sides run at once
+void test_threads_exchange_messages() {
+  unsigned long handled = 0;
+  bool intact = true;
+
+  std::thread receiver([]() {
+    char payload[16];
+    for (unsigned long i = 1; i <= MESSAGES;) {
+      auto len = (size_t)snprintf(payload, sizeof(payload), "%lu", i);
+      if (inbox->receive("pin/1", payload, len, 0, len)) {
+        i++;
+      } else {
+        std::this_thread::yield();
+      }
+    }
+  });
+  std::thread handler([&]() {
+    char expected[16];
+    while (handled < MESSAGES) {
+      auto slot = inbox->front();
+      if (slot == nullptr) {
+        std::this_thread::yield();
+        continue;
+      }
+      snprintf(expected, sizeof(expected), "%lu", ++handled);
+      intact &= strcmp(slot->payload, expected) == 0 &&
+                strcmp(slot->topic, "pin/1") == 0;
+      inbox->drop();
+    }
+  });
+  receiver.join();
+  handler.join();
+
+  TEST_ASSERT_EQUAL(MESSAGES, handled);
+  TEST_ASSERT_TRUE(intact);
+  char line[64];
+  snprintf(line, sizeof(line), "rejected while full: %lu", inbox->full());
+  TEST_MESSAGE(line);
+}
+
+int main(int argc, char **argv) {
+  UNITY_BEGIN();
+  RUN_TEST(test_keeps_messages_in_order);
+  RUN_TEST(test_puts_chunks_together);
+  RUN_TEST(test_counts_dropped_messages);
+  RUN_TEST(test_takes_large_configs_one_at_a_time);
+  RUN_TEST(test_clear_forgets_the_previous_session);
+  RUN_TEST(test_receiving_does_not_allocate);
+  RUN_TEST(test_drains_in_batches);
+  RUN_TEST(test_drain_stops_on_budget_and_refusal);
+  RUN_TEST(test_coalesces_state_topics_only);
+  RUN_TEST(test_threads_exchange_messages);
+  return UNITY_END();
+}
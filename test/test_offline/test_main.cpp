@@ -0,0 +1,175 @@
+// Publishes kept while offline: order, paced replay, compaction and the spill
+// past the RAM ring, on a virtual clock.
+
+#include <Arduino.h>
+#include <OfflineLog.h>
+#include <Tasks.h>
+#include <deque>
+#include <unity.h>
+
+unsigned long virtualMillis = 0;
+unsigned long virtualClock() { return virtualMillis; }
+
+// Spill kept in memory, as the flash one would keep it
+class MemorySpill : public OfflineSpill {
+public:
+  std::deque<OfflineRecord> records;
+
+  bool write(const OfflineRecord &record) override {
+    records.push_back(record);
+    return true;
+  }
+  bool front(OfflineRecord &record) override {
+    if (records.empty()) {
+      return false;
+    }
+    record = records.front();
+    return true;
+  }
+  void drop() override { records.pop_front(); }
+  size_t size() const override { return records.size(); }
+};
+
+OfflineLog *offline;
+String sent;
+bool accepting;
+
+bool send(const OfflineRecord &record) {
+  if (!accepting) {
+    return false;
+  }
+  sent += record.topic;
+  sent += "=";
+  sent += record.payload;
+  sent += ";";
+  return true;
+}
+
+void setUp() {
+  virtualMillis = 1000;
+  Tasks::setClock(virtualClock);
+  offline = new OfflineLog();
+  sent = "";
+  accepting = true;
+}
+
+void tearDown() { delete offline; }
+
+void test_replays_in_order_at_the_set_rate() {
+  for (int i = 1; i <= 5; i++) {
+    offline->append("pin/1", String(i).c_str(), 0);
+  }
+  // 10 a second, one every 100 ms
+  TEST_ASSERT_EQUAL(1, offline->replay(send, 10));
+  virtualMillis += 50;
+  TEST_ASSERT_EQUAL(0, offline->replay(send, 10));
+  virtualMillis += 50;
+  TEST_ASSERT_EQUAL(1, offline->replay(send, 10));
+  TEST_ASSERT_TRUE(sent == "pin/1=1;pin/1=2;");
+
+  // Idle time does not turn into a burst
+  virtualMillis += 10000;
+  TEST_ASSERT_EQUAL(1, offline->replay(send, 10));
+  TEST_ASSERT_EQUAL(2, offline->size());
+}
+
+void test_waits_while_the_client_refuses() {
+  offline->append("pin/1", "1", 0);
+  accepting = false;
+  TEST_ASSERT_EQUAL(0, offline->replay(send, 1000));
+  accepting = true;
+  TEST_ASSERT_EQUAL(1, offline->replay(send, 1000));
+  TEST_ASSERT_TRUE(offline->empty());
+}
+
+void test_overwrites_the_oldest_once_full() {
+  for (int i = 0; i < MQTT_OFFLINE_SLOTS + 2; i++) {
+    offline->append("pin/1", String(i).c_str(), 0);
+  }
+  TEST_ASSERT_EQUAL(MQTT_OFFLINE_SLOTS, offline->size());
+  TEST_ASSERT_EQUAL(2, offline->stats().dropped);
+  offline->replay(send, 1000);
+  TEST_ASSERT_TRUE(sent == "pin/1=2;");
+}
+
+void test_compacts_to_the_last_values() {
+  offline->append("pin/1", "1", 0);
+  offline->append("pin/2", "1", 1);
+  offline->append("pin/1", "2", 0);
+  String last1, last2;
+  offline->compact([&](const OfflineRecord &record) {
+    (strcmp(record.topic, "pin/1") == 0 ? last1 : last2) = record.payload;
+  });
+  TEST_ASSERT_TRUE(last1 == "2" && last2 == "1");
+  TEST_ASSERT_TRUE(offline->empty());
+  TEST_ASSERT_EQUAL(3, offline->stats().replayed);
+}
+
+void test_spills_the_oldest_and_replays_them_first() {
+  MemorySpill spill;
+  OfflineLog spilling(&spill);
+  for (int i = 0; i < MQTT_OFFLINE_SLOTS + 3; i++) {
+    spilling.append("pin/1", String(i).c_str(), 0);
+  }
+  TEST_ASSERT_EQUAL(3, spill.size());
+  TEST_ASSERT_EQUAL(MQTT_OFFLINE_SLOTS + 3, spilling.size());
+  TEST_ASSERT_EQUAL(0, spilling.stats().dropped);
+
+  while (!spilling.empty()) {
+    virtualMillis += 1;
+    spilling.replay(send, 1000);
+  }
+  String expected;
+  for (int i = 0; i < MQTT_OFFLINE_SLOTS + 3; i++) {
+    expected += "pin/1=" + String(i) + ";";
+  }
+  TEST_ASSERT_TRUE(sent == expected);
+}
+
+void test_replays_through_the_publish_queue() {
+  PublishQueue queue(0);
+  offline->append("pin/1", "1", 1);
+  offline->append("pin/1", "2", 1);
+  offline->append("pin/2", "3", 0);
+  uint16_t next_id = 1;
+  auto pass = [&]() {
+    virtualMillis += 1;
+    offline->replay(
+        [&](const OfflineRecord &record) {
+          return queue.accepts(record.topic) &&
+                 queue.offer(record.topic, record.payload, record.qos);
+        },
+        1000);
+    queue.flush([&](const char *topic, const char *payload, uint8_t qos,
+                    bool dup, uint16_t packet_id) {
+      sent += String(topic) + "=" + payload + ";";
+      return packet_id != 0 ? packet_id : next_id++;
+    });
+  };
+
+  pass();
+  pass();
+  // The next value of the topic waits for the PUBACK, the rest behind it
+  TEST_ASSERT_TRUE(sent == "pin/1=1;");
+  TEST_ASSERT_EQUAL(2, offline->size());
+  TEST_ASSERT_EQUAL(1, queue.inflight());
+
+  queue.acked(1);
+  pass();
+  pass();
+  TEST_ASSERT_TRUE(sent == "pin/1=1;pin/1=2;pin/2=3;");
+  TEST_ASSERT_TRUE(offline->empty());
+  TEST_ASSERT_EQUAL(0, queue.stats().coalesced);
+  TEST_ASSERT_EQUAL(0, queue.stats().superseded);
+}
+
+int main(int argc, char **argv) {
+  UNITY_BEGIN();
+  RUN_TEST(test_replays_in_order_at_the_set_rate);
+  RUN_TEST(test_waits_while_the_client_refuses);
+  RUN_TEST(test_overwrites_the_oldest_once_full);
+  RUN_TEST(test_compacts_to_the_last_values);
+  RUN_TEST(test_spills_the_oldest_and_replays_them_first);
+  RUN_TEST(test_replays_through_the_publish_queue);
+  return UNITY_END();
+}
@@ -0,0 +1,207 @@
+// Outbound publishes: coalescing, rate limit, backpressure and the QoS 1 window
+// on a virtual clock.
+
+#include <Arduino.h>
+#include <PublishQueue.h>
+#include <Tasks.h>
+#include <unity.h>
+
+unsigned long virtualMillis = 0;
+unsigned long virtualClock() { return virtualMillis; }
+
+PublishQueue *queue;
+String sent;
+// Publishes the client still takes, unlimited when negative
+int room;
+uint16_t last_packet_id;
+
+uint16_t send(const char *topic, const char *payload, uint8_t qos, bool dup,
+              uint16_t packet_id) {
+  if (room == 0) {
+    return 0;
+  }
+  room--;
+  sent += dup ? "dup " : "";
+  sent += topic;
+  sent += "=";
+  sent += payload;
+  sent += ";";
+  if (qos == 0) {
+    return 1;
+  }
+  return packet_id != 0 ? packet_id : ++last_packet_id;
+}
+
+void setUp() {
+  virtualMillis = 1000;
+  Tasks::setClock(virtualClock);
+  queue = new PublishQueue(100);
+  sent = "";
+  room = -1;
+  last_packet_id = 0;
+}
+
+void tearDown() { delete queue; }
+
+void test_publishes_oldest_first() {
+  queue->offer("pin/1", "a");
+  queue->offer("pin/2", "b");
+  TEST_ASSERT_EQUAL(2, queue->pending());
+  TEST_ASSERT_EQUAL(2, queue->flush(send));
+  TEST_ASSERT_TRUE(sent == "pin/1=a;pin/2=b;");
+  TEST_ASSERT_EQUAL(0, queue->pending());
+}
+
+void test_keeps_the_latest_value_per_topic() {
+  queue->offer("pin/1", "1");
+  queue->offer("pin/2", "1");
+  queue->offer("pin/1", "2");
+  queue->offer("pin/1", "3");
+  TEST_ASSERT_EQUAL(2, queue->flush(send));
+  TEST_ASSERT_TRUE(sent == "pin/1=3;pin/2=1;");
+  TEST_ASSERT_EQUAL(2, queue->stats().coalesced);
+}
+
+void test_limits_the_rate_per_topic() {
+  queue->offer("pin/1", "1");
+  queue->flush(send);
+  for (int i = 2; i <= 10; i++) {
+    virtualMillis += 10;
+    queue->offer("pin/1", String(i).c_str());
+    queue->offer("pin/2", String(i).c_str());
+    queue->flush(send);
+  }
+  // Other topics are not held back
+  TEST_ASSERT_TRUE(sent == "pin/1=1;pin/2=2;");
+
+  virtualMillis += 10;
+  queue->flush(send);
+  TEST_ASSERT_TRUE(sent == "pin/1=1;pin/2=2;pin/1=10;");
+  TEST_ASSERT_EQUAL(8 + 7, queue->stats().coalesced);
+}
+
+void test_stops_when_the_client_is_full() {
+  queue->offer("pin/1", "a");
+  queue->offer("pin/2", "b");
+  room = 1;
+  TEST_ASSERT_EQUAL(1, queue->flush(send));
+  TEST_ASSERT_EQUAL(1, queue->stats().blocked);
+  TEST_ASSERT_EQUAL(1, queue->pending());
+
+  room = -1;
+  TEST_ASSERT_EQUAL(1, queue->flush(send));
+  TEST_ASSERT_TRUE(sent == "pin/1=a;pin/2=b;");
+}
+
+void test_overflow_drops_oldest_or_rejects() {
+  room = 0;
+  for (int i = 0; i < MQTT_PUBLISH_SLOTS; i++) {
+    queue->offer(("pin/" + String(i)).c_str(), "v");
+  }
+  TEST_ASSERT_TRUE(queue->offer("pin/new", "v"));
+  TEST_ASSERT_EQUAL(1, queue->stats().dropped);
+  room = -1;
+  queue->flush(send);
+  TEST_ASSERT_TRUE(sent.indexOf("pin/0=") < 0);
+  TEST_ASSERT_TRUE(sent.indexOf("pin/new=v") >= 0);
+
+  PublishQueue strict(100, Overflow::Reject);
+  for (int i = 0; i < MQTT_PUBLISH_SLOTS; i++) {
+    strict.offer(("pin/" + String(i)).c_str(), "v");
+  }
+  TEST_ASSERT_FALSE(strict.offer("pin/new", "v"));
+  TEST_ASSERT_TRUE(strict.offer("pin/0", "w"));
+  TEST_ASSERT_EQUAL(1, strict.stats().dropped);
+}
+
+void test_tracks_qos1_until_acked() {
+  queue->offer("pin/1", "on", 1);
+  queue->flush(send);
+  TEST_ASSERT_EQUAL(1, queue->inflight());
+
+  virtualMillis += 40;
+  queue->acked(1);
+  TEST_ASSERT_EQUAL(0, queue->inflight());
+  TEST_ASSERT_EQUAL(1, queue->stats().acked);
+  TEST_ASSERT_EQUAL(40, queue->stats().max_ack_ms);
+
+  // Acks of unknown packets are ignored
+  queue->acked(1);
+  queue->acked(7);
+  TEST_ASSERT_EQUAL(1, queue->stats().acked);
+}
+
+void test_retransmits_until_acked() {
+  queue->offer("pin/1", "on", 1);
+  queue->flush(send);
+  virtualMillis += MQTT_RETRY_MS - 1;
+  queue->flush(send);
+  TEST_ASSERT_TRUE(sent == "pin/1=on;");
+
+  virtualMillis += 1;
+  queue->flush(send);
+  TEST_ASSERT_TRUE(sent == "pin/1=on;dup pin/1=on;");
+  TEST_ASSERT_EQUAL(1, queue->stats().retransmits);
+
+  queue->acked(1);
+  virtualMillis += MQTT_RETRY_MS;
+  TEST_ASSERT_EQUAL(0, queue->flush(send));
+}
+
+void test_newer_value_supersedes_unacked() {
+  queue->offer("pin/1", "on", 1);
+  queue->flush(send);
+  queue->offer("pin/1", "off", 1);
+  TEST_ASSERT_EQUAL(0, queue->inflight());
+  TEST_ASSERT_EQUAL(1, queue->stats().superseded);
+
+  virtualMillis += 100;
+  queue->flush(send);
+  TEST_ASSERT_TRUE(sent == "pin/1=on;pin/1=off;");
+  queue->acked(1);
+  TEST_ASSERT_EQUAL(0, queue->stats().acked);
+  TEST_ASSERT_EQUAL(1, queue->inflight());
+}
+
+void test_full_window_holds_back_qos1_only() {
+  for (int i = 0; i < MQTT_INFLIGHT_WINDOW + 1; i++) {
+    queue->offer(("pin/" + String(i)).c_str(), "on", 1);
+  }
+  queue->offer("pin/fast", "on");
+  TEST_ASSERT_EQUAL(MQTT_INFLIGHT_WINDOW + 1, queue->flush(send));
+  TEST_ASSERT_EQUAL(MQTT_INFLIGHT_WINDOW, queue->inflight());
+  TEST_ASSERT_EQUAL(1, queue->pending());
+  TEST_ASSERT_TRUE(sent.indexOf("pin/fast=on") >= 0);
+
+  queue->acked(2);
+  TEST_ASSERT_EQUAL(1, queue->flush(send));
+  TEST_ASSERT_EQUAL(0, queue->pending());
+}
+
+void test_requeues_unacked_for_a_new_session() {
+  queue->offer("pin/1", "on", 1);
+  queue->flush(send);
+  queue->requeue();
+  TEST_ASSERT_EQUAL(0, queue->inflight());
+  TEST_ASSERT_EQUAL(1, queue->pending());
+
+  virtualMillis += 100;
+  queue->flush(send);
+  TEST_ASSERT_TRUE(sent == "pin/1=on;pin/1=on;");
+  TEST_ASSERT_EQUAL(1, queue->inflight());
+}
+
+int main(int argc, char **argv) {
+  UNITY_BEGIN();
+  RUN_TEST(test_publishes_oldest_first);
+  RUN_TEST(test_keeps_the_latest_value_per_topic);
+  RUN_TEST(test_limits_the_rate_per_topic);
+  RUN_TEST(test_stops_when_the_client_is_full);
+  RUN_TEST(test_overflow_drops_oldest_or_rejects);
+  RUN_TEST(test_tracks_qos1_until_acked);
+  RUN_TEST(test_retransmits_until_acked);
+  RUN_TEST(test_newer_value_supersedes_unacked);
+  RUN_TEST(test_full_window_holds_back_qos1_only);
+  RUN_TEST(test_requeues_unacked_for_a_new_session);
+  return UNITY_END();
+}
@@ -0,0 +1,256 @@
+// Topic routing rules, fan-out, allocation-free dispatch, lookup cost against
+// the std::map it replaced and agents sharing one router.
+
+#include <Allocations.h>
+#include <Arduino.h>
+#include <TopicRouter.h>
+#include <chrono>
+#include <cstdio>
+#include <map>
+#include <unity.h>
+
+TopicRouter *router;
+String hits;
+
+// Handler recording which filter matched
+TopicHandler record(const char *filter) {
+  return [filter](const char *payload, size_t len) {
+    hits += filter;
+    hits += ";";
+  };
+}
+
+void setUp() {
+  router = new TopicRouter();
+  hits = "";
+}
+
+void tearDown() { delete router; }
+
+void test_matches_exact_and_wildcard_filters() {
+  router->add("pin/5", record("pin/5"));
+  router->add("pin/+", record("pin/+"));
+  router->add("pin/#", record("pin/#"));
+  router->add("pin/+/src", record("pin/+/src"));
+  router->add("#", record("#"));
+
+  TEST_ASSERT_EQUAL(4, router->dispatch("pin/5", ""));
+  TEST_ASSERT_TRUE(hits == "pin/5;pin/+;pin/#;#;");
+
+  hits = "";
+  TEST_ASSERT_EQUAL(3, router->dispatch("pin/7/src", ""));
+  TEST_ASSERT_TRUE(hits == "pin/+/src;pin/#;#;");
+
+  // `pin/#` matches its parent level too
+  hits = "";
+  TEST_ASSERT_EQUAL(2, router->dispatch("pin", ""));
+  TEST_ASSERT_TRUE(hits == "pin/#;#;");
+
+  hits = "";
+  TEST_ASSERT_EQUAL(1, router->dispatch("pins/5", ""));
+  TEST_ASSERT_TRUE(hits == "#;");
+}
+
+void test_wildcards_skip_system_topics() {
+  router->add("#", record("#"));
+  router->add("+/broker", record("+/broker"));
+  router->add("$SYS/broker", record("$SYS/broker"));
+
+  TEST_ASSERT_EQUAL(1, router->dispatch("$SYS/broker", ""));
+  TEST_ASSERT_TRUE(hits == "$SYS/broker;");
+}
+
+void test_fans_out_to_every_route_of_a_filter() {
+  auto first = router->add("pin/5", record("first"));
+  auto second = router->add("pin/5", record("second"));
+  router->add("pin/6", record("pin/6"));
+  TEST_ASSERT_TRUE(first != second);
+  TEST_ASSERT_EQUAL(2, router->count("pin/5"));
+
+  TEST_ASSERT_EQUAL(2, router->dispatch("pin/5", ""));
+  TEST_ASSERT_TRUE(hits == "first;second;");
+
+  // Routes are removed one at a time, by id
+  hits = "";
+  TEST_ASSERT_TRUE(router->remove("pin/5", first));
+  TEST_ASSERT_FALSE(router->remove("pin/5", first));
+  TEST_ASSERT_FALSE(router->remove("pin/6", second));
+  TEST_ASSERT_EQUAL(1, router->count("pin/5"));
+  TEST_ASSERT_EQUAL(1, router->dispatch("pin/5", ""));
+  TEST_ASSERT_TRUE(hits == "second;");
+
+  TEST_ASSERT_TRUE(router->remove("pin/5", second));
+  TEST_ASSERT_EQUAL(0, router->count("pin/5"));
+  TEST_ASSERT_EQUAL(0, router->dispatch("pin/5", ""));
+  TEST_ASSERT_EQUAL(1, router->size());
+}
+
+void test_lists_filters_with_routes() {
+  router->add("pin/5", record("pin/5"));
+  router->add("pin/5", record("pin/5"));
+  auto route = router->add("pin/5/src", record("pin/5/src"));
+  router->add("pin/#", record("pin/#"));
+  router->add("param/+", record("param/+"));
+  router->remove("pin/5/src", route);
+
+  router->forEachFilter([](const char *filter) {
+    hits += filter;
+    hits += ";";
+  });
+  TEST_ASSERT_TRUE(hits == "pin/5;pin/#;param/+;" ||
+                   hits == "param/+;pin/5;pin/#;");
+}
+
+void test_removes_routes_even_while_dispatching() {
+  uint32_t second = 0;
+  uint32_t first = router->add("pin/1", [&](const char *payload, size_t len) {
+    router->remove("pin/1", first);
+    router->remove("pin/2", second);
+    router->add("pin/3", record("pin/3"));
+  });
+  second = router->add("pin/2", record("pin/2"));
+  router->add("pin/+", record("pin/+"));
+
+  TEST_ASSERT_EQUAL(2, router->dispatch("pin/1", ""));
+  TEST_ASSERT_EQUAL(1, router->dispatch("pin/2", ""));
+  TEST_ASSERT_EQUAL(2, router->dispatch("pin/3", ""));
+  TEST_ASSERT_EQUAL(2, router->size());
+  TEST_ASSERT_FALSE(router->remove("pin/1", first));
+}
+
+void test_dispatch_does_not_allocate() {
+  for (int i = 0; i < 100; i++) {
+    router->add(("pin/" + String(i)).c_str(),
+                [](const char *payload, size_t len) {});
+    router->add(("pin/" + String(i) + "/src").c_str(),
+                [](const char *payload, size_t len) {});
+  }
+  router->add("pin/#", [](const char *payload, size_t len) {});
+
+  auto before = allocations.load();
+  size_t matched = 0;
+  for (int i = 0; i < 1000; i++) {
+    matched += router->dispatch("pin/42", "true", 4);
+    matched += router->dispatch("pin/42/src", "true", 4);
+    matched += router->dispatch("param/1", "true", 4);
+  }
+
+  TEST_ASSERT_EQUAL(before, allocations.load());
+  TEST_ASSERT_EQUAL(4000, matched);
+}
+
+void test_covers_topics_and_filters() {
+  TEST_ASSERT_TRUE(TopicRouter::covers("pin/#", "pin/5"));
+  TEST_ASSERT_TRUE(TopicRouter::covers("pin/#", "pin/5/src"));
+  TEST_ASSERT_TRUE(TopicRouter::covers("pin/#", "pin"));
+  TEST_ASSERT_TRUE(TopicRouter::covers("pin/#", "pin/+"));
+  TEST_ASSERT_TRUE(TopicRouter::covers("pin/+", "pin/5"));
+  TEST_ASSERT_TRUE(TopicRouter::covers("pin/+", "pin/+"));
+  TEST_ASSERT_FALSE(TopicRouter::covers("pin/+", "pin/5/src"));
+  TEST_ASSERT_FALSE(TopicRouter::covers("pin/+", "pin/#"));
+  TEST_ASSERT_FALSE(TopicRouter::covers("pin/5", "pin/+"));
+  TEST_ASSERT_FALSE(TopicRouter::covers("pin/5", "pin/50"));
+  TEST_ASSERT_FALSE(TopicRouter::covers("#", "$SYS/broker"));
+}
+
+// BENCHMARKS
+void bench(size_t count) {
+  TopicRouter router;
+  std::map<String, TopicHandler> map;
+  unsigned long calls = 0;
+  auto handler = [&calls](const char *payload, size_t len) { calls++; };
+  for (size_t i = 0; i < count; i++) {
+    auto topic = "pin/" + String((unsigned long)i);
+    map.emplace(topic, handler);
+    router.add(topic.c_str(), handler);
+  }
+  const char *topic = "pin/7";
+  String payload("42");
+  const int rounds = 200000;
+
+  // As handle() did it, the key is built from the incoming topic
+  auto start = std::chrono::steady_clock::now();
+  for (int i = 0; i < rounds; i++) {
+    auto it = map.find(String(topic));
+    if (it != map.end()) {
+      it->second(payload.c_str(), payload.length());
+    }
+  }
+  auto mapped = std::chrono::steady_clock::now() - start;
+
+  start = std::chrono::steady_clock::now();
+  for (int i = 0; i < rounds; i++) {
+    router.dispatch(topic, payload.c_str(), payload.length());
+  }
+  auto routed = std::chrono::steady_clock::now() - start;
+
+  char line[128];
+  snprintf(line, sizeof(line), "routes=%-5zu map %7.1f ns  trie %7.1f ns",
+           count,
+           (double)std::chrono::nanoseconds(mapped).count() / rounds,
+           (double)std::chrono::nanoseconds(routed).count() / rounds);
+  TEST_MESSAGE(line);
+  TEST_ASSERT_EQUAL(2 * rounds, calls);
+}
+
+void test_benchmark_lookup() {
+  for (size_t count : {10, 100, 1000}) {
+    bench(count);
+  }
+}
+
+// Agents of one firmware sharing the router, each listening to a pin of
+// its own and to one they all use
+void benchAgents(size_t agents) {
+  TopicRouter router;
+  unsigned long calls = 0;
+  auto handler = [&calls](const char *payload, size_t len) { calls++; };
+  for (size_t i = 0; i < agents; i++) {
+    router.add(("pin/" + String((unsigned long)(100 + i))).c_str(), handler);
+    router.add(("pin/" + String((unsigned long)(100 + i)) + "/src").c_str(),
+               handler);
+    router.add("pin/1", handler);
+  }
+  String payload("42");
+  const int rounds = 100000;
+
+  auto start = std::chrono::steady_clock::now();
+  for (int i = 0; i < rounds; i++) {
+    router.dispatch("pin/100", payload.c_str(), payload.length());
+  }
+  auto own = std::chrono::steady_clock::now() - start;
+
+  start = std::chrono::steady_clock::now();
+  for (int i = 0; i < rounds; i++) {
+    router.dispatch("pin/1", payload.c_str(), payload.length());
+  }
+  auto shared = std::chrono::steady_clock::now() - start;
+
+  char line[128];
+  snprintf(line, sizeof(line), "agents=%-3zu own %7.1f ns  shared %7.1f ns",
+           agents, (double)std::chrono::nanoseconds(own).count() / rounds,
+           (double)std::chrono::nanoseconds(shared).count() / rounds);
+  TEST_MESSAGE(line);
+  TEST_ASSERT_EQUAL(rounds + agents * rounds, calls);
+}
+
+void test_benchmark_agents() {
+  for (size_t agents : {1, 4, 16}) {
+    benchAgents(agents);
+  }
+}
+// BENCHMARKS END
+
+int main(int argc, char **argv) {
+  UNITY_BEGIN();
+  RUN_TEST(test_matches_exact_and_wildcard_filters);
+  RUN_TEST(test_wildcards_skip_system_topics);
+  RUN_TEST(test_fans_out_to_every_route_of_a_filter);
+  RUN_TEST(test_lists_filters_with_routes);
+  RUN_TEST(test_removes_routes_even_while_dispatching);
+  RUN_TEST(test_dispatch_does_not_allocate);
+  RUN_TEST(test_covers_topics_and_filters);
+  RUN_TEST(test_benchmark_lookup);
+  RUN_TEST(test_benchmark_agents);
+  return UNITY_END();
+}
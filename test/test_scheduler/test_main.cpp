@@ -0,0 +1,490 @@
+// Scheduler behaviour on a virtual clock, plus loop cost benchmarks.
+
+#include <Arduino.h>
+#include <CustomTasks.h>
+#include <Tasks.h>
+#include <chrono>
+#include <cstdio>
+#include <unity.h>
+#include <vector>
+
+unsigned long virtualMillis = 0;
+unsigned long virtualClock() { return virtualMillis; }
+
+Tasks::Scope suite;
+std::vector<Tasks::TaskRef *> refs;
+
+void setUp() {
+  virtualMillis = 0;
+  Tasks::setClock(virtualClock);
+  Tasks::resetClassStats();
+  // Schedules on the virtual clock do not depend on how fast the host is,
+  // the budget tests set one of their own
+  Tasks::setPassBudget(ULONG_MAX);
+  suite.renew();
+}
+
+void tearDown() {
+  suite.cancel();
+  for (auto ref : refs) {
+    Tasks::cancel(ref);
+  }
+  refs.clear();
+  Tasks::setPassBudget(TASKS_PASS_BUDGET_US);
+}
+
+// Advances the virtual clock straight to the next deadline after each pass,
+// so hours of schedule take milliseconds. Returns the number of passes.
+unsigned long runFor(unsigned long duration) {
+  auto end = virtualMillis + duration;
+  unsigned long passes = 0;
+  while (virtualMillis < end) {
+    auto left = Tasks::loop();
+    passes++;
+    virtualMillis += std::max(1UL, std::min(left, end - virtualMillis));
+  }
+  return passes;
+}
+
+void test_interval_fires_on_schedule_for_hours() {
+  unsigned long fired = 0;
+  unsigned long lateness = 0;
+  refs.push_back(Tasks::setInterval(
+      [&]() {
+        lateness = std::max(lateness, virtualMillis - fired * 1000);
+        fired++;
+      },
+      1000));
+
+  auto passes = runFor(3 * 60 * 60 * 1000UL);
+
+  TEST_ASSERT_EQUAL(3 * 60 * 60, fired);
+  TEST_ASSERT_EQUAL(0, lateness);
+  // Parked between firings, one pass per deadline
+  TEST_ASSERT_EQUAL(3 * 60 * 60, passes);
+}
+
+void test_timeout_fires_once_at_deadline() {
+  unsigned long fired_at = 0;
+  int fired = 0;
+  Tasks::setTimeout(
+      [&]() {
+        fired_at = virtualMillis;
+        fired++;
+      },
+      2500);
+
+  runFor(10000);
+
+  TEST_ASSERT_EQUAL(1, fired);
+  TEST_ASSERT_EQUAL(2500, fired_at);
+  TEST_ASSERT_EQUAL(0, Tasks::poolStats().used);
+}
+
+void test_cancelled_scope_drops_parked_tasks() {
+  Tasks::Scope child(&suite);
+  int fired = 0;
+  for (int i = 0; i < 10; i++) {
+    Tasks::spawn(Tasks::dependent(child, Tasks::timed(1000, [&]() {
+                                    fired++;
+                                    return false;
+                                  })));
+  }
+  runFor(500);
+  TEST_ASSERT_EQUAL(10, Tasks::poolStats().used);
+
+  suite.cancel();
+
+  TEST_ASSERT_EQUAL(0, Tasks::poolStats().used);
+  TEST_ASSERT_EQUAL(Tasks::NO_DEADLINE, Tasks::loop());
+  TEST_ASSERT_FALSE(child.isActive());
+}
+
+void test_signalled_scope_cancels_on_apply() {
+  Tasks::Scope link(&suite, false);
+  Tasks::ScopeSignal signal(link);
+  signal.renew();
+  TEST_ASSERT_FALSE(link.isActive());
+  signal.apply();
+  TEST_ASSERT_TRUE(link.isActive());
+
+  int polls = 0;
+  int fired = 0;
+  // Parked until a deadline that is never reached
+  auto spawnSleeper = [&]() {
+    auto step = Tasks::timed(
+        1000,
+        [&]() {
+          fired++;
+          return false;
+        },
+        false);
+    Tasks::spawn(Tasks::dependent(link, step));
+  };
+  for (int i = 0; i < 5; i++) {
+    Tasks::spawn(Tasks::dependent(link, Tasks::poll([&]() {
+                                    polls++;
+                                    return false;
+                                  })));
+    spawnSleeper();
+  }
+  Tasks::spawn(Tasks::poll([&]() { return signal.apply(); }), &suite);
+  runFor(500);
+  TEST_ASSERT_EQUAL(11, Tasks::poolStats().used);
+
+  // As from another thread, nothing is touched until the scheduler applies
+  // it, with the timers still parked
+  signal.cancel();
+  TEST_ASSERT_TRUE(link.isActive());
+  TEST_ASSERT_EQUAL(11, Tasks::poolStats().used);
+  Tasks::loop();
+  TEST_ASSERT_FALSE(link.isActive());
+  TEST_ASSERT_EQUAL(1, Tasks::poolStats().used);
+  auto before = polls;
+  runFor(5000);
+  TEST_ASSERT_EQUAL(0, fired);
+  TEST_ASSERT_EQUAL(before, polls);
+
+  // Cancelled scopes take no tasks until renewed
+  spawnSleeper();
+  TEST_ASSERT_EQUAL(1, Tasks::poolStats().used);
+  signal.renew();
+  Tasks::loop();
+  spawnSleeper();
+  TEST_ASSERT_EQUAL(2, Tasks::poolStats().used);
+
+  // A drop and a reconnect in between two passes still drop the tasks of
+  // the first connection
+  signal.cancel();
+  signal.renew();
+  Tasks::loop();
+  TEST_ASSERT_TRUE(link.isActive());
+  TEST_ASSERT_EQUAL(1, Tasks::poolStats().used);
+
+  // A renew never outlives the parent scope being cancelled meanwhile
+  suite.cancel();
+  Tasks::loop();
+  TEST_ASSERT_FALSE(link.isActive());
+  TEST_ASSERT_EQUAL(0, Tasks::poolStats().used);
+}
+
+void test_sequence_stops_at_the_failing_step() {
+  String steps;
+  auto composed = Tasks::then(
+      Tasks::sequence(Tasks::once([&]() { steps += "a"; }),
+                      Tasks::once([&]() {
+                        steps += "b";
+                        return Tasks::Status::Failed;
+                      }),
+                      Tasks::once([&]() { steps += "c"; })),
+      [&]() { steps += "!"; });
+  Tasks::spawn(composed, &suite);
+  runFor(100);
+
+  // Neither the steps after it nor the dispatch of the sequence run
+  TEST_ASSERT_EQUAL_STRING("ab", steps.c_str());
+  TEST_ASSERT_EQUAL(0, Tasks::poolStats().used);
+
+  steps = "";
+  auto passing = Tasks::sequence(Tasks::once([&]() { steps += "a"; }),
+                                 Tasks::once([&]() { steps += "b"; }));
+  Tasks::spawn(Tasks::then(passing, [&]() { steps += "!"; }), &suite);
+  runFor(100);
+  TEST_ASSERT_EQUAL_STRING("ab!", steps.c_str());
+}
+
+void test_race_drops_the_losing_branches() {
+  int slowChecks = 0;
+  String dispatched;
+  auto slow = Tasks::then(Tasks::poll([&]() {
+                            slowChecks++;
+                            return false;
+                          }),
+                          [&]() { dispatched += "slow"; });
+  auto fast = Tasks::then(Tasks::timed(300, []() { return true; }, false),
+                          [&]() { dispatched += "fast"; });
+  Tasks::spawn(Tasks::race(slow, fast), &suite);
+  runFor(1000);
+
+  // Only the winner is dispatched, the other branch is not checked again
+  TEST_ASSERT_EQUAL_STRING("fast", dispatched.c_str());
+  TEST_ASSERT_EQUAL(0, Tasks::poolStats().used);
+  auto checks = slowChecks;
+  runFor(1000);
+  TEST_ASSERT_EQUAL(checks, slowChecks);
+
+  // A failed branch leaves the others racing, the race only fails once they
+  // all did
+  int fails = 0;
+  int finished = 0;
+  auto failing = [&]() {
+    fails++;
+    return Tasks::Status::Failed;
+  };
+  Tasks::spawn(Tasks::then(Tasks::race(Tasks::poll(failing),
+                                       Tasks::timed(200, []() { return true; },
+                                                    false)),
+                           [&]() { finished++; }),
+               &suite);
+  runFor(1000);
+  TEST_ASSERT_EQUAL(1, fails);
+  TEST_ASSERT_EQUAL(1, finished);
+
+  Tasks::spawn(Tasks::then(Tasks::race(Tasks::poll(failing),
+                                       Tasks::poll(failing)),
+                           [&]() { finished++; }),
+               &suite);
+  runFor(100);
+  TEST_ASSERT_EQUAL(3, fails);
+  TEST_ASSERT_EQUAL(1, finished);
+  TEST_ASSERT_EQUAL(0, Tasks::poolStats().used);
+}
+
+void test_retry_runs_the_step_attempts_times() {
+  int runs = 0;
+  int finished = 0;
+  auto failing = [&]() {
+    runs++;
+    return Tasks::Status::Failed;
+  };
+  Tasks::spawn(Tasks::then(Tasks::retry(3, Tasks::poll(failing)),
+                           [&]() { finished++; }),
+               &suite);
+  runFor(100);
+  TEST_ASSERT_EQUAL(3, runs);
+  TEST_ASSERT_EQUAL(0, finished);
+
+  // Still runs once, instead of wrapping the count around
+  runs = 0;
+  Tasks::spawn(Tasks::retry(0, Tasks::poll(failing)), &suite);
+  runFor(100);
+  TEST_ASSERT_EQUAL(1, runs);
+
+  // Succeeding on the second run, the step is initialized again for it
+  runs = 0;
+  int inits = 0;
+  auto flaky = Tasks::sequence(Tasks::once([&]() { inits++; }),
+                               Tasks::poll([&]() {
+                                 return ++runs < 2 ? Tasks::Status::Failed
+                                                   : Tasks::Status::Done;
+                               }));
+  Tasks::spawn(Tasks::then(Tasks::retry(5, flaky), [&]() { finished++; }),
+               &suite);
+  runFor(100);
+  TEST_ASSERT_EQUAL(2, runs);
+  TEST_ASSERT_EQUAL(2, inits);
+  TEST_ASSERT_EQUAL(1, finished);
+  TEST_ASSERT_EQUAL(0, Tasks::poolStats().used);
+}
+
+void busyWait(unsigned long us) {
+  auto start = micros();
+  while (micros() - start < us) {
+  }
+}
+
+void test_budget_defers_lower_classes_fairly() {
+  Tasks::setPassBudget(1000);
+  int realtime = 0;
+  int background = 0;
+  int io[5] = {};
+  for (auto &checks : io) {
+    Tasks::spawn(Tasks::poll([&checks]() {
+                   checks++;
+                   busyWait(600);
+                   return false;
+                 }),
+                 &suite);
+  }
+  auto sampler = Tasks::spawn(Tasks::poll([&]() {
+                                realtime++;
+                                return false;
+                              }),
+                              &suite);
+  Tasks::prioritize(sampler, Tasks::Priority::Realtime);
+  auto housekeeping = Tasks::spawn(Tasks::poll([&]() {
+                                     background++;
+                                     return false;
+                                   }),
+                                   &suite);
+  Tasks::prioritize(housekeeping, Tasks::Priority::Background);
+
+  for (int i = 0; i < 10; i++) {
+    Tasks::loop();
+  }
+
+  // At most two I/O checks fit in a pass, fewer when the host is slow, and
+  // they take turns across passes. The background class still has its one.
+  TEST_ASSERT_EQUAL(10, realtime);
+  TEST_ASSERT_EQUAL(10, background);
+  int fewest = io[0];
+  int most = io[0];
+  for (auto checks : io) {
+    fewest = std::min(fewest, checks);
+    most = std::max(most, checks);
+  }
+  TEST_ASSERT_GREATER_OR_EQUAL(2, fewest);
+  TEST_ASSERT_LESS_OR_EQUAL(4, most);
+  TEST_ASSERT_LESS_OR_EQUAL(1, most - fewest);
+  TEST_ASSERT_EQUAL(10, Tasks::classStats(Tasks::Priority::Io).deferred);
+  TEST_ASSERT_EQUAL(0, Tasks::classStats(Tasks::Priority::Background).deferred);
+}
+
+void test_lower_classes_progress_under_saturated_realtime() {
+  int realtime = 0;
+  int io[2] = {};
+  for (auto &checks : io) {
+    Tasks::spawn(Tasks::poll([&checks]() {
+                   checks++;
+                   return false;
+                 }),
+                 &suite);
+  }
+  auto sampler = Tasks::spawn(Tasks::poll([&]() {
+                                realtime++;
+                                return false;
+                              }),
+                              &suite);
+  Tasks::prioritize(sampler, Tasks::Priority::Realtime);
+  int fired = 0;
+  unsigned long lateness = 0;
+  refs.push_back(Tasks::setInterval(
+      [&]() {
+        lateness = std::max(lateness, virtualMillis - fired * 100);
+        fired++;
+      },
+      100));
+  Tasks::prioritize(refs.back(), Tasks::Priority::Background);
+
+  // Realtime work took the whole pass every time
+  Tasks::setPassBudget(0);
+  auto passes = runFor(1000);
+
+  // One check of each class per pass, the I/O tasks taking turns
+  TEST_ASSERT_EQUAL(passes, realtime);
+  TEST_ASSERT_EQUAL(passes, io[0] + io[1]);
+  TEST_ASSERT_LESS_OR_EQUAL(1, std::abs(io[0] - io[1]));
+  TEST_ASSERT_EQUAL(10, fired);
+  TEST_ASSERT_EQUAL(0, lateness);
+}
+
+void test_counts_deadline_misses_per_class() {
+  int fired = 0;
+  refs.push_back(Tasks::setTimeout([&]() { fired++; }, 10));
+  Tasks::prioritize(refs.back(), Tasks::Priority::Realtime);
+  refs.push_back(Tasks::setTimeout([&]() { fired++; }, 10));
+  Tasks::prioritize(refs.back(), Tasks::Priority::Background);
+  // An I/O check that takes 15 ms once the timeouts are due
+  Tasks::spawn(Tasks::poll([]() {
+                 if (virtualMillis == 10) {
+                   virtualMillis += 15;
+                 }
+                 return false;
+               }),
+               &suite);
+  runFor(10);
+  TEST_ASSERT_EQUAL(0, fired);
+
+  Tasks::loop();
+  TEST_ASSERT_EQUAL(2, fired);
+  refs.clear();
+
+  auto &late = Tasks::classStats(Tasks::Priority::Background);
+  TEST_ASSERT_EQUAL(1, late.misses);
+  TEST_ASSERT_EQUAL(15, late.max_late_ms);
+  TEST_ASSERT_EQUAL(0, Tasks::classStats(Tasks::Priority::Realtime).misses);
+}
+
+// BENCHMARKS
+enum class Kind { Timeouts, Intervals, Dependent };
+
+const char *kindName(Kind kind) {
+  switch (kind) {
+  case Kind::Timeouts:
+    return "timeouts";
+  case Kind::Intervals:
+    return "intervals";
+  default:
+    return "dependent";
+  }
+}
+
+unsigned long firings = 0;
+
+// Deadlines spread over 1 to 10 s, all of them within the benchmark
+void populate(Kind kind, size_t count) {
+  for (size_t i = 0; i < count; i++) {
+    unsigned long period = 1000 + (i * 37) % 9000;
+    switch (kind) {
+    case Kind::Timeouts:
+      Tasks::setTimeout([]() { firings++; }, period);
+      break;
+    case Kind::Intervals:
+      refs.push_back(Tasks::setInterval([]() { firings++; }, period, false));
+      break;
+    case Kind::Dependent:
+      Tasks::spawn(Tasks::dependent(suite, Tasks::timed(period, []() {
+                                      firings++;
+                                      return false;
+                                    })));
+      break;
+    }
+  }
+}
+
+void bench(Kind kind, size_t count) {
+  // Raw loop cost, nothing is deferred however long a pass takes
+  setUp();
+  firings = 0;
+  populate(kind, count);
+  Tasks::loop();
+
+  const unsigned long passes = 20000;
+  auto start = std::chrono::steady_clock::now();
+  for (unsigned long i = 0; i < passes; i++) {
+    virtualMillis++;
+    Tasks::loop();
+  }
+  auto elapsed = std::chrono::duration_cast<std::chrono::nanoseconds>(
+                     std::chrono::steady_clock::now() - start)
+                     .count();
+
+  char line[128];
+  snprintf(line, sizeof(line), "%-10s n=%-6zu %9.1f ns/pass  firings=%-6lu",
+           kindName(kind), count, (double)elapsed / passes, firings);
+  TEST_MESSAGE(line);
+
+  // Every timeout fired once, and every timer at least once
+  if (kind == Kind::Timeouts) {
+    TEST_ASSERT_EQUAL(count, firings);
+  } else {
+    TEST_ASSERT_GREATER_OR_EQUAL(count, firings);
+  }
+  TEST_ASSERT_EQUAL(0, Tasks::poolStats().exhausted);
+  tearDown();
+}
+
+void test_benchmark_loop_cost() {
+  for (auto kind : {Kind::Timeouts, Kind::Intervals, Kind::Dependent}) {
+    for (size_t count : {10, 100, 1000, 10000}) {
+      bench(kind, count);
+    }
+  }
+}
+// BENCHMARKS END
+
+int main(int argc, char **argv) {
+  UNITY_BEGIN();
+  RUN_TEST(test_interval_fires_on_schedule_for_hours);
+  RUN_TEST(test_timeout_fires_once_at_deadline);
+  RUN_TEST(test_cancelled_scope_drops_parked_tasks);
+  RUN_TEST(test_signalled_scope_cancels_on_apply);
+  RUN_TEST(test_sequence_stops_at_the_failing_step);
+  RUN_TEST(test_race_drops_the_losing_branches);
+  RUN_TEST(test_retry_runs_the_step_attempts_times);
+  RUN_TEST(test_budget_defers_lower_classes_fairly);
+  RUN_TEST(test_lower_classes_progress_under_saturated_realtime);
+  RUN_TEST(test_counts_deadline_misses_per_class);
+  RUN_TEST(test_benchmark_loop_cost);
+  return UNITY_END();
+}
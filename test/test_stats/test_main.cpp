@@ -0,0 +1,95 @@
+// Scheduler instrumentation, built with TASKS_STATS for this suite only.
+
+#define TASKS_STATS
+
+#include <Arduino.h>
+#include <CustomTasks.h>
+#include <Tasks.h>
+#include <string>
+#include <unity.h>
+
+unsigned long virtualMillis = 0;
+unsigned long virtualClock() { return virtualMillis; }
+
+class StringPrint : public Print {
+public:
+  std::string out;
+
+  virtual size_t write(const uint8_t *buf, size_t len) override {
+    out.append((const char *)buf, len);
+    return len;
+  }
+};
+
+const Tasks::TaskStats *find(const char *name) {
+  size_t count;
+  auto slots = Tasks::Stats::tasks(count);
+  for (size_t i = 0; i < count; i++) {
+    if (strcmp(slots[i].name, name) == 0) {
+      return &slots[i];
+    }
+  }
+  return nullptr;
+}
+
+void setUp() {
+  virtualMillis = 0;
+  Tasks::setClock(virtualClock);
+  Tasks::Stats::reset();
+}
+
+void tearDown() {}
+
+void test_counts_phases_per_name() {
+  for (int i = 0; i < 2; i++) {
+    Tasks::name(Tasks::spawn(Tasks::poll(
+                    [checks = 0]() mutable { return ++checks == 3; })),
+                "poller");
+  }
+  for (int i = 0; i < 5; i++) {
+    Tasks::loop();
+  }
+
+  auto stats = find("poller");
+  TEST_ASSERT_NOT_NULL(stats);
+  TEST_ASSERT_EQUAL(2, stats->count[(size_t)Tasks::Phase::Setup]);
+  TEST_ASSERT_EQUAL(6, stats->count[(size_t)Tasks::Phase::Check]);
+  TEST_ASSERT_EQUAL(2, stats->count[(size_t)Tasks::Phase::Finish]);
+  TEST_ASSERT_EQUAL(5, Tasks::Stats::loops().loops);
+}
+
+void test_counts_checks_over_budget() {
+  Tasks::Stats::setBudget(100);
+  Tasks::name(Tasks::spawn(Tasks::once([]() {
+                auto start = micros();
+                while (micros() - start < 500) {
+                }
+              })),
+              "blocking");
+  Tasks::loop();
+
+  TEST_ASSERT_EQUAL(1, find("blocking")->overruns);
+  TEST_ASSERT_EQUAL(1, Tasks::Stats::loops().overruns);
+  Tasks::Stats::setBudget(TASKS_STATS_BUDGET_US);
+}
+
+void test_dumps_compact_json() {
+  Tasks::name(Tasks::spawn(Tasks::once([]() {})), "dumped");
+  Tasks::loop();
+
+  StringPrint out;
+  Tasks::Stats::dump(out);
+
+  TEST_ASSERT_EQUAL(0, out.out.find("{\"loops\":1,"));
+  TEST_ASSERT_TRUE(out.out.find("\"dumped\":{\"setup\":[1,") !=
+                   std::string::npos);
+  TEST_ASSERT_EQUAL('}', out.out.back());
+}
+
+int main(int argc, char **argv) {
+  UNITY_BEGIN();
+  RUN_TEST(test_counts_phases_per_name);
+  RUN_TEST(test_counts_checks_over_budget);
+  RUN_TEST(test_dumps_compact_json);
+  return UNITY_END();
+}
@@ -0,0 +1,182 @@
+// Decoding values as their slot declares and encoding them back, and the cost
+// of both against parsing and formatting a String on every update.
+
+#include <Arduino.h>
+#include <Value.h>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <unity.h>
+
+const char *const modes[] = {"off", "change", "period"};
+
+Value decode(const ValueSpec &spec, const char *text) {
+  Value value;
+  decodeValue(spec, text, strlen(text), value);
+  return value;
+}
+
+String encode(const ValueSpec &spec, const Value &value) {
+  char text[VALUE_TEXT_SIZE];
+  return encodeValue(spec, value, text, sizeof(text)) ? String(text) : "-";
+}
+
+void setUp() {}
+
+void tearDown() {}
+
+void test_decodes_booleans() {
+  TEST_ASSERT_TRUE(decode(boolValue(), "true").asBool());
+  TEST_ASSERT_TRUE(decode(boolValue(), "TRUE").asBool());
+  TEST_ASSERT_TRUE(decode(boolValue(), "1").asBool());
+  TEST_ASSERT_FALSE(decode(boolValue(), "false").asBool());
+  // Anything else is false, as trueStr.equalsIgnoreCase() had it
+  TEST_ASSERT_FALSE(decode(boolValue(), "").asBool());
+  TEST_ASSERT_FALSE(decode(boolValue(), "truest").asBool());
+  TEST_ASSERT_TRUE(decode(boolValue(), "yes").isSet());
+}
+
+void test_decodes_integers_within_bounds() {
+  TEST_ASSERT_EQUAL(42, decode(intValue(), "42").asInt());
+  TEST_ASSERT_EQUAL(-7, decode(intValue(), "-7").asInt());
+  TEST_ASSERT_EQUAL(100, decode(intValue(0, 100), "250").asInt());
+  TEST_ASSERT_EQUAL(0, decode(intValue(0, 100), "-3").asInt());
+  // The fraction is cut off
+  TEST_ASSERT_EQUAL(55, decode(intValue(), "55.7").asInt());
+  TEST_ASSERT_EQUAL(INT32_MAX,
+                    decode(intValue(), "99999999999999999999").asInt());
+  TEST_ASSERT_EQUAL(INT32_MIN, decode(intValue(), "-2147483648").asInt());
+}
+
+void test_rejects_malformed_numbers() {
+  TEST_ASSERT_FALSE(decode(intValue(), "").isSet());
+  TEST_ASSERT_FALSE(decode(intValue(), "-").isSet());
+  TEST_ASSERT_FALSE(decode(intValue(), "abc").isSet());
+  TEST_ASSERT_FALSE(decode(intValue(), "12px").isSet());
+  TEST_ASSERT_FALSE(decode(intValue(), "1e3").isSet());
+  TEST_ASSERT_FALSE(decode(intValue(), "null").isSet());
+}
+
+void test_decodes_fixed_point() {
+  auto spec = fixedValue(2, -1000, 10000);
+  TEST_ASSERT_EQUAL(1250, decode(spec, "12.5").asInt());
+  TEST_ASSERT_EQUAL(1234, decode(spec, "12.345").asInt());
+  TEST_ASSERT_EQUAL(50, decode(spec, ".5").asInt());
+  TEST_ASSERT_EQUAL(-5, decode(spec, "-0.05").asInt());
+  TEST_ASSERT_EQUAL(700, decode(spec, "7").asInt());
+  TEST_ASSERT_EQUAL(10000, decode(spec, "1000").asInt());
+  TEST_ASSERT_FALSE(decode(spec, ".").isSet());
+}
+
+void test_decodes_enums_by_name() {
+  auto spec = enumValue(modes);
+  TEST_ASSERT_EQUAL(2, spec.max);
+  TEST_ASSERT_EQUAL(1, decode(spec, "change").asEnum());
+  TEST_ASSERT_EQUAL(ValueType::Enum, decode(spec, "off").type);
+  TEST_ASSERT_FALSE(decode(spec, "chang").isSet());
+  TEST_ASSERT_FALSE(decode(spec, "1").isSet());
+}
+
+void test_encodes_values() {
+  TEST_ASSERT_EQUAL_STRING("true",
+                           encode(boolValue(), Value::ofBool(true)).c_str());
+  TEST_ASSERT_EQUAL_STRING("false",
+                           encode(boolValue(), Value::ofBool(false)).c_str());
+  TEST_ASSERT_EQUAL_STRING("0", encode(intValue(), Value::ofInt(0)).c_str());
+  TEST_ASSERT_EQUAL_STRING("-42",
+                           encode(intValue(), Value::ofInt(-42)).c_str());
+  TEST_ASSERT_EQUAL_STRING(
+      "-2147483648", encode(intValue(), Value::ofInt(INT32_MIN)).c_str());
+  TEST_ASSERT_EQUAL_STRING(
+      "12.50", encode(fixedValue(2), Value::ofFixed(1250)).c_str());
+  TEST_ASSERT_EQUAL_STRING("-0.05",
+                           encode(fixedValue(2), Value::ofFixed(-5)).c_str());
+  TEST_ASSERT_EQUAL_STRING(
+      "-21.47483648",
+      encode(fixedValue(8), Value::ofFixed(INT32_MIN)).c_str());
+  TEST_ASSERT_EQUAL_STRING("period",
+                           encode(enumValue(modes), Value::ofEnum(2)).c_str());
+  TEST_ASSERT_EQUAL_STRING("-",
+                           encode(enumValue(modes), Value::ofEnum(3)).c_str());
+}
+
+void test_encoding_checks_the_type() {
+  TEST_ASSERT_EQUAL_STRING("-", encode(boolValue(), Value::ofInt(1)).c_str());
+  TEST_ASSERT_EQUAL_STRING("-",
+                           encode(intValue(), Value::ofFixed(1250)).c_str());
+  TEST_ASSERT_EQUAL_STRING("-", encode(fixedValue(2), Value()).c_str());
+  TEST_ASSERT_EQUAL_STRING("-",
+                           encode(enumValue(modes), Value::ofInt(0)).c_str());
+}
+
+void test_encoding_respects_the_buffer() {
+  char text[4];
+  TEST_ASSERT_EQUAL(3, encodeValue(intValue(), Value::ofInt(123), text,
+                                   sizeof(text)));
+  TEST_ASSERT_EQUAL_STRING("123", text);
+  TEST_ASSERT_EQUAL(0, encodeValue(intValue(), Value::ofInt(1234), text,
+                                   sizeof(text)));
+  TEST_ASSERT_EQUAL(0, encodeValue(boolValue(), Value::ofBool(false), text,
+                                   sizeof(text)));
+}
+
+void test_round_trips() {
+  auto spec = fixedValue(3);
+  for (int32_t raw : {0, 1, -1, 999, 1000, -123456, INT32_MAX, INT32_MIN}) {
+    char text[VALUE_TEXT_SIZE];
+    auto len = encodeValue(spec, Value::ofFixed(raw), text, sizeof(text));
+    Value value;
+    TEST_ASSERT_TRUE(decodeValue(spec, text, len, value));
+    TEST_ASSERT_EQUAL(raw, value.asInt());
+  }
+}
+
+// BENCHMARKS
+void test_benchmark_values() {
+  const int rounds = 500000;
+  String payload("73");
+  long sum = 0;
+
+  // What a handler and an output did before, per update
+  auto start = std::chrono::steady_clock::now();
+  for (int i = 0; i < rounds; i++) {
+    auto value = payload.toInt();
+    auto text = String((int)value + i % 2);
+    sum += text.length();
+  }
+  auto stringTime = std::chrono::steady_clock::now() - start;
+
+  auto spec = intValue(0, 100);
+  start = std::chrono::steady_clock::now();
+  for (int i = 0; i < rounds; i++) {
+    Value value;
+    decodeValue(spec, payload.c_str(), payload.length(), value);
+    char text[VALUE_TEXT_SIZE];
+    sum -= encodeValue(spec, Value::ofInt(value.asInt() + i % 2), text,
+                       sizeof(text));
+  }
+  auto valueTime = std::chrono::steady_clock::now() - start;
+
+  char line[128];
+  snprintf(line, sizeof(line), "parse+format String %6.1f ns  value %6.1f ns",
+           (double)std::chrono::nanoseconds(stringTime).count() / rounds,
+           (double)std::chrono::nanoseconds(valueTime).count() / rounds);
+  TEST_MESSAGE(line);
+  TEST_ASSERT_EQUAL(0, sum);
+}
+// BENCHMARKS END
+
+int main(int argc, char **argv) {
+  UNITY_BEGIN();
+  RUN_TEST(test_decodes_booleans);
+  RUN_TEST(test_decodes_integers_within_bounds);
+  RUN_TEST(test_rejects_malformed_numbers);
+  RUN_TEST(test_decodes_fixed_point);
+  RUN_TEST(test_decodes_enums_by_name);
+  RUN_TEST(test_encodes_values);
+  RUN_TEST(test_encoding_checks_the_type);
+  RUN_TEST(test_encoding_respects_the_buffer);
+  RUN_TEST(test_round_trips);
+  RUN_TEST(test_benchmark_values);
+  return UNITY_END();
+}